@@ -31,12 +31,16 @@
 #include "edify/expr.h"
 
 static int SaveFileContents(const char* filename, FileContents file);
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int keep_data);
 int ParseSha1(const char* str, uint8_t* digest);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 
 static int mtd_partitions_scanned = 0;
 
+// Chunk size for hashing files and partitions without loading them.
+#define HASH_BUFFER_SIZE (256*1024)
+
 // Read a file into memory; store it and its associated metadata in
 // *file.  Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file) {
@@ -46,7 +50,7 @@ int LoadFileContents(const char* filename, FileContents* file) {
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, 1);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -79,6 +83,54 @@ int LoadFileContents(const char* filename, FileContents* file) {
     return 0;
 }
 
+// Like LoadFileContents(), but only compute file->sha1, file->size and
+// file->st, reading the file (or partition) in chunks instead of
+// holding it all in memory.  file->data is set to NULL.  Return 0 on
+// success.
+int HashFileContents(const char* filename, FileContents* file) {
+    file->data = NULL;
+
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        return LoadPartitionContents(filename, file, 0);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &file->st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    file->size = file->st.st_size;
+
+    unsigned char* buffer = malloc(HASH_BUFFER_SIZE);
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    ssize_t so_far = 0;
+    while (so_far < file->size) {
+        ssize_t n = read(fd, buffer, HASH_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("short read of \"%s\" (%ld bytes of %ld)\n",
+                   filename, (long)so_far, (long)file->size);
+            free(buffer);
+            close(fd);
+            return -1;
+        }
+        SHA_update(&ctx, buffer, n);
+        so_far += n;
+    }
+    free(buffer);
+    close(fd);
+
+    memcpy(file->sha1, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -114,11 +166,21 @@ void FreeFileContents(FileContents* file) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If keep_data is zero the contents are only hashed, in chunks, and
+// file->data is left NULL; file->size and file->sha1 still describe
+// the matched prefix.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int keep_data) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
+    int result = -1;
+    int* index = NULL;
+    size_t* size = NULL;
+    char** sha1sum = NULL;
+    unsigned char* buffer = NULL;
 
     enum PartitionType type;
 
@@ -129,7 +191,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     } else {
         printf("LoadPartitionContents called with bad filename (%s)\n",
                filename);
-        return -1;
+        goto done;
     }
     const char* partition = strtok(NULL, ":");
 
@@ -143,19 +205,20 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     if (colons < 3 || colons%2 == 0) {
         printf("LoadPartitionContents called with bad filename (%s)\n",
                filename);
+        goto done;
     }
 
     int pairs = (colons-1)/2;     // # of (size,sha1) pairs in filename
-    int* index = malloc(pairs * sizeof(int));
-    size_t* size = malloc(pairs * sizeof(size_t));
-    char** sha1sum = malloc(pairs * sizeof(char*));
+    index = malloc(pairs * sizeof(int));
+    size = malloc(pairs * sizeof(size_t));
+    sha1sum = malloc(pairs * sizeof(char*));
 
     for (i = 0; i < pairs; ++i) {
         const char* size_str = strtok(NULL, ":");
         size[i] = strtol(size_str, NULL, 10);
         if (size[i] == 0) {
             printf("LoadPartitionContents called with bad size (%s)\n", filename);
-            return -1;
+            goto done;
         }
         sha1sum[i] = strtok(NULL, ":");
         index[i] = i;
@@ -180,14 +243,14 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found (loading %s)\n",
                        partition, filename);
-                return -1;
+                goto done;
             }
 
             ctx = mtd_read_partition(mtd);
             if (ctx == NULL) {
                 printf("failed to initialize read of mtd partition \"%s\"\n",
                        partition);
-                return -1;
+                goto done;
             }
             break;
 
@@ -196,7 +259,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             if (dev == NULL) {
                 printf("failed to open emmc partition \"%s\": %s\n",
                        partition, strerror(errno));
-                return -1;
+                goto done;
             }
     }
 
@@ -204,9 +267,13 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
-    char* p = (char*)file->data;
+    if (keep_data) {
+        // allocate enough memory to hold the largest size.
+        file->data = malloc(size[index[pairs-1]]);
+    } else {
+        // only the hash is wanted; stream the data through a buffer.
+        buffer = malloc(HASH_BUFFER_SIZE);
+    }
     file->size = 0;                // # bytes read so far
 
     for (i = 0; i < pairs; ++i) {
@@ -214,26 +281,34 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         // (again, we're trying the possibilities in order of increasing
         // size).
         size_t next = size[index[i]] - file->size;
-        size_t read = 0;
-        if (next > 0) {
+        while (next > 0) {
+            unsigned char* p = keep_data ? file->data + file->size : buffer;
+            size_t want = keep_data || next < HASH_BUFFER_SIZE ?
+                next : HASH_BUFFER_SIZE;
+            size_t read = 0;
             switch (type) {
                 case MTD:
-                    read = mtd_read_data(ctx, p, next);
+                    read = mtd_read_data(ctx, (char*)p, want);
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    read = fread(p, 1, want, dev);
                     break;
             }
-            if (next != read) {
+            if (want != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
-                       read, next, partition);
-                free(file->data);
-                file->data = NULL;
-                return -1;
+                       (int)read, (int)want, partition);
+                break;
             }
             SHA_update(&sha_ctx, p, read);
             file->size += read;
+            next -= read;
+        }
+        if (next > 0) {
+            // The partition is shorter than this candidate, so it
+            // can't match this or any of the larger ones.
+            i = pairs;
+            break;
         }
 
         // Duplicate the SHA context and finalize the duplicate so we can
@@ -245,20 +320,17 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
-            return -1;
+            i = pairs;
+            break;
         }
 
         if (memcmp(sha_so_far, parsed_sha, SHA_DIGEST_SIZE) == 0) {
             // we have a match.  stop reading the partition; we'll return
             // the data we've read so far.
             printf("partition read matched size %d sha %s\n",
-                   size[index[i]], sha1sum[index[i]]);
+                   (int)size[index[i]], sha1sum[index[i]]);
             break;
         }
-
-        p += read;
     }
 
     switch (type) {
@@ -279,7 +351,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                partition, filename);
         free(file->data);
         file->data = NULL;
-        return -1;
+        goto done;
     }
 
     const uint8_t* sha_final = SHA_final(&sha_ctx);
@@ -291,13 +363,15 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     file->st.st_mode = 0644;
     file->st.st_uid = 0;
     file->st.st_gid = 0;
+    result = 0;
 
+  done:
     free(copy);
     free(index);
     free(size);
     free(sha1sum);
-
-    return 0;
+    free(buffer);
+    return result;
 }
 
 
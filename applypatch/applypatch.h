@@ -64,6 +64,10 @@ int applypatch_check(const char* filename,
 int LoadFileContents(const char* filename, FileContents* file);
 void FreeFileContents(FileContents* file);
 
+// Like LoadFileContents(), but only fill in the sha1, size and stat
+// info, hashing the file as it is read; file->data is left NULL.
+int HashFileContents(const char* filename, FileContents* file);
+
 // bsdiff.c
 void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
@@ -80,5 +84,8 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
 
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
+// Like MakeFreeSpaceOnCache, but with dry_run set only reports which
+// files would be deleted.
+int PlanFreeSpaceOnCache(size_t bytes_needed, int dry_run);
 
 #endif
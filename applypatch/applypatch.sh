@@ -151,6 +151,14 @@ run_command $WORK_DIR/applypatch -c $WORK_DIR/old.file $BAD1_SHA1 $OLD_SHA1 $BAD
 testname "check mode cache (missing) failure"
 run_command $WORK_DIR/applypatch -c $WORK_DIR/old.file $BAD2_SHA1 $BAD1_SHA1 && fail
 
+# a partition spec needs at least one size:sha1 pair; a bare one must
+# be rejected cleanly rather than read with no sizes to go by.
+testname "check mode bare partition spec"
+run_command $WORK_DIR/applypatch -c MTD:$WORK_FS $BAD1_SHA1
+[ $? == 1 ] || fail
+run_command $WORK_DIR/applypatch -c EMMC:/dev/null $BAD1_SHA1
+[ $? == 1 ] || fail
+
 
 # --------------- apply patch ----------------------
 
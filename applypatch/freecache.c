@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,7 +12,61 @@
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+typedef struct {
+  char* path;
+  size_t bytes;     // what deleting it gives back (0 if it has other links)
+} Candidate;
+
+// Set of inode numbers on /cache that some process has open.  Open
+// addressing; a zero slot is empty (no real file has inode 0).
+typedef struct {
+  ino_t* slots;
+  size_t size;
+  size_t count;
+} InodeSet;
+
+static int InodeSetAdd(InodeSet* set, ino_t ino) {
+  if (ino == 0) return 0;
+  if ((set->count + 1) * 2 > set->size) {
+    size_t new_size = set->size ? set->size * 2 : 64;
+    ino_t* slots = calloc(new_size, sizeof(ino_t));
+    if (slots == NULL) return -1;
+    size_t i;
+    for (i = 0; i < set->size; ++i) {
+      if (set->slots[i] != 0) {
+        size_t h = set->slots[i] & (new_size - 1);
+        while (slots[h] != 0) h = (h + 1) & (new_size - 1);
+        slots[h] = set->slots[i];
+      }
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->size = new_size;
+  }
+  size_t h = ino & (set->size - 1);
+  while (set->slots[h] != 0) {
+    if (set->slots[h] == ino) return 0;
+    h = (h + 1) & (set->size - 1);
+  }
+  set->slots[h] = ino;
+  ++set->count;
+  return 0;
+}
+
+static int InodeSetContains(const InodeSet* set, ino_t ino) {
+  if (set->size == 0) return 0;
+  size_t h = ino & (set->size - 1);
+  while (set->slots[h] != 0) {
+    if (set->slots[h] == ino) return 1;
+    h = (h + 1) & (set->size - 1);
+  }
+  return 0;
+}
+
+// Walk every /proc/<pid>/fd once, recording the inode of each open
+// file that lives on the same filesystem as /cache.  stat() through
+// the fd link identifies the file even if it has since been renamed.
+static int FindOpenInodes(dev_t cache_dev, InodeSet* open_inodes) {
   DIR* d;
   struct dirent* de;
   d = opendir("/proc");
@@ -27,9 +82,7 @@ static int EliminateOpenFiles(char** files, int file_count) {
     // de->d_name[i] is numeric
 
     char path[FILENAME_MAX];
-    strcpy(path, "/proc/");
-    strcat(path, de->d_name);
-    strcat(path, "/fd/");
+    snprintf(path, sizeof(path), "/proc/%s/fd", de->d_name);
 
     DIR* fdd;
     struct dirent* fdde;
@@ -39,28 +92,14 @@ static int EliminateOpenFiles(char** files, int file_count) {
       continue;
     }
     while ((fdde = readdir(fdd)) != 0) {
-      char fd_path[FILENAME_MAX];
-      char link[FILENAME_MAX];
-      strcpy(fd_path, path);
-      strcat(fd_path, fdde->d_name);
-
-      int count;
-      count = readlink(fd_path, link, sizeof(link)-1);
-      if (count >= 0) {
-        link[count] = '\0';
-
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
-        if (strncmp(link, "/cache/", 7) == 0) {
-          int j;
-          for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
-              printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
-            }
-          }
+      if (fdde->d_name[0] == '.') continue;
+      struct stat st;
+      if (fstatat(dirfd(fdd), fdde->d_name, &st, 0) == 0 &&
+          st.st_dev == cache_dev && S_ISREG(st.st_mode)) {
+        if (InodeSetAdd(open_inodes, st.st_ino) < 0) {
+          closedir(fdd);
+          closedir(d);
+          return -1;
         }
       }
     }
@@ -71,12 +110,21 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+// Collect the unopened regular files we're allowed to delete.
+static int FindExpendableFiles(dev_t cache_dev, Candidate** files, int* entries) {
   DIR* d;
   struct dirent* de;
   int size = 32;
   *entries = 0;
-  *names = malloc(size * sizeof(char*));
+  *files = malloc(size * sizeof(Candidate));
+  if (*files == NULL) return -1;
+
+  InodeSet open_inodes = { NULL, 0, 0 };
+  if (FindOpenInodes(cache_dev, &open_inodes) < 0) {
+    free(open_inodes.slots);
+    free(*files);
+    return -1;
+  }
 
   char path[FILENAME_MAX];
 
@@ -94,9 +142,7 @@ int FindExpendableFiles(char*** names, int* entries) {
 
     // Look for regular files in the directory (not in any subdirectories).
     while ((de = readdir(d)) != 0) {
-      strcpy(path, dirs[i]);
-      strcat(path, "/");
-      strcat(path, de->d_name);
+      snprintf(path, sizeof(path), "%s/%s", dirs[i], de->d_name);
 
       // We can't delete CACHE_TEMP_SOURCE; if it's there we might have
       // restarted during installation and could be depending on it to
@@ -104,29 +150,83 @@ int FindExpendableFiles(char*** names, int* entries) {
       if (strcmp(path, CACHE_TEMP_SOURCE) == 0) continue;
 
       struct stat st;
-      if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
-        if (*entries >= size) {
-          size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
-        }
-        (*names)[(*entries)++] = strdup(path);
+      if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+          !S_ISREG(st.st_mode)) {
+        continue;
+      }
+      if (InodeSetContains(&open_inodes, st.st_ino)) {
+        printf("%s is open\n", path);
+        continue;
+      }
+      if (*entries >= size) {
+        size *= 2;
+        *files = realloc(*files, size * sizeof(Candidate));
       }
+      Candidate* c = &(*files)[(*entries)++];
+      c->path = strdup(path);
+      // Only the last link's removal gives the blocks back.
+      c->bytes = st.st_nlink == 1 ? (size_t)st.st_blocks * 512 : 0;
     }
 
     closedir(d);
   }
+  free(open_inodes.slots);
 
-  printf("%d regular files in deletable directories\n", *entries);
+  printf("%d unopened regular files in deletable directories\n", *entries);
+  return 0;
+}
 
-  if (EliminateOpenFiles(*names, *entries) < 0) {
-    return -1;
+static int CompareCandidateBytesDescending(const void* a, const void* b) {
+  const Candidate* ca = (const Candidate*)a;
+  const Candidate* cb = (const Candidate*)b;
+  if (ca->bytes != cb->bytes) return ca->bytes < cb->bytes ? 1 : -1;
+  return strcmp(ca->path, cb->path);
+}
+
+// Choose which files to delete to free "needed" more bytes, marking
+// them by moving them to the front of files[].  If one file is enough
+// on its own, take the smallest such file; otherwise take the largest
+// files until the total is covered, which touches the fewest files.
+// Returns the number chosen and stores the bytes they'll free in
+// *freed.  If even deleting everything isn't enough, chooses nothing.
+static int PlanDeletions(Candidate* files, int entries, size_t needed,
+                         size_t* freed) {
+  *freed = 0;
+  qsort(files, entries, sizeof(Candidate), CompareCandidateBytesDescending);
+
+  int i;
+  int single = -1;
+  for (i = 0; i < entries && files[i].bytes >= needed; ++i) {
+    single = i;
+  }
+  if (single >= 0) {
+    Candidate tmp = files[0];
+    files[0] = files[single];
+    files[single] = tmp;
+    *freed = files[0].bytes;
+    return 1;
   }
 
-  return 0;
+  size_t total = 0;
+  for (i = 0; i < entries && total < needed; ++i) {
+    total += files[i].bytes;
+  }
+  if (total < needed) {
+    *freed = 0;
+    return 0;
+  }
+  *freed = total;
+  return i;
 }
 
-int MakeFreeSpaceOnCache(size_t bytes_needed) {
-  size_t free_now = FreeSpaceForFile("/cache");
+int PlanFreeSpaceOnCache(size_t bytes_needed, int dry_run) {
+  struct statfs sf;
+  struct stat cache_st;
+  if (statfs("/cache", &sf) != 0 || stat("/cache", &cache_st) != 0) {
+    printf("failed to stat /cache: %s\n", strerror(errno));
+    return -1;
+  }
+  size_t free_now = sf.f_bsize * sf.f_bfree;
   printf("%ld bytes free on /cache (%ld needed)\n",
          (long)free_now, (long)bytes_needed);
 
@@ -134,39 +234,54 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
+  Candidate* files;
   int entries;
 
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  if (FindExpendableFiles(cache_st.st_dev, &files, &entries) < 0) {
     return -1;
   }
 
-  if (entries == 0) {
-    // nothing we can delete to free up space!
-    printf("no files can be deleted to free space on /cache\n");
-    return -1;
+  int result = -1;
+  int i;
+  size_t freed;
+  int chosen = PlanDeletions(files, entries, bytes_needed - free_now, &freed);
+  if (chosen == 0) {
+    // nothing we can delete to free enough space!
+    printf("no set of files can be deleted to free %ld bytes on /cache\n",
+           (long)(bytes_needed - free_now));
+    goto done;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
-
-  int i;
-  for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+  for (i = 0; i < chosen; ++i) {
+    if (dry_run) {
+      printf("would delete %s (%ld bytes)\n", files[i].path, (long)files[i].bytes);
+    } else if (unlink(files[i].path) == 0) {
+      printf("deleted %s (%ld bytes)\n", files[i].path, (long)files[i].bytes);
+    } else {
+      printf("failed to delete %s: %s\n", files[i].path, strerror(errno));
+      freed -= files[i].bytes;
     }
   }
+  printf("%s %ld bytes free on /cache\n", dry_run ? "would have" : "expect",
+         (long)(free_now + freed));
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+  if (dry_run) {
+    result = 0;
+  } else {
+    // One check at the end that the filesystem agrees with the plan.
+    free_now = FreeSpaceForFile("/cache");
+    printf("now %ld bytes free on /cache\n", (long)free_now);
+    result = (free_now != (size_t)-1 && free_now >= bytes_needed) ? 0 : -1;
   }
-  free(names);
 
-  return (free_now >= bytes_needed) ? 0 : -1;
+done:
+  for (i = 0; i < entries; ++i) {
+    free(files[i].path);
+  }
+  free(files);
+  return result;
+}
+
+int MakeFreeSpaceOnCache(size_t bytes_needed) {
+  return PlanFreeSpaceOnCache(bytes_needed, 0);
 }
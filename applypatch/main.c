@@ -30,7 +30,7 @@ int CheckMode(int argc, char** argv) {
     return applypatch_check(argv[2], argc-3, argv+3);
 }
 
-int SpaceMode(int argc, char** argv) {
+int SpaceMode(int argc, char** argv, int dry_run) {
     if (argc != 3) {
         return 2;
     }
@@ -40,6 +40,9 @@ int SpaceMode(int argc, char** argv) {
         printf("can't parse \"%s\" as byte count\n\n", argv[2]);
         return 1;
     }
+    if (dry_run) {
+        return PlanFreeSpaceOnCache(bytes, 1) < 0 ? 1 : 0;
+    }
     return CacheSizeCheck(bytes);
 }
 
@@ -167,12 +170,13 @@ int main(int argc, char** argv) {
             "[<src-sha1>:<patch> ...]\n"
             "   or  %s -c <file> [<sha1> ...]\n"
             "   or  %s -s <bytes>\n"
+            "   or  %s -S <bytes>   (report what -s would delete)\n"
             "   or  %s -l\n"
             "\n"
             "Filenames may be of the form\n"
             "  MTD:<partition>:<len_1>:<sha1_1>:<len_2>:<sha1_2>:...\n"
             "to specify reading from or writing to an MTD partition.\n\n",
-            argv[0], argv[0], argv[0], argv[0]);
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 2;
     }
 
@@ -183,7 +187,9 @@ int main(int argc, char** argv) {
     } else if (strncmp(argv[1], "-c", 3) == 0) {
         result = CheckMode(argc, argv);
     } else if (strncmp(argv[1], "-s", 3) == 0) {
-        result = SpaceMode(argc, argv);
+        result = SpaceMode(argc, argv, 0);
+    } else if (strncmp(argv[1], "-S", 3) == 0) {
+        result = SpaceMode(argc, argv, 1);
     } else {
         result = PatchMode(argc, argv);
     }
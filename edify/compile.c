@@ -0,0 +1,412 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "expr.h"
+
+// Post-parse passes over the Expr tree: folding of constant
+// subexpressions, and a compact serialized form of the tree that can
+// be cached on disk so later runs of the same script skip the parser.
+
+// Operators that are pure functions of their arguments.  The position
+// in this table is the opcode used in the serialized form, so only
+// ever append to it.
+static const Function kOperators[] = {
+    ConcatFn,
+    LogicalAndFn,
+    LogicalOrFn,
+    LogicalNotFn,
+    SubstringFn,
+    EqualityFn,
+    InequalityFn,
+    SequenceFn,
+    IfElseFn,
+};
+#define NUM_OPERATORS (int)(sizeof(kOperators) / sizeof(kOperators[0]))
+
+#define OP_LITERAL   0xff
+#define OP_CALL      0xfe
+
+#define CACHE_MAGIC  "EDC1"
+
+static const char* kOperatorName = "(operator)";
+
+static int OperatorIndex(Function fn) {
+    int i;
+    for (i = 0; i < NUM_OPERATORS; ++i) {
+        if (kOperators[i] == fn) return i;
+    }
+    return -1;
+}
+
+// The operator functions index argv without checking argc (the
+// parser always gives them the right count), so a cache has to be
+// held to the same shapes.
+static int OperatorArityOk(Function fn, uint32_t argc) {
+    if (fn == ConcatFn) return 1;
+    if (fn == LogicalNotFn) return argc == 1;
+    if (fn == IfElseFn) return argc == 2 || argc == 3;
+    return argc == 2;
+}
+
+static int IsLiteral(const Expr* e) {
+    return e->fn == Literal;
+}
+
+static int IsTrue(const Expr* e) {
+    return e->name[0] != '\0';
+}
+
+// Names of operator nodes point at a string constant (see Build());
+// everything else was malloc'd by the lexer or by us.
+static int OwnsName(const Expr* e) {
+    return e->fn == Literal || strcmp(e->name, kOperatorName) != 0;
+}
+
+void FreeExpr(Expr* e) {
+    if (e == NULL) return;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        FreeExpr(e->argv[i]);
+    }
+    free(e->argv);
+    if (OwnsName(e)) free(e->name);
+    free(e);
+}
+
+// Turn 'e' into a literal with the given (malloc'd) value, keeping
+// its source span so error messages still point at the right text.
+static Expr* MakeLiteral(Expr* e, char* value) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        FreeExpr(e->argv[i]);
+    }
+    free(e->argv);
+    if (OwnsName(e)) free(e->name);
+    e->fn = Literal;
+    e->name = value;
+    e->argc = 0;
+    e->argv = NULL;
+    return e;
+}
+
+// Replace 'e' with its child argv[keep], discarding everything else.
+static Expr* ReplaceWithChild(Expr* e, int keep) {
+    Expr* child = e->argv[keep];
+    e->argv[keep] = NULL;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        FreeExpr(e->argv[i]);
+    }
+    free(e->argv);
+    if (OwnsName(e)) free(e->name);
+    free(e);
+    return child;
+}
+
+Expr* OptimizeExpr(Expr* e) {
+    if (e == NULL) return NULL;
+
+    int i;
+    int all_literal = 1;
+    for (i = 0; i < e->argc; ++i) {
+        e->argv[i] = OptimizeExpr(e->argv[i]);
+        if (!IsLiteral(e->argv[i])) all_literal = 0;
+    }
+
+    if (e->fn == ConcatFn && all_literal) {
+        size_t length = 0;
+        for (i = 0; i < e->argc; ++i) {
+            length += strlen(e->argv[i]->name);
+        }
+        char* result = malloc(length+1);
+        size_t p = 0;
+        for (i = 0; i < e->argc; ++i) {
+            size_t len = strlen(e->argv[i]->name);
+            memcpy(result+p, e->argv[i]->name, len);
+            p += len;
+        }
+        result[p] = '\0';
+        return MakeLiteral(e, result);
+    }
+
+    if ((e->fn == EqualityFn || e->fn == InequalityFn) &&
+        e->argc == 2 && all_literal) {
+        int equal = strcmp(e->argv[0]->name, e->argv[1]->name) == 0;
+        if (e->fn == InequalityFn) equal = !equal;
+        return MakeLiteral(e, strdup(equal ? "t" : ""));
+    }
+
+    if (e->fn == SubstringFn && e->argc == 2 && all_literal) {
+        int found = strstr(e->argv[1]->name, e->argv[0]->name) != NULL;
+        return MakeLiteral(e, strdup(found ? "t" : ""));
+    }
+
+    if (e->fn == LogicalNotFn && e->argc == 1 && all_literal) {
+        return MakeLiteral(e, strdup(IsTrue(e->argv[0]) ? "" : "t"));
+    }
+
+    // The remaining operators only need their first argument to be
+    // constant to decide which branch survives.
+    if (e->argc == 0 || !IsLiteral(e->argv[0])) return e;
+
+    if (e->fn == LogicalAndFn && e->argc == 2) {
+        return ReplaceWithChild(e, IsTrue(e->argv[0]) ? 1 : 0);
+    }
+    if (e->fn == LogicalOrFn && e->argc == 2) {
+        return ReplaceWithChild(e, IsTrue(e->argv[0]) ? 0 : 1);
+    }
+    if (e->fn == SequenceFn && e->argc == 2) {
+        return ReplaceWithChild(e, 1);
+    }
+    if (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3)) {
+        if (IsTrue(e->argv[0])) return ReplaceWithChild(e, 1);
+        // With no else branch a false condition is its own result.
+        return ReplaceWithChild(e, e->argc == 3 ? 2 : 0);
+    }
+
+    return e;
+}
+
+// -----------------------------------------------------------------
+//   serialized form
+// -----------------------------------------------------------------
+//
+// After a four-byte magic, each node is written in prefix order as
+//
+//   opcode    1 byte: index into kOperators, OP_CALL or OP_LITERAL
+//   start     4 bytes
+//   end       4 bytes
+//   argc      4 bytes (omitted for OP_LITERAL)
+//   name      4-byte length + bytes (OP_LITERAL and OP_CALL only)
+//
+// followed by its argc children.  All integers are little-endian.
+// Named functions are stored by name and looked up again when the
+// cache is loaded, so a cache written by a binary with a different
+// set of functions is rejected rather than misinterpreted.
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t alloc;
+} Buffer;
+
+static void Put(Buffer* b, const void* data, size_t len) {
+    if (b->size + len > b->alloc) {
+        while (b->size + len > b->alloc) {
+            b->alloc = b->alloc*2 + 256;
+        }
+        b->data = realloc(b->data, b->alloc);
+    }
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+}
+
+static void PutInt(Buffer* b, uint32_t v) {
+    unsigned char bytes[4];
+    bytes[0] = v & 0xff;
+    bytes[1] = (v >> 8) & 0xff;
+    bytes[2] = (v >> 16) & 0xff;
+    bytes[3] = (v >> 24) & 0xff;
+    Put(b, bytes, 4);
+}
+
+static void PutString(Buffer* b, const char* s) {
+    size_t len = strlen(s);
+    PutInt(b, len);
+    Put(b, s, len);
+}
+
+static void SerializeExpr(Buffer* b, const Expr* e) {
+    unsigned char op;
+    int index = OperatorIndex(e->fn);
+    if (IsLiteral(e)) {
+        op = OP_LITERAL;
+    } else if (index >= 0 && strcmp(e->name, kOperatorName) == 0) {
+        op = index;
+    } else {
+        op = OP_CALL;
+    }
+    Put(b, &op, 1);
+    PutInt(b, e->start);
+    PutInt(b, e->end);
+    if (op == OP_LITERAL) {
+        PutString(b, e->name);
+        return;
+    }
+    PutInt(b, e->argc);
+    if (op == OP_CALL) {
+        PutString(b, e->name);
+    }
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        SerializeExpr(b, e->argv[i]);
+    }
+}
+
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+} Reader;
+
+static int GetInt(Reader* r, uint32_t* v) {
+    if (r->size - r->pos < 4) return -1;
+    const unsigned char* p = r->data + r->pos;
+    *v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    r->pos += 4;
+    return 0;
+}
+
+static char* GetString(Reader* r) {
+    uint32_t len;
+    if (GetInt(r, &len) < 0 || r->size - r->pos < len) return NULL;
+    if (memchr(r->data + r->pos, '\0', len) != NULL) return NULL;
+    char* s = malloc(len+1);
+    memcpy(s, r->data + r->pos, len);
+    s[len] = '\0';
+    r->pos += len;
+    return s;
+}
+
+static Expr* DeserializeExpr(Reader* r, int depth) {
+    // The parser can't produce anything this deep from a script that
+    // fits in a package; treat it as a corrupt cache.
+    if (depth > 10000 || r->pos >= r->size) return NULL;
+
+    unsigned char op = r->data[r->pos++];
+    uint32_t start, end, argc = 0;
+    if (GetInt(r, &start) < 0 || GetInt(r, &end) < 0) return NULL;
+
+    Expr* e = malloc(sizeof(Expr));
+    e->start = start;
+    e->end = end;
+    e->argc = 0;
+    e->argv = NULL;
+
+    if (op == OP_LITERAL) {
+        e->fn = Literal;
+        e->name = GetString(r);
+        if (e->name == NULL) {
+            free(e);
+            return NULL;
+        }
+        return e;
+    }
+
+    // Each child takes at least nine bytes, which bounds argc by what
+    // is left in the buffer.
+    if (GetInt(r, &argc) < 0 || argc > (r->size - r->pos) / 9) {
+        free(e);
+        return NULL;
+    }
+
+    if (op == OP_CALL) {
+        e->name = GetString(r);
+        if (e->name == NULL) {
+            free(e);
+            return NULL;
+        }
+        e->fn = FindFunction(e->name);
+        if (e->fn == NULL) {
+            fprintf(stderr, "compiled script calls unknown function \"%s\"\n",
+                    e->name);
+            free(e->name);
+            free(e);
+            return NULL;
+        }
+    } else if (op < NUM_OPERATORS && OperatorArityOk(kOperators[op], argc)) {
+        e->fn = kOperators[op];
+        e->name = (char*)kOperatorName;
+    } else {
+        free(e);
+        return NULL;
+    }
+
+    if (argc > 0) {
+        e->argv = malloc(argc * sizeof(Expr*));
+    }
+    for (e->argc = 0; e->argc < (int)argc; ++e->argc) {
+        Expr* child = DeserializeExpr(r, depth+1);
+        if (child == NULL) {
+            FreeExpr(e);
+            return NULL;
+        }
+        e->argv[e->argc] = child;
+    }
+    return e;
+}
+
+int SaveCompiledExpr(const char* path, Expr* root) {
+    Buffer b;
+    b.data = NULL;
+    b.size = b.alloc = 0;
+    Put(&b, CACHE_MAGIC, 4);
+    SerializeExpr(&b, root);
+
+    // Write to a temporary name and rename into place, so a reader
+    // never sees a partial file.
+    char* temp = malloc(strlen(path) + 6);
+    strcpy(temp, path);
+    strcat(temp, ".part");
+
+    int result = -1;
+    FILE* f = fopen(temp, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "can't write %s: %s\n", temp, strerror(errno));
+        goto done;
+    }
+    if (fwrite(b.data, 1, b.size, f) != b.size) {
+        fprintf(stderr, "short write of %s: %s\n", temp, strerror(errno));
+        fclose(f);
+        unlink(temp);
+        goto done;
+    }
+    if (fclose(f) != 0 || rename(temp, path) != 0) {
+        fprintf(stderr, "failed to save %s: %s\n", path, strerror(errno));
+        unlink(temp);
+        goto done;
+    }
+    result = 0;
+
+  done:
+    free(temp);
+    free(b.data);
+    return result;
+}
+
+Expr* LoadCompiledExpr(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+
+    Buffer b;
+    b.data = NULL;
+    b.size = b.alloc = 0;
+    unsigned char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        Put(&b, chunk, n);
+    }
+    fclose(f);
+
+    Expr* root = NULL;
+    if (b.size > 4 && memcmp(b.data, CACHE_MAGIC, 4) == 0) {
+        Reader r;
+        r.data = b.data;
+        r.size = b.size;
+        r.pos = 4;
+        root = DeserializeExpr(&r, 0);
+        if (root != NULL && r.pos != r.size) {
+            FreeExpr(root);
+            root = NULL;
+        }
+    }
+    if (root == NULL) {
+        fprintf(stderr, "ignoring invalid compiled script %s\n", path);
+    }
+    free(b.data);
+    return root;
+}
@@ -32,8 +32,47 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
-char* Evaluate(State* state, Expr* expr) {
+// Value structs from FreeValue(), kept for reuse by StringValue().
+// Nearly every evaluated expression makes and frees one, so this
+// saves a malloc/free pair per node.  They're ordinary malloc'd
+// blocks, so code that free()s a Value directly still works.
+#define VALUE_POOL_SIZE 32
+static Value* value_pool[VALUE_POOL_SIZE];
+static int value_pool_count = 0;
+
+static Value* AllocValue() {
+    if (value_pool_count > 0) {
+        return value_pool[--value_pool_count];
+    }
+    return malloc(sizeof(Value));
+}
+
+static void ReleaseValue(Value* v) {
+    if (value_pool_count < VALUE_POOL_SIZE) {
+        value_pool[value_pool_count++] = v;
+    } else {
+        free(v);
+    }
+}
+
+static CallHook call_hook = NULL;
+
+void SetCallHook(CallHook hook) {
+    call_hook = hook;
+}
+
+static Value* Call(State* state, Expr* expr) {
+    if (call_hook == NULL || expr->fn == Literal) {
+        return expr->fn(expr->name, state, expr->argc, expr->argv);
+    }
+    call_hook(state, expr, 0, NULL);
     Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    call_hook(state, expr, 1, v);
+    return v;
+}
+
+char* Evaluate(State* state, Expr* expr) {
+    Value* v = Call(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -41,17 +80,17 @@ char* Evaluate(State* state, Expr* expr) {
         return NULL;
     }
     char* result = v->data;
-    free(v);
+    ReleaseValue(v);
     return result;
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    return Call(state, expr);
 }
 
 Value* StringValue(char* str) {
     if (str == NULL) return NULL;
-    Value* v = malloc(sizeof(Value));
+    Value* v = AllocValue();
     v->type = VAL_STRING;
     v->size = strlen(str);
     v->data = str;
@@ -61,33 +100,36 @@ Value* StringValue(char* str) {
 void FreeValue(Value* v) {
     if (v == NULL) return;
     free(v->data);
-    free(v);
+    ReleaseValue(v);
 }
 
 Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
         return StringValue(strdup(""));
     }
-    char** strings = malloc(argc * sizeof(char*));
+    ArenaMark mark = ArenaGetMark(state);
+    char** strings = ArenaAlloc(state, argc * sizeof(char*));
+    size_t* lengths = ArenaAlloc(state, argc * sizeof(size_t));
     int i;
     for (i = 0; i < argc; ++i) {
         strings[i] = NULL;
     }
     char* result = NULL;
-    int length = 0;
+    size_t length = 0;
     for (i = 0; i < argc; ++i) {
         strings[i] = Evaluate(state, argv[i]);
         if (strings[i] == NULL) {
             goto done;
         }
-        length += strlen(strings[i]);
+        lengths[i] = strlen(strings[i]);
+        length += lengths[i];
     }
 
     result = malloc(length+1);
-    int p = 0;
+    size_t p = 0;
     for (i = 0; i < argc; ++i) {
-        strcpy(result+p, strings[i]);
-        p += strlen(strings[i]);
+        memcpy(result+p, strings[i], lengths[i]);
+        p += lengths[i];
     }
     result[p] = '\0';
 
@@ -95,7 +137,7 @@ Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     for (i = 0; i < argc; ++i) {
         free(strings[i]);
     }
-    free(strings);
+    ArenaRelease(state, mark);
     return StringValue(result);
 }
 
@@ -265,7 +307,11 @@ Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
+    // The left side is a complete statement; whatever scratch memory
+    // it took is no longer needed once it has run.
+    ArenaMark mark = ArenaGetMark(state);
     Value* left = EvaluateValue(state, argv[0]);
+    ArenaRelease(state, mark);
     if (left == NULL) return NULL;
     FreeValue(left);
     return EvaluateValue(state, argv[1]);
@@ -403,7 +449,8 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
+    ArenaMark mark = ArenaGetMark(state);
+    char** args = ArenaAlloc(state, count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
@@ -415,13 +462,13 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
             for (j = 0; j < i; ++j) {
                 free(args[j]);
             }
-            free(args);
+            ArenaRelease(state, mark);
             return -1;
         }
         *(va_arg(v, char**)) = args[i];
     }
     va_end(v);
-    free(args);
+    ArenaRelease(state, mark);
     return 0;
 }
 
@@ -429,7 +476,8 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
+    ArenaMark mark = ArenaGetMark(state);
+    Value** args = ArenaAlloc(state, count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
@@ -441,13 +489,13 @@ int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
             for (j = 0; j < i; ++j) {
                 FreeValue(args[j]);
             }
-            free(args);
+            ArenaRelease(state, mark);
             return -1;
         }
         *(va_arg(v, Value**)) = args[i];
     }
     va_end(v);
-    free(args);
+    ArenaRelease(state, mark);
     return 0;
 }
 
@@ -505,3 +553,71 @@ Value* ErrorAbort(State* state, char* format, ...) {
     state->errmsg = buffer;
     return NULL;
 }
+
+// -----------------------------------------------------------------
+//   scratch memory
+// -----------------------------------------------------------------
+
+#define ARENA_CHUNK_SIZE  16384
+
+struct ArenaChunk {
+    struct ArenaChunk* prev;
+    size_t size;
+    size_t used;
+};
+
+// Chunk header size, rounded up so the data after it stays aligned.
+#define ARENA_HEADER_SIZE ((sizeof(struct ArenaChunk) + 7) & ~(size_t)7)
+
+void* ArenaAlloc(State* state, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    struct ArenaChunk* c = state->arena;
+    if (c == NULL || c->size - c->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        struct ArenaChunk* n = malloc(ARENA_HEADER_SIZE + chunk_size);
+        if (n == NULL) {
+            fprintf(stderr, "failed to allocate %ld bytes of scratch\n",
+                    (long)chunk_size);
+            abort();
+        }
+        n->prev = c;
+        n->size = chunk_size;
+        n->used = 0;
+        state->arena = c = n;
+    }
+    void* p = (char*)c + ARENA_HEADER_SIZE + c->used;
+    c->used += size;
+    return p;
+}
+
+char* ArenaStrdup(State* state, const char* str) {
+    size_t len = strlen(str);
+    char* copy = ArenaAlloc(state, len+1);
+    memcpy(copy, str, len+1);
+    return copy;
+}
+
+ArenaMark ArenaGetMark(State* state) {
+    ArenaMark mark;
+    mark.chunk = state->arena;
+    mark.used = state->arena ? state->arena->used : 0;
+    return mark;
+}
+
+void ArenaRelease(State* state, ArenaMark mark) {
+    while (state->arena != mark.chunk) {
+        struct ArenaChunk* c = state->arena;
+        state->arena = c->prev;
+        free(c);
+    }
+    if (state->arena != NULL) {
+        state->arena->used = mark.used;
+    }
+}
+
+void FreeArena(State* state) {
+    ArenaMark empty;
+    empty.chunk = NULL;
+    empty.used = 0;
+    ArenaRelease(state, empty);
+}
@@ -39,8 +39,18 @@ typedef struct {
     // Should be NULL initially, will be either NULL or a malloc'd
     // pointer after Evaluate() returns.
     char* errmsg;
+
+    // Scratch memory handed out by ArenaAlloc().  Should be NULL
+    // initially; release it with FreeArena() when done evaluating.
+    struct ArenaChunk* arena;
 } State;
 
+// A position in a State's arena, to release back to later.
+typedef struct {
+    struct ArenaChunk* chunk;
+    size_t used;
+} ArenaMark;
+
 #define VAL_STRING  1  // data will be NULL-terminated; size doesn't count null
 #define VAL_BLOB    2
 
@@ -73,6 +83,15 @@ Value* EvaluateValue(State* state, Expr* expr);
 // with strings.
 char* Evaluate(State* state, Expr* expr);
 
+// Called around every call Evaluate() and EvaluateValue() make, other
+// than of literals: before it with done == 0, and after it with done
+// == 1 and its result (NULL if it failed).  Calls nest, so every
+// "before" is matched by the next unmatched "after".
+typedef void (*CallHook)(State* state, Expr* expr, int done, Value* result);
+
+// Install (or, with NULL, remove) the call hook.
+void SetCallHook(CallHook hook);
+
 // Glue to make an Expr out of a literal.
 Value* Literal(const char* name, State* state, int argc, Expr* argv[]);
 
@@ -126,6 +145,31 @@ void FinishRegistration();
 Function FindFunction(const char* name);
 
 
+// --- compiling scripts (compile.c) ---
+
+// Fold constant subexpressions of a parsed script: concatenations,
+// comparisons and negations of literals become literals, and
+// &&, ||, ; and if/else with a literal condition are reduced to the
+// branch they would take.  Only the built-in operators are touched;
+// registered functions may have side effects and are left alone.
+// Takes ownership of 'expr' and returns the new root.
+Expr* OptimizeExpr(Expr* expr);
+
+// Free a tree returned by the parser, OptimizeExpr() or
+// LoadCompiledExpr().
+void FreeExpr(Expr* expr);
+
+// Write 'root' to 'path' in a compact binary form.  Returns 0 on
+// success.
+int SaveCompiledExpr(const char* path, Expr* root);
+
+// Read a tree written by SaveCompiledExpr(), resolving function names
+// against the current function table (so call this after
+// FinishRegistration()).  Returns NULL if the file is missing,
+// corrupt, or names a function that isn't registered.
+Expr* LoadCompiledExpr(const char* path);
+
+
 // --- convenience functions for use in functions ---
 
 // Evaluate the expressions in argv, giving 'count' char* (the ... is
@@ -160,4 +204,26 @@ Value* StringValue(char* str);
 // Free a Value object.
 void FreeValue(Value* v);
 
+// --- scratch memory ---
+//
+// Functions that need temporary buffers can take them from the
+// State's arena instead of malloc().  Everything allocated is released
+// in bulk when the enclosing statement (the left side of a ';')
+// finishes, or earlier with ArenaRelease().  Arena memory must never
+// be returned inside a Value: callers free Values with free().
+
+// Allocate 'size' bytes (8-byte aligned) from the arena.
+void* ArenaAlloc(State* state, size_t size);
+
+// Copy a string into the arena.
+char* ArenaStrdup(State* state, const char* str);
+
+// Record the current arena position, and free everything allocated
+// since a recorded position.  Marks must be released in LIFO order.
+ArenaMark ArenaGetMark(State* state);
+void ArenaRelease(State* state, ArenaMark mark);
+
+// Free all of a State's arena.
+void FreeArena(State* state);
+
 #endif  // _EXPRESSION_H
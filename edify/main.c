@@ -44,8 +44,10 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     state.cookie = NULL;
     state.script = strdup(expr_str);
     state.errmsg = NULL;
+    state.arena = NULL;
 
     result = Evaluate(&state, e);
+    FreeArena(&state);
     free(state.errmsg);
     free(state.script);
     if (result == NULL && expected != NULL) {
@@ -70,6 +72,84 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     return 1;
 }
 
+// Like expect(), but evaluates the script after it has been through
+// OptimizeExpr() and a round trip through the compiled cache format.
+// If 'folded' is set the whole script must have reduced to a literal.
+int expect_compiled(const char* expr_str, const char* expected,
+                    int folded, int* errors) {
+    Expr* e;
+    int error;
+    char* result;
+    const char* path = "/tmp/edify-test.edc";
+
+    printf(".");
+
+    yy_scan_string(expr_str);
+    int error_count = 0;
+    error = yyparse(&e, &error_count);
+    if (error > 0 || error_count > 0) {
+        fprintf(stderr, "error parsing \"%s\" (%d errors)\n",
+                expr_str, error_count);
+        ++*errors;
+        return 0;
+    }
+
+    e = OptimizeExpr(e);
+    if (folded && e->fn != Literal) {
+        fprintf(stderr, "\"%s\" was not folded to a literal\n", expr_str);
+        ++*errors;
+        FreeExpr(e);
+        return 0;
+    }
+
+    if (SaveCompiledExpr(path, e) != 0) {
+        fprintf(stderr, "failed to save \"%s\"\n", expr_str);
+        ++*errors;
+        FreeExpr(e);
+        return 0;
+    }
+    FreeExpr(e);
+    e = LoadCompiledExpr(path);
+    unlink(path);
+    if (e == NULL) {
+        fprintf(stderr, "failed to load \"%s\"\n", expr_str);
+        ++*errors;
+        return 0;
+    }
+
+    State state;
+    state.cookie = NULL;
+    state.script = strdup(expr_str);
+    state.errmsg = NULL;
+    state.arena = NULL;
+
+    result = Evaluate(&state, e);
+    FreeArena(&state);
+    FreeExpr(e);
+    free(state.errmsg);
+    free(state.script);
+    if (result == NULL && expected != NULL) {
+        fprintf(stderr, "error evaluating compiled \"%s\"\n", expr_str);
+        ++*errors;
+        return 0;
+    }
+
+    if (result == NULL && expected == NULL) {
+        return 1;
+    }
+
+    if (strcmp(result, expected) != 0) {
+        fprintf(stderr, "compiled \"%s\": expected \"%s\", got \"%s\"\n",
+                expr_str, expected, result);
+        ++*errors;
+        free(result);
+        return 0;
+    }
+
+    free(result);
+    return 1;
+}
+
 int test() {
     int errors = 0;
 
@@ -154,6 +234,22 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // constant folding and the compiled form
+    expect_compiled("a + b + c", "abc", 1, &errors);
+    expect_compiled("concat(a + b, c, \"d\")", "abcd", 1, &errors);
+    expect_compiled("a + b == ab", "t", 1, &errors);
+    expect_compiled("a != a", "", 1, &errors);
+    expect_compiled("!!a", "t", 1, &errors);
+    expect_compiled("is_substring(cad, abracadabra)", "t", 1, &errors);
+    expect_compiled("\"\" && abort()", "", 1, &errors);
+    expect_compiled("a || abort()", "a", 1, &errors);
+    expect_compiled("if \"\" then yes endif", "", 1, &errors);
+    expect_compiled("if a + b == ab then yes else no endif", "yes", 1, &errors);
+    expect_compiled("t && abort()", NULL, 0, &errors);
+    expect_compiled("less_than_int(3, 1 + 4)", "t", 0, &errors);
+    expect_compiled("a; b; stdout(\"\"); c + d", "cd", 0, &errors);
+    expect_compiled("assert(t, \"\")", NULL, 0, &errors);
+
     printf("\n");
 
     return errors;
@@ -204,8 +300,10 @@ int main(int argc, char** argv) {
         state.cookie = NULL;
         state.script = buffer;
         state.errmsg = NULL;
+        state.arena = NULL;
 
         char* result = Evaluate(&state, root);
+        FreeArena(&state);
         if (result == NULL) {
             printf("result was NULL, message is: %s\n",
                    (state.errmsg == NULL ? "(NULL)" : state.errmsg));
@@ -46,6 +46,7 @@
 #include "mmcutils/mmcutils.h"
 //#include "edify/parser.h"
 #include "safebootcommands.h"
+#include "libcrecovery/common.h"
 
 #define FLASH_NS_FILE "/.flash_non_safe"
 
@@ -322,8 +323,10 @@ int run_script_from_buffer(char* script_data, int script_len, char* filename)
         state.cookie = NULL;
         state.script = script_data;
         state.errmsg = NULL;
+        state.arena = NULL;
 
         char* result = Evaluate(&state, root);
+        FreeArena(&state);
         if (result == NULL) {
             printf("result was NULL, message is: %s\n",
                    (state.errmsg == NULL ? "(NULL)" : state.errmsg));
@@ -343,8 +346,7 @@ int run_script_from_buffer(char* script_data, int script_len, char* filename)
 int run_and_remove_extendedcommand()
 {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cp %s /tmp/%s", EXTENDEDCOMMAND_SCRIPT, basename(EXTENDEDCOMMAND_SCRIPT));
-    __system(tmp);
+    builtin_cp(EXTENDEDCOMMAND_SCRIPT, "/tmp");
     remove(EXTENDEDCOMMAND_SCRIPT);
     int i = 0;
     for (i = 20; i > 0; i--) {
@@ -432,8 +434,10 @@ int edify_main(int argc, char** argv) {
         state.cookie = NULL;
         state.script = buffer;
         state.errmsg = NULL;
+        state.arena = NULL;
 
         char* result = Evaluate(&state, root);
+        FreeArena(&state);
         if (result == NULL) {
             printf("result was NULL, message is: %s\n",
                    (state.errmsg == NULL ? "(NULL)" : state.errmsg));
@@ -3,10 +3,12 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <stdint.h>
 #include <linux/input.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/reboot.h>
 #include <reboot/reboot.h>
 #include <sys/types.h>
@@ -42,7 +44,10 @@
 #include "edify/expr.h"
 #include <libgen.h>
 #include "mtdutils/mtdutils.h"
+#include "mmcutils/mmcutils.h"
 #include "safebootcommands.h"
+#include "libcrecovery/common.h"
+#include "logger.h"
 
 #define MENU_HEADER_ROWS 32
 #define MENU_HEADER_COLS 55
@@ -52,6 +57,8 @@
 int poweroff = 0;
 int signature_check_enabled = 1;
 int script_assert_enabled = 1;
+int strict_crc_enabled = 0;
+int install_trace_enabled = 0;
 static const char *SDCARD_UPDATE_FILE = "/sdcard/update.zip";
 
 int
@@ -80,16 +87,14 @@ open_pipe(const char *pathtoprog)
 int
 backup_ss_files(const char *backup_script_path)
 {
-    char tmp_b_cmd[PATH_MAX];
     char tmp_b_pipe_arg[PATH_MAX];
 
-    sprintf(tmp_b_cmd,"chmod 777 %s", backup_script_path);
     sprintf(tmp_b_pipe_arg,"/sbin/bash %s", backup_script_path);
 
     ui_show_progress(1,4);
 
     ui_print("backing up safestrap files...\n");
-    __system(tmp_b_cmd);	
+    chmod(backup_script_path, 0777);
     int b_piperet = open_pipe(tmp_b_pipe_arg);
     if(!b_piperet)
 	ui_print("completed backup.\n");
@@ -103,16 +108,14 @@ backup_ss_files(const char *backup_script_path)
 int
 restore_ss_files(const char *restore_script_path)
 {
-    char tmp_r_cmd[PATH_MAX];
     char tmp_r_pipe_arg[PATH_MAX];
 
-    sprintf(tmp_r_cmd,"chmod 777 %s", restore_script_path);
     sprintf(tmp_r_pipe_arg,"/sbin/bash %s", restore_script_path);
 
     ui_show_progress(1, 7);
 
     ui_print("restoring safestrap files...\n");
-    __system(tmp_r_cmd);
+    chmod(restore_script_path, 0777);
     int r_piperet = open_pipe(tmp_r_pipe_arg);
     if(!r_piperet)
 	ui_print("restore completed.\n");
@@ -177,6 +180,18 @@ void toggle_script_asserts()
     ui_print("script asserts: %s\n", script_assert_enabled ? "ENABLED" : "DISABLED");
 }
 
+void toggle_strict_crc()
+{
+    strict_crc_enabled = !strict_crc_enabled;
+    ui_print("strict crc checks: %s\n", strict_crc_enabled ? "ENABLED" : "DISABLED");
+}
+
+void toggle_install_trace()
+{
+    install_trace_enabled = !install_trace_enabled;
+    ui_print("install profiling: %s\n", install_trace_enabled ? "ENABLED" : "DISABLED");
+}
+
 int install_zip(const char* packagefilepath)
 {
     ui_print("\n-- installing: %s\n", packagefilepath);
@@ -342,7 +357,7 @@ show_wipe_menu() {
                 {
                     ui_print("\n-- wiping cache...\n");
                     erase_volume("/cache");
-		    __system("echo 1 > /.color_change");
+		    builtin_echo("/.color_change", "1\n");
                     ui_print("cache wipe complete.\n");
 		}
 		break;
@@ -363,10 +378,10 @@ show_wipe_menu() {
 		{
 		    ui_print("\nwiping dalvik cache...\n");
 
-		    __system("rm -r /data/dalvik-cache");
-		    __system("rm -r /cache/dalvik-cache");
-	            //__system("rm -r /sd-ext/dalvik-cache");
-		    __system("echo 1 > /.color_change");
+		    dirUnlinkHierarchy("/data/dalvik-cache");
+		    dirUnlinkHierarchy("/cache/dalvik-cache");
+	            //dirUnlinkHierarchy("/sd-ext/dalvik-cache");
+		    builtin_echo("/.color_change", "1\n");
 		    ui_print("\ndalvik cache wiped.\n");
 		    ensure_path_unmounted("/data");
 		}
@@ -383,7 +398,7 @@ show_wipe_menu() {
 		{
 		    ui_print("\nwiping data...\n");
 		    erase_volume("/data");
-		    __system("echo 1 > /.color_change");
+		    builtin_echo("/.color_change", "1\n");
 		    ui_print("\ndata wipe complete.\n");
 		    ensure_path_unmounted("/data");
 		}
@@ -406,7 +421,7 @@ show_wipe_menu() {
 		    
 		    //erase_volume("/sd-ext");
 		    erase_volume("/sdcard/.android_secure");
-		    __system("echo 1 > /.color_change");
+		    builtin_echo("/.color_change", "1\n");
 		    ui_print("\ndata wipe complete.\n");
 		}
 		break;
@@ -420,6 +435,8 @@ char** INSTALL_MENU_ITEMS[] = {  "|| <1> choose .zip from internal/external sdca
                                  "|| <2> apply update.zip from root of sdcard       |/|",
                                  "|| <3> toggle signature verification              |/|",
                                  "|| <4> toggle script asserts                      |/|",
+                                 "|| <5> toggle strict crc checks                   |/|",
+                                 "|| <6> toggle install profiling                   |/|",
 			         NULL
 			      };
 
@@ -427,6 +444,8 @@ char** INSTALL_MENU_ITEMS[] = {  "|| <1> choose .zip from internal/external sdca
 #define ITEM_APPLY_SDCARD     1
 #define ITEM_SIG_CHECK        2
 #define ITEM_ASSERTS          3
+#define ITEM_STRICT_CRC       4
+#define ITEM_INSTALL_TRACE    5
 
 void show_install_update_menu()
 {
@@ -543,6 +562,14 @@ void show_install_update_menu()
 	    case ITEM_ASSERTS:
                 toggle_script_asserts();
                 break;
+
+	    case ITEM_STRICT_CRC:
+                toggle_strict_crc();
+                break;
+
+	    case ITEM_INSTALL_TRACE:
+                toggle_install_trace();
+                break;
 	    
         }
     }
@@ -562,20 +589,169 @@ void free_string_array(char** array)
     free(array);
 }
 
+// Directory listings are cached, keyed by path, and reused for as long
+// as the directory's mtime (and identity) is unchanged, so moving back
+// and forth through the file and backup menus doesn't rescan sdcards
+// holding thousands of entries.
+#define DIR_CACHE_SIZE 8
+
+typedef struct {
+    char* name;
+    int is_dir;
+} DirEntryInfo;
+
+typedef struct {
+    char* directory;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    time_t scanned;
+    unsigned long last_used;
+    DirEntryInfo* entries;
+    int count;
+} DirListing;
+
+static DirListing dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_cache_clock = 0;
+
+// Compare names so that runs of digits sort by value: "backup-9" comes
+// before "backup-10".  Ties (eg. "01" vs "1") fall back to strcmp.
+static int natural_compare(const char* a, const char* b)
+{
+    const char* sa = a;
+    const char* sb = b;
+    while (*a != '\0' && *b != '\0') {
+        if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            while (*a == '0') a++;
+            while (*b == '0') b++;
+            const char* ea = a;
+            const char* eb = b;
+            while (isdigit((unsigned char)*ea)) ea++;
+            while (isdigit((unsigned char)*eb)) eb++;
+            if (ea - a != eb - b)
+                return (ea - a) < (eb - b) ? -1 : 1;
+            for (; a < ea; a++, b++) {
+                if (*a != *b)
+                    return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+            }
+            continue;
+        }
+        if (*a != *b)
+            return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+        a++;
+        b++;
+    }
+    if (*a != *b)
+        return *a == '\0' ? -1 : 1;
+    return strcmp(sa, sb);
+}
+
+static int compare_dir_entries(const void* a, const void* b)
+{
+    return natural_compare(((const DirEntryInfo*)a)->name,
+                           ((const DirEntryInfo*)b)->name);
+}
+
+static void free_dir_listing(DirListing* listing)
+{
+    int i;
+    for (i = 0; i < listing->count; i++)
+        free(listing->entries[i].name);
+    free(listing->entries);
+    free(listing->directory);
+    memset(listing, 0, sizeof(*listing));
+}
+
+// One readdir pass; d_type says which entries are directories, with a
+// stat only for symlinks and filesystems that don't fill d_type in.
+static int scan_directory(const char* directory, DirListing* listing)
+{
+    DIR* dir = opendir(directory);
+    if (dir == NULL)
+        return -1;
+
+    int allocd = 64;
+    listing->entries = malloc(allocd * sizeof(DirEntryInfo));
+    listing->count = 0;
+
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        // skip hidden files
+        if (de->d_name[0] == '.')
+            continue;
+
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+            struct stat info;
+            is_dir = fstatat(dirfd(dir), de->d_name, &info, 0) == 0 &&
+                     S_ISDIR(info.st_mode);
+        }
+
+        if (listing->count == allocd) {
+            allocd *= 2;
+            listing->entries = realloc(listing->entries, allocd * sizeof(DirEntryInfo));
+        }
+        listing->entries[listing->count].name = strdup(de->d_name);
+        listing->entries[listing->count].is_dir = is_dir;
+        listing->count++;
+    }
+
+    if (closedir(dir) < 0) {
+        LOGE("failed to close directory.");
+    }
+
+    qsort(listing->entries, listing->count, sizeof(DirEntryInfo), compare_dir_entries);
+    return 0;
+}
+
+static const DirListing* get_dir_listing(const char* directory)
+{
+    struct stat st;
+    if (stat(directory, &st) != 0)
+        return NULL;
+
+    int i;
+    DirListing* slot = &dir_cache[0];
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        DirListing* l = &dir_cache[i];
+        if (l->directory != NULL && strcmp(l->directory, directory) == 0) {
+            // A change in the same second as the scan wouldn't move the
+            // mtime, so only trust listings taken after the last change.
+            if (l->dev == st.st_dev && l->ino == st.st_ino &&
+                l->mtime == st.st_mtime && l->scanned > st.st_mtime) {
+                l->last_used = ++dir_cache_clock;
+                return l;
+            }
+            slot = l;
+            break;
+        }
+        if (l->last_used < slot->last_used)
+            slot = l;
+    }
+
+    free_dir_listing(slot);
+    if (scan_directory(directory, slot) != 0) {
+        free_dir_listing(slot);
+        return NULL;
+    }
+    slot->directory = strdup(directory);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtime;
+    slot->scanned = time(NULL);
+    slot->last_used = ++dir_cache_clock;
+    return slot;
+}
+
 char** gather_files(const char* directory, const char* fileExtensionOrDirectory, int* numFiles)
 {
-    char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    int total = 0;
     int i;
-    char** files = NULL;
-    int pass;
+    int total = 0;
     *numFiles = 0;
     int dirLen = strlen(directory);
 
-    dir = opendir(directory);
-    if (dir == NULL) {
+    const DirListing* listing = get_dir_listing(directory);
+    if (listing == NULL) {
         ui_print("couldn't open directory.\n");
         return NULL;
     }
@@ -584,91 +760,58 @@ char** gather_files(const char* directory, const char* fileExtensionOrDirectory,
     if (fileExtensionOrDirectory != NULL)
         extension_length = strlen(fileExtensionOrDirectory);
 
-    int isCounting = 1;
-    i = 0;
-    for (pass = 0; pass < 2; pass++) {
-        while ((de=readdir(dir)) != NULL) {
-            // skip hidden files
-            if (de->d_name[0] == '.')
-                continue;
-
-            // NULL means that we are gathering directories, so skip this
-            if (fileExtensionOrDirectory != NULL)
-            {
-                // make sure that we can have the desired extension (prevent seg fault)
-                if (strlen(de->d_name) < extension_length)
-                    continue;
-                // compare the extension
-                if (strcmp(de->d_name + strlen(de->d_name) - extension_length, fileExtensionOrDirectory) != 0)
-                    continue;
-            }
-            else
-            {
-                struct stat info;
-                char fullFileName[PATH_MAX];
-                strcpy(fullFileName, directory);
-                strcat(fullFileName, de->d_name);
-                stat(fullFileName, &info);
-                // make sure it is a directory
-                if (!(S_ISDIR(info.st_mode)))
-                    continue;
-            }
+    char** files = (char**) malloc((listing->count + 1) * sizeof(char*));
+    for (i = 0; i < listing->count; i++) {
+        const DirEntryInfo* e = &listing->entries[i];
+        int nameLen = strlen(e->name);
 
-            if (pass == 0)
-            {
-                total++;
+        // NULL means that we are gathering directories
+        if (fileExtensionOrDirectory != NULL) {
+            // make sure that we can have the desired extension (prevent seg fault)
+            if (nameLen < extension_length)
                 continue;
-            }
-
-            files[i] = (char*) malloc(dirLen + strlen(de->d_name) + 2);
-            strcpy(files[i], directory);
-            strcat(files[i], de->d_name);
-            if (fileExtensionOrDirectory == NULL)
-                strcat(files[i], "/");
-            i++;
+            // compare the extension
+            if (strcmp(e->name + nameLen - extension_length, fileExtensionOrDirectory) != 0)
+                continue;
+        } else if (!e->is_dir) {
+            continue;
         }
-        if (pass == 1)
-            break;
-        if (total == 0)
-            break;
-        rewinddir(dir);
-        *numFiles = total;
-        files = (char**) malloc((total+1)*sizeof(char*));
-        files[total]=NULL;
-    }
 
-    if(closedir(dir) < 0) {
-        LOGE("failed to close directory.");
+        files[total] = (char*) malloc(dirLen + nameLen + 2);
+        strcpy(files[total], directory);
+        strcat(files[total], e->name);
+        if (fileExtensionOrDirectory == NULL)
+            strcat(files[total], "/");
+        total++;
     }
+    files[total] = NULL;
 
-    if (total==0) {
+    if (total == 0) {
+        free(files);
         return NULL;
     }
 
-    // sort the result
-    if (files != NULL) {
-        for (i = 0; i < total; i++) {
-            int curMax = -1;
-            int j;
-            for (j = 0; j < total - i; j++) {
-                if (curMax == -1 || strcmp(files[curMax], files[j]) < 0)
-                    curMax = j;
-            }
-            char* temp = files[curMax];
-            files[curMax] = files[total - i - 1];
-            files[total - i - 1] = temp;
-        }
-    }
-
+    *numFiles = total;
     return files;
 }
 
+// The menu can hold a few hundred rows, so long listings are shown a
+// page at a time with entries to move between pages.
+#define FILE_MENU_PAGE_SIZE 200
+
+static char* file_menu_item(const char* name)
+{
+    const char *template = "||                                                |/|";
+    char* item = strdup(template);
+    int room = strlen(template) - 3 - 3;
+    int len = strlen(name);
+    memcpy(item + 3, name, len < room ? len : room);
+    return item;
+}
+
 // pass in NULL for fileExtensionOrDirectory and you will get a directory chooser
 char* choose_file_menu(const char* directory, const char* fileExtensionOrDirectory, char** headers[])
 {
-    char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
     int numFiles = 0;
     int numDirs = 0;
     int i;
@@ -687,44 +830,52 @@ char* choose_file_menu(const char* directory, const char* fileExtensionOrDirecto
     }
     else
     {
-        char** list = (char**) malloc((total + 1) * sizeof(char*));
-	list[total] = NULL;
-	const char *template = "||                                                |/|";
+        int page = 0;
+        int pages = (total + FILE_MENU_PAGE_SIZE - 1) / FILE_MENU_PAGE_SIZE;
+        char** list = (char**) malloc((FILE_MENU_PAGE_SIZE + 3) * sizeof(char*));
 
-	for (i = 0; i < numDirs; i++)
-	{
-	    list[i] = strdup(template);
-	    char *t_c2 = list[i] + 3;
-	    char *dirp = strdup(dirs[i] + dir_len);
-	    memcpy(t_c2, dirp, (strlen(dirp)*sizeof(char)));
-	}
-	for (i = 0 ; i < numFiles; i++)
-	{
-	    list[numDirs + i] = strdup(template);
-	    char *t_c2 = list[numDirs + i] + 3;
-	    char *dirp = strdup(files[i] + dir_len);
-	    memcpy(t_c2, dirp, (strlen(dirp)*sizeof(char)));
-	}
-/*
-        for (i = 0 ; i < numDirs; i++)
-        {
-            list[i] = strdup(dirs[i] + dir_len);
-        }
-
-        for (i = 0 ; i < numFiles; i++)
-        {
-            list[numDirs + i] = strdup(files[i] + dir_len);
-        }
-*/
         for (;;)
         {
+            // Build just the rows for this page.
+            int first = page * FILE_MENU_PAGE_SIZE;
+            int last = first + FILE_MENU_PAGE_SIZE;
+            if (last > total)
+                last = total;
+            int n = 0;
+            int has_prev = page > 0;
+            int has_next = page < pages - 1;
+            if (has_prev)
+                list[n++] = strdup("|| <<< previous page                              |/|");
+            for (i = first; i < last; i++) {
+                const char* path = i < numDirs ? dirs[i] : files[i - numDirs];
+                list[n++] = file_menu_item(path + dir_len);
+            }
+            if (has_next)
+                list[n++] = strdup("|| next page >>>                                  |/|");
+            list[n] = NULL;
+
             int chosen_item = get_menu_selection(headers, list, 0, 0, 0, 0);
+            for (i = 0; i < n; i++)
+                free(list[i]);
+
             if (chosen_item == GO_BACK)
                 break;
+            if (chosen_item < 0 || chosen_item >= n)
+                continue;
+            if (has_prev && chosen_item == 0) {
+                page--;
+                continue;
+            }
+            if (has_next && chosen_item == n - 1) {
+                page++;
+                continue;
+            }
+            int index = first + chosen_item - has_prev;
+
             static char ret[PATH_MAX];
-            if (chosen_item < numDirs)
+            if (index < numDirs)
             {
-                char* subret = choose_file_menu(dirs[chosen_item], fileExtensionOrDirectory, headers);
+                char* subret = choose_file_menu(dirs[index], fileExtensionOrDirectory, headers);
                 if (subret != NULL)
                 {
                     strcpy(ret, subret);
@@ -733,11 +884,11 @@ char* choose_file_menu(const char* directory, const char* fileExtensionOrDirecto
                 }
                 continue;
             }
-            strcpy(ret, files[chosen_item - numDirs]);
+            strcpy(ret, files[index - numDirs]);
             return_value = ret;
             break;
         }
-	free_string_array(list);
+        free(list);
     }
 
     free_string_array(files);
@@ -1056,7 +1207,7 @@ int format_device(const char *device, const char *path, const char *fs_type) {
     if (ensure_path_unmounted(path) != 0) {
         if(!strcmp(path,"/cache")) {
 	    fprintf(stderr,"format_volume: /cache stuck, trying umount -l\n");
-	    __system("umount -l /cache");
+	    builtin_umount("/cache", 1);
 	} else {
             LOGE("format_volume failed to unmount \"%s\"\n", v->mount_point);
             return -1;
@@ -1087,6 +1238,7 @@ int format_device(const char *device, const char *path, const char *fs_type) {
     }
 
     if (strcmp(fs_type, "ext4") == 0) {
+        discard_for_format(device);
         reset_ext4fs_info();
         int result = make_ext4fs(device, NULL, NULL, 0, 0, 0);
         if (result != 0) {
@@ -1099,6 +1251,31 @@ int format_device(const char *device, const char *path, const char *fs_type) {
     return format_unknown_device(device, path, fs_type);
 }
 
+#ifndef FITRIM
+struct fstrim_range {
+    uint64_t start;
+    uint64_t len;
+    uint64_t minlen;
+};
+#define FITRIM _IOWR('X', 121, struct fstrim_range)
+#endif
+
+// Files removed from a mounted volume leave their blocks allocated as
+// far as the flash controller knows; ask the filesystem to discard
+// everything that is now free.
+static void trim_mounted_volume(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return;
+    struct fstrim_range range;
+    memset(&range, 0, sizeof(range));
+    range.len = UINT64_MAX;
+    if (ioctl(fd, FITRIM, &range) == 0)
+        LOGI("trimmed %llu bytes on %s\n", (unsigned long long)range.len, path);
+    close(fd);
+}
+
 int format_unknown_device(const char *device, const char* path, const char *fs_type)
 {
     LOGI("formatting unknown device.\n");
@@ -1145,17 +1322,16 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
         return 0;
     }
 
-    static char tmp[PATH_MAX];
-    if (strcmp(path, "/data") == 0) {
-        sprintf(tmp, "cd /data ; for f in $(ls -a | grep -v ^media$); do rm -rf $f; done");
-        __system(tmp);
-    }
-    else {
-        sprintf(tmp, "rm -rf %s/*", path);
-        __system(tmp);
-        sprintf(tmp, "rm -rf %s/.*", path);
-        __system(tmp);
-    }
+    // /data/media is the internal sdcard on some devices; a wipe of /data
+    // must leave it alone.
+    static const char* data_exclude[] = { "/data/media", NULL };
+    const char* const* exclude = NULL;
+    if (strcmp(path, "/data") == 0)
+        exclude = data_exclude;
+    if (dirUnlinkContents(path, exclude) != 0)
+        LOGW("couldn't remove everything in %s (%s)\n", path, strerror(errno));
+    else if (format_discard_mode != FORMAT_DISCARD_OFF)
+        trim_mounted_volume(path);
 
     ensure_path_unmounted(path);
     return 0;
@@ -1845,7 +2021,7 @@ void write_fstab_root(char *path, FILE *file)
 void create_fstab()
 {
     struct stat info;
-    __system("touch /etc/mtab");
+    builtin_touch("/etc/mtab");
     FILE *file = fopen("/etc/fstab", "w");
     if (file == NULL) {
         LOGW("unable to create /etc/fstab.\n");
@@ -1892,9 +2068,7 @@ int bml_check_volume(const char *path) {
     }
     
     ui_print("%s may be rfs.  checking...\n", path);
-    char tmp[PATH_MAX];
-    sprintf(tmp, "mount -t rfs %s %s", vol->device, path);
-    int ret = __system(tmp);
+    int ret = builtin_mount(vol->device, path, "rfs", NULL);
     printf("%d\n", ret);
     return ret == 0 ? 1 : 0;
 }
@@ -1954,8 +2128,9 @@ void handle_failure(int ret)
         return;
     sprintf(tmp, "/sdcard/%s", EXPAND(RECOVERY_FOLDER));
     mkdir(tmp, S_IRWXU);
-    sprintf(tmp, "cp /tmp/recovery.log /sdcard/%s/recovery.log", EXPAND(RECOVERY_FOLDER));
-    __system(tmp);
+    strcat(tmp, "/recovery.log");
+    logger_flush();
+    builtin_cp("/tmp/recovery.log", tmp);
     ui_print("/tmp/recovery.log was copied to /sdcard/%s/recovery.log.  please open Safestrap to report the issue.\n", EXPAND(RECOVERY_FOLDER));
 }
 
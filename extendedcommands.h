@@ -1,5 +1,7 @@
 extern int signature_check_enabled;
 extern int script_assert_enabled;
+extern int strict_crc_enabled;
+extern int install_trace_enabled;
 
 int
 backup_ss_files(const char *backup_script_path);
@@ -22,6 +24,12 @@ toggle_signature_check();
 void
 toggle_script_asserts();
 
+void
+toggle_strict_crc();
+
+void
+toggle_install_trace();
+
 void
 show_choose_zip_menu();
 
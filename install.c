@@ -41,6 +41,11 @@
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 #define PUBLIC_KEYS_FILE "/res/keys"
 
+// With install profiling on, the updater writes a Chrome trace of the
+// install here, and we keep a copy in /cache next to the logs.
+#define UPDATER_TRACE_FILE "/tmp/updater-trace.json"
+#define UPDATER_TRACE_CACHE_FILE "/cache/recovery/updater-trace.json"
+
 // The update binary ask us to install a firmware file on reboot.  Set
 // that up.  Takes ownership of type and filename.
 static int
@@ -54,7 +59,11 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
             LOGE("Failed to find \"%s\" in package", filename+8);
             return INSTALL_ERROR;
         }
-        data_size = entry->uncompLen;
+        if (mzGetZipEntryUncompLen(entry) > INT_MAX) {
+            LOGE("\"%s\" is too large for firmware data\n", filename+8);
+            return INSTALL_ERROR;
+        }
+        data_size = mzGetZipEntryUncompLen(entry);
     } else {
         struct stat st_data;
         if (stat(filename, &st_data) < 0) {
@@ -102,6 +111,29 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
     return INSTALL_SUCCESS;
 }
 
+static void
+save_updater_trace() {
+    FILE* in = fopen(UPDATER_TRACE_FILE, "r");
+    if (in == NULL) {
+        LOGE("can't open %s\n", UPDATER_TRACE_FILE);
+        return;
+    }
+    FILE* out = fopen_path(UPDATER_TRACE_CACHE_FILE, "w");
+    if (out != NULL) {
+        char buf[64 * 1024];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            if (fwrite(buf, 1, n, out) != n) break;
+        }
+        if (fclose(out) == 0 && !ferror(in)) {
+            ui_print("install profile saved to %s\n", UPDATER_TRACE_CACHE_FILE);
+        } else {
+            LOGE("error writing %s\n", UPDATER_TRACE_CACHE_FILE);
+        }
+    }
+    fclose(in);
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary(const char *path, ZipArchive *zip) {
@@ -177,6 +209,12 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //
     //   - the name of the package zip file.
     //
+    // The open package fd is also inherited, and its number is passed in
+    // $UPDATE_PACKAGE_FD so the updater can map the verified file rather
+    // than reopening the path.  $UPDATE_PACKAGE_STRICT_CRC is set when
+    // entries that fail their CRC check should fail the install, and
+    // $UPDATE_PACKAGE_TRACE names the file to write a profile to.
+    //
 
     char** args = malloc(sizeof(char*) * 5);
     args[0] = binary;
@@ -186,9 +224,19 @@ try_update_binary(const char *path, ZipArchive *zip) {
     args[3] = (char*)path;
     args[4] = NULL;
 
+    if (install_trace_enabled) {
+        unlink(UPDATER_TRACE_FILE);
+    }
     pid_t pid = fork();
     if (pid == 0) {
         setenv("UPDATE_PACKAGE", path, 1);
+        char fd_str[16];
+        snprintf(fd_str, sizeof(fd_str), "%d", zip->fd);
+        setenv("UPDATE_PACKAGE_FD", fd_str, 1);
+        if (strict_crc_enabled)
+            setenv("UPDATE_PACKAGE_STRICT_CRC", "1", 1);
+        if (install_trace_enabled)
+            setenv("UPDATE_PACKAGE_TRACE", UPDATER_TRACE_FILE, 1);
         close(pipefd[0]);
         execv(binary, args);
         fprintf(stdout, "E:Can't run %s (%s)\n", binary, strerror(errno));
@@ -245,6 +293,9 @@ try_update_binary(const char *path, ZipArchive *zip) {
 
     int status;
     waitpid(pid, &status, 0);
+    if (install_trace_enabled) {
+        save_updater_trace();
+    }
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         LOGE("Error in %s\n(Status %d)\n", path, WEXITSTATUS(status));
         mzCloseZipArchive(zip);
@@ -350,11 +401,26 @@ install_package(const char *path)
 
     int err;
 
+    /* Try to open the package.  The mapping made here is the one that gets
+     * verified, and its fd is handed on to the update binary, so the
+     * package is only read once and the updater sees exactly the bytes
+     * that were checked.  Packages too big to map are verified through
+     * that same fd instead.  The central directory isn't parsed until
+     * the signature has been checked.
+     */
+    ZipArchive zip;
+    err = mzMapZipArchive(path, &zip);
+    if (err != 0) {
+        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        return INSTALL_CORRUPT;
+    }
+
     if (signature_check_enabled) {
         int numKeys;
         RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
         if (loadedKeys == NULL) {
             LOGE("Failed to load keys\n");
+            mzCloseZipArchive(&zip);
             return INSTALL_CORRUPT;
         }
         LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
@@ -365,23 +431,26 @@ install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
+        if (mzIsZipArchiveMapped(&zip)) {
+            err = verify_data(zip.map.addr, zip.map.length, loadedKeys, numKeys);
+        } else {
+            err = verify_fd(zip.fd, zip.fileLength, loadedKeys, numKeys);
+        }
         free(loadedKeys);
-        LOGI("verify_file returned %d\n", err);
+        LOGI("verify returned %d\n", err);
         if (err != VERIFY_SUCCESS) {
             LOGE("signature verification failed\n");
+            mzCloseZipArchive(&zip);
             return INSTALL_CORRUPT;
         }
     }
 
-    /* Try to open the package.
-     */
-    ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
+    err = mzParseZipArchive(&zip);
     if (err != 0) {
-        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        LOGE("Can't open %s\n(bad)\n", path);
         return INSTALL_CORRUPT;
     }
+    zip.strictCrc = strict_crc_enabled;
 
     /* Verify and install the contents of the package.
      */
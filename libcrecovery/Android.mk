@@ -4,7 +4,7 @@ ifneq ($(TARGET_SIMULATOR),true)
 ifeq ($(TARGET_ARCH),arm)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := system.c popen.c
+LOCAL_SRC_FILES := system.c popen.c builtins.c
 LOCAL_MODULE := libcrecovery
 LOCAL_MODULE_TAGS := eng
 include $(BUILD_STATIC_LIBRARY)
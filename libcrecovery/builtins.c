@@ -0,0 +1,361 @@
+/*
+ * In-process versions of the shell one-liners recovery used to run
+ * through __system().  Each returns 0 on success and -1 with errno set
+ * on failure, where the shell would have exited non-zero.
+ */
+
+#include <sys/types.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "common.h"
+
+#ifndef MNT_DETACH
+#define MNT_DETACH 2
+#endif
+
+/* mkdir -p */
+int
+builtin_mkdir_p(const char *path, mode_t mode)
+{
+	char buf[PATH_MAX];
+	char *p;
+	struct stat st;
+
+	if (strlen(path) >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(buf, path);
+
+	for (p = buf + 1; ; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		char c = *p;
+		*p = '\0';
+		if (mkdir(buf, mode) != 0) {
+			if (errno != EEXIST || stat(buf, &st) != 0)
+				return -1;
+			if (!S_ISDIR(st.st_mode)) {
+				errno = ENOTDIR;
+				return -1;
+			}
+		}
+		*p = c;
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+	}
+	return 0;
+}
+
+/* cp <src> <dst>; a directory <dst> gets <src>'s basename appended. */
+int
+builtin_cp(const char *src, const char *dst)
+{
+	char target[PATH_MAX];
+	char buf[32 * 1024];
+	struct stat st;
+	int in, out;
+	ssize_t n;
+
+	in = open(src, O_RDONLY);
+	if (in < 0)
+		return -1;
+	if (fstat(in, &st) != 0)
+		goto fail_in;
+
+	if (stat(dst, &st) == 0 && S_ISDIR(st.st_mode)) {
+		const char *base = strrchr(src, '/');
+		base = base ? base + 1 : src;
+		if (snprintf(target, sizeof(target), "%s/%s", dst, base) >= (int)sizeof(target)) {
+			errno = ENAMETOOLONG;
+			goto fail_in;
+		}
+		dst = target;
+	}
+
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0)
+		goto fail_in;
+
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			goto fail_out;
+		}
+		char *p = buf;
+		while (n > 0) {
+			ssize_t w = write(out, p, n);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				goto fail_out;
+			}
+			p += w;
+			n -= w;
+		}
+	}
+	close(in);
+	return close(out);
+
+fail_out:
+	{
+		int save = errno;
+		close(out);
+		errno = save;
+	}
+fail_in:
+	{
+		int save = errno;
+		close(in);
+		errno = save;
+	}
+	return -1;
+}
+
+/*
+ * tail -n <lines> <path>, written to <out>.  Reads backwards from the
+ * end of the file, so the cost depends on the output, not the log size.
+ */
+int
+builtin_tail(const char *path, int lines, FILE *out)
+{
+	char buf[4096];
+	off_t end, pos;
+	int fd, found = 0;
+
+	if (lines <= 0)
+		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	end = lseek(fd, 0, SEEK_END);
+	if (end < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* Find the start of the last <lines> lines; a trailing newline
+	 * ends the last line rather than starting an empty one. */
+	pos = end;
+	off_t start = 0;
+	int skip_last = 1;
+	while (pos > 0 && found <= lines) {
+		size_t chunk = pos > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)pos;
+		pos -= chunk;
+		if (pread(fd, buf, chunk, pos) != (ssize_t)chunk) {
+			close(fd);
+			return -1;
+		}
+		size_t i = chunk;
+		while (i > 0) {
+			i--;
+			if (buf[i] != '\n')
+				continue;
+			if (skip_last && pos + (off_t)i == end - 1) {
+				continue;
+			}
+			if (++found == lines) {
+				start = pos + i + 1;
+				pos = 0;
+				break;
+			}
+		}
+		skip_last = 0;
+	}
+
+	lseek(fd, start, SEEK_SET);
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, out);
+	close(fd);
+	return n < 0 ? -1 : 0;
+}
+
+/* touch: create if missing, otherwise bump the timestamps. */
+int
+builtin_touch(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	close(fd);
+	return utime(path, NULL);
+}
+
+/* echo -n <text> > <path> */
+int
+builtin_echo(const char *path, const char *text)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	size_t len = strlen(text);
+	ssize_t w = write(fd, text, len);
+	int save = errno;
+	close(fd);
+	if (w != (ssize_t)len) {
+		errno = w < 0 ? save : EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	unsigned long set;
+	unsigned long clear;
+} mount_options[] = {
+	{ "ro",         MS_RDONLY,      0 },
+	{ "rw",         0,              MS_RDONLY },
+	{ "nosuid",     MS_NOSUID,      0 },
+	{ "suid",       0,              MS_NOSUID },
+	{ "nodev",      MS_NODEV,       0 },
+	{ "dev",        0,              MS_NODEV },
+	{ "noexec",     MS_NOEXEC,      0 },
+	{ "exec",       0,              MS_NOEXEC },
+	{ "sync",       MS_SYNCHRONOUS, 0 },
+	{ "async",      0,              MS_SYNCHRONOUS },
+	{ "remount",    MS_REMOUNT,     0 },
+	{ "noatime",    MS_NOATIME,     0 },
+	{ "atime",      0,              MS_NOATIME },
+	{ "nodiratime", MS_NODIRATIME,  0 },
+	{ "diratime",   0,              MS_NODIRATIME },
+	{ "bind",       MS_BIND,        0 },
+	{ "defaults",   0,              0 },
+	{ NULL,         0,              0 },
+};
+
+/* Split a mount -o string into MS_* flags and the fs-specific rest. */
+static void
+parse_mount_options(const char *options, unsigned long *flags, char *data, size_t size)
+{
+	char buf[1024];
+	char *opt, *save;
+	size_t used = 0;
+
+	*flags = 0;
+	data[0] = '\0';
+	if (options == NULL)
+		return;
+	strncpy(buf, options, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (opt = strtok_r(buf, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+		int i;
+		for (i = 0; mount_options[i].name != NULL; i++) {
+			if (strcmp(opt, mount_options[i].name) == 0)
+				break;
+		}
+		if (mount_options[i].name != NULL) {
+			*flags |= mount_options[i].set;
+			*flags &= ~mount_options[i].clear;
+			continue;
+		}
+		size_t len = strlen(opt);
+		if (used + len + 2 > size)
+			continue;
+		if (used)
+			data[used++] = ',';
+		memcpy(data + used, opt, len + 1);
+		used += len;
+	}
+}
+
+/*
+ * mount [-t <type>] [-o <options>] <device> <dir>.  With no type (or
+ * "auto") every non-nodev filesystem in /proc/filesystems is tried in
+ * turn, as busybox mount does.
+ */
+int
+builtin_mount(const char *device, const char *dir, const char *type, const char *options)
+{
+	unsigned long flags;
+	char data[1024];
+
+	parse_mount_options(options, &flags, data, sizeof(data));
+
+	if (type != NULL && strcmp(type, "auto") != 0)
+		return mount(device, dir, type, flags, data);
+
+	FILE *f = fopen("/proc/filesystems", "r");
+	if (f == NULL)
+		return -1;
+	char line[128];
+	int ret = -1;
+	int err = ENODEV;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "nodev", 5) == 0)
+			continue;
+		char *fs = line;
+		while (isspace((unsigned char)*fs))
+			fs++;
+		char *e = fs + strlen(fs);
+		while (e > fs && isspace((unsigned char)e[-1]))
+			*--e = '\0';
+		if (*fs == '\0')
+			continue;
+		if (mount(device, dir, fs, flags, data) == 0) {
+			ret = 0;
+			break;
+		}
+		/* Keep the most useful error: anything beats "wrong fs type". */
+		if (errno != EINVAL || err == ENODEV)
+			err = errno;
+	}
+	fclose(f);
+	if (ret != 0)
+		errno = err;
+	return ret;
+}
+
+/* mount <dir>, looking <dir> up in /etc/fstab. */
+int
+builtin_mount_fstab(const char *dir)
+{
+	FILE *f = fopen("/etc/fstab", "r");
+	if (f == NULL)
+		return -1;
+
+	char line[512];
+	int ret = -1;
+	errno = ENOENT;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *save;
+		char *device = strtok_r(line, " \t\n", &save);
+		char *mount_point = strtok_r(NULL, " \t\n", &save);
+		char *type = strtok_r(NULL, " \t\n", &save);
+		char *options = strtok_r(NULL, " \t\n", &save);
+		if (device == NULL || device[0] == '#' || mount_point == NULL)
+			continue;
+		if (strcmp(mount_point, dir) == 0) {
+			ret = builtin_mount(device, dir, type, options);
+			break;
+		}
+	}
+	int save_errno = errno;
+	fclose(f);
+	errno = save_errno;
+	return ret;
+}
+
+/* umount [-l] <dir> */
+int
+builtin_umount(const char *dir, int lazy)
+{
+	if (lazy)
+		return umount2(dir, MNT_DETACH);
+	return umount(dir);
+}
@@ -2,11 +2,22 @@
 #define LIBCRECOVERY_COMMON_H
 
 #include <stdio.h>
+#include <sys/types.h>
 
 int __system(const char *command);
 FILE * __popen(const char *program, const char *type);
 int __pclose(FILE *iop);
 
+/* builtins.c: in-process replacements for common shell one-liners */
+int builtin_mkdir_p(const char *path, mode_t mode);
+int builtin_cp(const char *src, const char *dst);
+int builtin_tail(const char *path, int lines, FILE *out);
+int builtin_touch(const char *path);
+int builtin_echo(const char *path, const char *text);
+int builtin_mount(const char *device, const char *dir, const char *type, const char *options);
+int builtin_mount_fstab(const char *dir);
+int builtin_umount(const char *dir, int lazy);
+
 #define PHONE_SHELL "/sbin/bash"
 
 #endif
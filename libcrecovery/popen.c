@@ -41,6 +41,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <paths.h>
+#include <pthread.h>
 
 #include "defines.h"
 
@@ -50,6 +51,13 @@ static struct pid {
 	pid_t pid;
 } *pidlist;
 
+/*
+ * Guards pidlist, and keeps a pipe from being inherited by a child that
+ * another thread forks before the pipe's parent end is set up; that
+ * child would hold the write end open and the reader would never see EOF.
+ */
+static pthread_mutex_t pidlist_lock = PTHREAD_MUTEX_INITIALIZER;
+
 FILE *
 __popen(const char *program, const char *type)
 {
@@ -66,7 +74,9 @@ __popen(const char *program, const char *type)
 	if ((cur = malloc(sizeof(struct pid))) == NULL)
 		return (NULL);
 
+	pthread_mutex_lock(&pidlist_lock);
 	if (pipe(pdes) < 0) {
+		pthread_mutex_unlock(&pidlist_lock);
 		free(cur);
 		return (NULL);
 	}
@@ -75,6 +85,7 @@ __popen(const char *program, const char *type)
 	case -1:			/* Error. */
 		(void)close(pdes[0]);
 		(void)close(pdes[1]);
+		pthread_mutex_unlock(&pidlist_lock);
 		free(cur);
 		return (NULL);
 		/* NOTREACHED */
@@ -128,6 +139,7 @@ __popen(const char *program, const char *type)
 	cur->pid =  pid;
 	cur->next = pidlist;
 	pidlist = cur;
+	pthread_mutex_unlock(&pidlist_lock);
 
 	return (iop);
 }
@@ -145,12 +157,22 @@ __pclose(FILE *iop)
 	pid_t pid;
 
 	/* Find the appropriate file pointer. */
+	pthread_mutex_lock(&pidlist_lock);
 	for (last = NULL, cur = pidlist; cur; last = cur, cur = cur->next)
 		if (cur->fp == iop)
 			break;
 
-	if (cur == NULL)
+	if (cur == NULL) {
+		pthread_mutex_unlock(&pidlist_lock);
 		return (-1);
+	}
+
+	/* Remove the entry from the linked list. */
+	if (last == NULL)
+		pidlist = cur->next;
+	else
+		last->next = cur->next;
+	pthread_mutex_unlock(&pidlist_lock);
 
 	(void)fclose(iop);
 
@@ -158,11 +180,6 @@ __pclose(FILE *iop)
 		pid = waitpid(cur->pid, &pstat, 0);
 	} while (pid == -1 && errno == EINTR);
 
-	/* Remove the entry from the linked list. */
-	if (last == NULL)
-		pidlist = cur->next;
-	else
-		last->next = cur->next;
 	free(cur);
 
 	return (pid == -1 ? -1 : pstat);
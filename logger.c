@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+// Batch file writes up to this size, and don't hold any line back for
+// longer than LOGGER_FLUSH_MS.
+#define LOGGER_BATCH_SIZE (64 * 1024)
+#define LOGGER_FLUSH_MS 250
+
+static int log_fd = -1;
+static int pipe_rd = -1;
+static int wake_rd = -1;
+static int wake_wr = -1;
+static int running = 0;
+static pthread_t logger_thread;
+static struct timespec start_time;
+
+static pthread_mutex_t logger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logger_flushed = PTHREAD_COND_INITIALIZER;
+static unsigned int flush_requested = 0;
+static unsigned int flush_done = 0;
+
+// The in-memory tail, guarded by logger_lock.
+static LogLine ring[LOGGER_RING_LINES];
+static int ring_next = 0;
+static int ring_count = 0;
+
+// Logger-thread-only state.
+static char out_buf[LOGGER_BATCH_SIZE];
+static size_t out_len = 0;
+static long out_since = 0;          // msec when out_buf became non-empty
+static LogLine current;             // the line being assembled
+static size_t current_len = 0;
+
+static long elapsed_msec() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) * 1000 +
+           (now.tv_nsec - start_time.tv_nsec) / 1000000;
+}
+
+static void set_cloexec(int fd) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void write_out() {
+    char* p = out_buf;
+    while (out_len > 0) {
+        ssize_t w = write(log_fd, p, out_len);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            // Nowhere left to complain; drop the batch.
+            break;
+        }
+        p += w;
+        out_len -= w;
+    }
+    out_len = 0;
+}
+
+static void end_line() {
+    current.text[current_len] = '\0';
+
+    pthread_mutex_lock(&logger_lock);
+    ring[ring_next] = current;
+    ring_next = (ring_next + 1) % LOGGER_RING_LINES;
+    if (ring_count < LOGGER_RING_LINES)
+        ring_count++;
+    pthread_mutex_unlock(&logger_lock);
+
+    current_len = 0;
+}
+
+// Queue output for the file, as is, and split it into lines for the
+// ring.
+static void consume(const char* data, size_t len) {
+    while (len > 0) {
+        if (out_len == LOGGER_BATCH_SIZE)
+            write_out();
+        if (out_len == 0)
+            out_since = elapsed_msec();
+
+        const char* nl = memchr(data, '\n', len);
+        size_t seg = nl ? (size_t)(nl - data) + 1 : len;
+        size_t room = LOGGER_BATCH_SIZE - out_len;
+        if (seg > room)
+            seg = room;
+
+        memcpy(out_buf + out_len, data, seg);
+        out_len += seg;
+
+        size_t keep = seg;
+        if (nl && seg == (size_t)(nl - data) + 1)
+            keep--;
+        if (keep > LOGGER_LINE_MAX - 1 - current_len)
+            keep = LOGGER_LINE_MAX - 1 - current_len;
+        memcpy(current.text + current_len, data, keep);
+        current_len += keep;
+
+        if (nl && seg == (size_t)(nl - data) + 1)
+            end_line();
+        data += seg;
+        len -= seg;
+    }
+}
+
+// Read whatever is in the pipe right now.  Returns 0 at EOF.
+static int drain_pipe() {
+    char buf[16 * 1024];
+    for (;;) {
+        ssize_t n = read(pipe_rd, buf, sizeof(buf));
+        if (n > 0) {
+            consume(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n == 0 ? 0 : 1;
+    }
+}
+
+static void* logger_main(void* arg) {
+    struct pollfd fds[2];
+    int alive = 1;
+    fds[0].fd = pipe_rd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_rd;
+    fds[1].events = POLLIN;
+
+    while (alive) {
+        int timeout = -1;
+        if (out_len > 0) {
+            timeout = LOGGER_FLUSH_MS - (int)(elapsed_msec() - out_since);
+            if (timeout < 0)
+                timeout = 0;
+        }
+        int r = poll(fds, 2, timeout);
+        if (r < 0 && errno != EINTR)
+            break;
+
+        if (r > 0 && (fds[0].revents & (POLLIN | POLLHUP)))
+            alive = drain_pipe();
+
+        if (r > 0 && (fds[1].revents & POLLIN)) {
+            char c[16];
+            while (read(wake_rd, c, sizeof(c)) > 0)
+                ;
+            pthread_mutex_lock(&logger_lock);
+            unsigned int target = flush_requested;
+            pthread_mutex_unlock(&logger_lock);
+
+            if (alive)
+                alive = drain_pipe();
+            write_out();
+
+            pthread_mutex_lock(&logger_lock);
+            flush_done = target;
+            pthread_cond_broadcast(&logger_flushed);
+            pthread_mutex_unlock(&logger_lock);
+        } else if (out_len > 0 && elapsed_msec() - out_since >= LOGGER_FLUSH_MS) {
+            write_out();
+        }
+    }
+
+    write_out();
+    pthread_mutex_lock(&logger_lock);
+    running = 0;
+    flush_done = flush_requested;
+    pthread_cond_broadcast(&logger_flushed);
+    pthread_mutex_unlock(&logger_lock);
+    return NULL;
+}
+
+int logger_init(const char* path) {
+    int p[2], w[2];
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (log_fd < 0)
+        return -1;
+    set_cloexec(log_fd);
+    if (pipe(p) < 0) {
+        close(log_fd);
+        return -1;
+    }
+    if (pipe(w) < 0) {
+        close(p[0]);
+        close(p[1]);
+        close(log_fd);
+        return -1;
+    }
+    pipe_rd = p[0];
+    wake_rd = w[0];
+    wake_wr = w[1];
+    set_cloexec(pipe_rd);
+    set_cloexec(wake_rd);
+    set_cloexec(wake_wr);
+    fcntl(pipe_rd, F_SETFL, O_NONBLOCK);
+    fcntl(wake_rd, F_SETFL, O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+    // More slack before a burst of output makes writers wait on us.
+    fcntl(pipe_rd, F_SETPIPE_SZ, 1024 * 1024);
+#endif
+
+    running = 1;
+    if (pthread_create(&logger_thread, NULL, logger_main, NULL) != 0) {
+        running = 0;
+        close(p[0]);
+        close(p[1]);
+        close(w[0]);
+        close(w[1]);
+        close(log_fd);
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(p[1], STDOUT_FILENO);
+    dup2(p[1], STDERR_FILENO);
+    close(p[1]);
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+    return 0;
+}
+
+int logger_running() {
+    return running;
+}
+
+void logger_flush() {
+    if (!running)
+        return;
+    fflush(stdout);
+    fflush(stderr);
+
+    pthread_mutex_lock(&logger_lock);
+    unsigned int target = ++flush_requested;
+    pthread_mutex_unlock(&logger_lock);
+
+    write(wake_wr, "", 1);
+
+    pthread_mutex_lock(&logger_lock);
+    while ((int)(flush_done - target) < 0)
+        pthread_cond_wait(&logger_flushed, &logger_lock);
+    pthread_mutex_unlock(&logger_lock);
+}
+
+int logger_tail(LogLine* out, int max) {
+    pthread_mutex_lock(&logger_lock);
+    int n = ring_count < max ? ring_count : max;
+    int first = (ring_next - n + LOGGER_RING_LINES) % LOGGER_RING_LINES;
+    int i;
+    for (i = 0; i < n; i++)
+        out[i] = ring[(first + i) % LOGGER_RING_LINES];
+    pthread_mutex_unlock(&logger_lock);
+    return n;
+}
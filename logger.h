@@ -0,0 +1,31 @@
+#ifndef RECOVERY_LOGGER_H_
+#define RECOVERY_LOGGER_H_
+
+// Recovery's stdout and stderr (and so those of every child it runs)
+// feed a pipe drained by a logger thread.  The thread keeps the most
+// recent lines in memory for the UI, and appends the output unchanged
+// to the log file in large batched writes.
+
+#define LOGGER_RING_LINES 512
+#define LOGGER_LINE_MAX 256
+
+typedef struct {
+    char text[LOGGER_LINE_MAX];
+} LogLine;
+
+// Redirect stdout/stderr through the logger, appending to path.
+// Returns 0 on success; on failure nothing has been redirected.
+int logger_init(const char* path);
+
+// Returns non-zero if logger_init() succeeded.
+int logger_running();
+
+// Block until everything written to stdout/stderr before the call is
+// in the log file.
+void logger_flush();
+
+// Copy up to max of the most recent lines, oldest first, into out.
+// Returns the number copied.
+int logger_tail(LogLine* out, int max);
+
+#endif  // RECOVERY_LOGGER_H_
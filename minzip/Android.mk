@@ -17,3 +17,35 @@ LOCAL_MODULE := libminzip
 LOCAL_CFLAGS += -Wall
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := hash_bench.c
+
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_MODULE := minzip_hash_bench
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_STATIC_LIBRARIES := libminzip libz libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := extract_test.c
+
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_MODULE := minzip_extract_test
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_STATIC_LIBRARIES := libminzip libz libc
+
+include $(BUILD_EXECUTABLE)
@@ -22,7 +22,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "DirUtil.h"
 
@@ -165,116 +167,314 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
-int
-dirUnlinkHierarchy(const char *path)
+/*
+ * Parallel tree deletion.
+ *
+ * Each directory still to be emptied is a work item on a shared stack.
+ * A worker opens the directory relative to its parent, unlinkat()s
+ * everything that isn't a directory straight away (d_type tells us
+ * which is which without a stat on most filesystems) and pushes
+ * subdirectories as new items.  An item counts its outstanding
+ * subdirectories and keeps its directory open until the last one is
+ * gone; then it is closed, removed from its parent with unlinkat() and
+ * the parent is notified, so removal cascades back up the tree without
+ * anyone waiting.  Nothing below the top is looked up by path, so a
+ * directory swapped for a symlink mid-walk can't redirect the deletion.
+ *
+ * The stack is LIFO, so workers go depth-first and keep the number of
+ * live items (and path strings) small.
+ */
+
+#define UNLINK_MAX_THREADS 4
+
+typedef struct UnlinkItem {
+    struct UnlinkItem *parent;
+    struct UnlinkItem *next;    /* on the work stack */
+    char *path;                 /* for the exclude list */
+    size_t name;                /* offset of the last component in path */
+    DIR *dir;                   /* open once scanned */
+    int pending;                /* 1 for our own scan + live children */
+    bool keep;                  /* holds something excluded; don't rmdir */
+} UnlinkItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UnlinkItem *stack;
+    int live;                   /* items not yet finished */
+    int error;                  /* first errno seen, or 0 */
+    const UnlinkItem *root;
+    bool keepRoot;
+    const char * const *exclude;
+} UnlinkState;
+
+static bool
+isExcluded(const UnlinkState *state, const char *path)
 {
-    struct stat st;
-    DIR *dir;
-    struct dirent *de;
-    int fail = 0;
+    const char * const *ex;
+    if (state->exclude == NULL) {
+        return false;
+    }
+    for (ex = state->exclude; *ex != NULL; ex++) {
+        if (strcmp(*ex, path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    /* is it a file or directory? */
-    if (lstat(path, &st) < 0) {
-        return -1;
+static void
+noteError(UnlinkState *state, int err)
+{
+    pthread_mutex_lock(&state->lock);
+    if (state->error == 0) {
+        state->error = err ? err : EIO;
     }
+    pthread_mutex_unlock(&state->lock);
+}
 
-    /* a file, so unlink it */
-    if (!S_ISDIR(st.st_mode)) {
-        return unlink(path);
+/* Drop one reference on "item"; when it reaches zero close and remove
+ * the (now empty) directory and walk up to the parent, which is still
+ * open since this item held a reference on it.  Called with the lock
+ * held.
+ */
+static void
+releaseItem(UnlinkState *state, UnlinkItem *item)
+{
+    while (item != NULL && --item->pending == 0) {
+        UnlinkItem *parent = item->parent;
+        if (item->dir != NULL) {
+            closedir(item->dir);
+        }
+        if (item->keep || (item == state->root && state->keepRoot)) {
+            if (parent != NULL) {
+                parent->keep = true;
+            }
+        } else {
+            /* rmdir outside the lock; nobody else can touch this item
+             * any more.
+             */
+            pthread_mutex_unlock(&state->lock);
+            int ret = parent == NULL ? rmdir(item->path) :
+                    unlinkat(dirfd(parent->dir), item->path + item->name,
+                            AT_REMOVEDIR);
+            int err = errno;
+            pthread_mutex_lock(&state->lock);
+            if (ret != 0 && state->error == 0) {
+                state->error = err;
+            }
+        }
+        free(item->path);
+        free(item);
+        if (--state->live == 0) {
+            pthread_cond_broadcast(&state->cond);
+        }
+        item = parent;
     }
+}
 
-    /* a directory, so open handle */
-    dir = opendir(path);
+/* Only the top of the tree is opened by path; everything below it is
+ * opened relative to its parent, which stays open until all of its
+ * subdirectories are done.
+ */
+static void
+scanItem(UnlinkState *state, UnlinkItem *item)
+{
+    int fd;
+    if (item->parent == NULL) {
+        fd = open(item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    } else {
+        fd = openat(dirfd(item->parent->dir), item->path + item->name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
     if (dir == NULL) {
-        return -1;
+        noteError(state, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        /* Make sure the failure propagates instead of rmdir()ing a
+         * parent we know we couldn't empty.
+         */
+        pthread_mutex_lock(&state->lock);
+        item->keep = true;
+        pthread_mutex_unlock(&state->lock);
+        return;
     }
+    /* Set before any child is pushed, so its openat() can use it. */
+    item->dir = dir;
 
-    /* recurse over components */
-    errno = 0;
+    size_t pathLen = strlen(item->path);
+    struct dirent *de;
     while ((de = readdir(dir)) != NULL) {
-//TODO: don't blow the stack
-        char dn[PATH_MAX];
         if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
             continue;
         }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
-            fail = 1;
+
+        bool isDir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                noteError(state, errno);
+                continue;
+            }
+            isDir = S_ISDIR(st.st_mode);
+        }
+
+        /* Only build a full path when we need one: to name a child
+         * item, and to check the exclude list.
+         */
+        char *childPath = NULL;
+        if (isDir || state->exclude != NULL) {
+            size_t nameLen = strlen(de->d_name);
+            childPath = malloc(pathLen + nameLen + 2);
+            if (childPath == NULL) {
+                noteError(state, ENOMEM);
+                break;
+            }
+            memcpy(childPath, item->path, pathLen);
+            childPath[pathLen] = '/';
+            memcpy(childPath + pathLen + 1, de->d_name, nameLen + 1);
+
+            if (isExcluded(state, childPath)) {
+                free(childPath);
+                pthread_mutex_lock(&state->lock);
+                item->keep = true;
+                pthread_mutex_unlock(&state->lock);
+                continue;
+            }
+        }
+
+        if (!isDir) {
+            free(childPath);
+            if (unlinkat(fd, de->d_name, 0) != 0 && errno != ENOENT) {
+                noteError(state, errno);
+            }
+            continue;
+        }
+
+        UnlinkItem *child = calloc(1, sizeof(*child));
+        if (child == NULL) {
+            free(childPath);
+            noteError(state, ENOMEM);
             break;
         }
-        errno = 0;
-    }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
-        int save = errno;
-        closedir(dir);
-        errno = save;
-        return -1;
-    }
+        child->path = childPath;
+        child->name = pathLen + 1;
+        child->parent = item;
+        child->pending = 1;
 
-    /* close directory handle */
-    if (closedir(dir) < 0) {
-        return -1;
+        pthread_mutex_lock(&state->lock);
+        item->pending++;
+        state->live++;
+        child->next = state->stack;
+        state->stack = child;
+        pthread_cond_signal(&state->cond);
+        pthread_mutex_unlock(&state->lock);
     }
+}
+
+static void *
+unlinkWorker(void *cookie)
+{
+    UnlinkState *state = (UnlinkState *)cookie;
+
+    pthread_mutex_lock(&state->lock);
+    for (;;) {
+        while (state->stack == NULL && state->live > 0) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+        if (state->stack == NULL) {
+            break;
+        }
+        UnlinkItem *item = state->stack;
+        state->stack = item->next;
+        pthread_mutex_unlock(&state->lock);
 
-    /* delete target directory */
-    return rmdir(path);
+        scanItem(state, item);
+
+        pthread_mutex_lock(&state->lock);
+        releaseItem(state, item);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
 }
 
-int
-dirSetHierarchyPermissions(const char *path,
-        int uid, int gid, int dirMode, int fileMode)
+static int
+unlinkTree(const char *path, bool keepRoot, const char * const *exclude)
 {
     struct stat st;
-    if (lstat(path, &st)) {
+
+    /* is it a file or directory? */
+    if (lstat(path, &st) < 0) {
         return -1;
     }
 
-    /* ignore symlinks */
-    if (S_ISLNK(st.st_mode)) {
-        return 0;
+    /* a file, so unlink it */
+    if (!S_ISDIR(st.st_mode)) {
+        return keepRoot ? 0 : unlink(path);
     }
 
-    /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    UnlinkItem *root = calloc(1, sizeof(*root));
+    if (root == NULL || (root->path = strdup(path)) == NULL) {
+        free(root);
+        errno = ENOMEM;
         return -1;
     }
+    /* "/data/" and "/data" should behave the same for the exclude list. */
+    size_t len = strlen(root->path);
+    while (len > 1 && root->path[len - 1] == '/') {
+        root->path[--len] = '\0';
+    }
+    root->pending = 1;
 
-    /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
-            return -1;
-        }
-
-        errno = 0;
-        const struct dirent *de;
-        while (errno == 0 && (de = readdir(dir)) != NULL) {
-            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-                continue;
-            }
+    UnlinkState state;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    state.stack = root;
+    state.live = 1;
+    state.error = 0;
+    state.root = root;
+    state.keepRoot = keepRoot;
+    state.exclude = exclude;
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
-                errno = 0;
-            } else if (errno == 0) {
-                errno = -1;
-            }
-        }
-
-        if (errno != 0) {
-            int save = errno;
-            closedir(dir);
-            errno = save;
-            return -1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus < 1 ? 1 : cpus > UNLINK_MAX_THREADS ?
+            UNLINK_MAX_THREADS : (int)cpus;
+    pthread_t threads[UNLINK_MAX_THREADS];
+    int started = 0;
+    int i;
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, unlinkWorker, &state)) {
+            break;
         }
+        started++;
+    }
 
-        if (closedir(dir)) {
-            return -1;
-        }
+    /* The calling thread works too. */
+    unlinkWorker(&state);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
     }
 
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+
+    if (state.error != 0) {
+        errno = state.error;
+        return -1;
+    }
     return 0;
 }
+
+int
+dirUnlinkHierarchy(const char *path)
+{
+    return unlinkTree(path, false, NULL);
+}
+
+int
+dirUnlinkContents(const char *path, const char * const *exclude)
+{
+    return unlinkTree(path, true, exclude);
+}
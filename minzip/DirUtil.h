@@ -37,15 +37,18 @@ int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName);
 
 /* rm -rf <path>
+ *
+ * Subdirectories are emptied in parallel.  Keeps going after an error
+ * and returns -1 with errno set from the first failure.
  */
 int dirUnlinkHierarchy(const char *path);
 
-/* chown -R <uid>:<gid> <path>
- * chmod -R <mode> <path>
+/* Empty <path> (everything "rm -rf <path>/{*,.*}" would remove), but
+ * leave <path> itself in place.
  *
- * Sets directories to <dirMode> and files to <fileMode>.  Skips symlinks.
+ * "exclude" is an optional NULL-terminated list of paths under <path>
+ * (eg. "/data/media") that are left alone, along with their contents.
  */
-int dirSetHierarchyPermissions(const char *path,
-         int uid, int gid, int dirMode, int fileMode);
+int dirUnlinkContents(const char *path, const char * const *exclude);
 
 #endif  // MINZIP_DIRUTIL_H_
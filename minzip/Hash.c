@@ -5,7 +5,10 @@
  * happening very infrequently.  We use probing, and don't worry much
  * about tombstone removal.
  */
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #define LOG_TAG "minzip"
@@ -388,3 +391,222 @@ void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
         minProbe, maxProbe, totalProbe, numEntries, pHashTable->tableSize,
         (float) totalProbe / (float) numEntries);
 }
+
+
+/*
+ * ===========================================================================
+ *      Name hash
+ * ===========================================================================
+ */
+
+/* NameHash load factor; Robin Hood probing copes with a fuller table */
+#define NAME_LOAD_NUMER 3       // 75%
+#define NAME_LOAD_DENOM 4
+
+#define NAME_HASH_MAX_DIST 0xffff
+
+/*
+ * Hash a name.  The multiply-by-31 loop leaves the low bits, which pick
+ * the home bucket, poorly mixed for names that differ near the end, so
+ * finish with the MurmurHash3 avalanche step.
+ */
+static unsigned int computeNameHash(const char* name, size_t nameLen)
+{
+    unsigned int hash = 2;
+
+    while (nameLen--)
+        hash = hash * 31 + (unsigned char) *name++;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/*
+ * Create a table sized for "maxItems" names.
+ */
+NameHash* mzNameHashCreate(size_t maxItems)
+{
+    NameHash* pTable;
+    size_t size = (maxItems * NAME_LOAD_DENOM) / NAME_LOAD_NUMER + 1;
+
+    if (maxItems > UINT_MAX / 2 || size > UINT_MAX / 2 ||
+        size > SIZE_MAX / 2 / sizeof(NameHashSlot))
+        return NULL;
+
+    pTable = (NameHash*) malloc(sizeof(*pTable));
+    if (pTable == NULL)
+        return NULL;
+
+    pTable->tableSize = roundUpPower2(size);
+    pTable->numItems = 0;
+    pTable->maxItems = maxItems;
+    pTable->pSlots =
+        (NameHashSlot*) calloc(pTable->tableSize, sizeof(NameHashSlot));
+    if (pTable->pSlots == NULL) {
+        free(pTable);
+        return NULL;
+    }
+
+    return pTable;
+}
+
+/*
+ * Free the table.
+ */
+void mzNameHashFree(NameHash* pTable)
+{
+    if (pTable == NULL)
+        return;
+    free(pTable->pSlots);
+    free(pTable);
+}
+
+/*
+ * Compare a slot against a name.  Only names longer than the inline
+ * prefix have to look at the caller's copy, and only once everything
+ * stored in the slot has matched.
+ */
+static bool slotMatches(const NameHashSlot* pSlot, unsigned int hash,
+    const char* name, size_t nameLen)
+{
+    if (pSlot->hash != hash || pSlot->nameLen != nameLen)
+        return false;
+    if (nameLen <= NAME_HASH_PREFIX)
+        return memcmp(pSlot->prefix, name, nameLen) == 0;
+    return memcmp(pSlot->prefix, name, NAME_HASH_PREFIX) == 0 &&
+        memcmp(pSlot->name + NAME_HASH_PREFIX, name + NAME_HASH_PREFIX,
+            nameLen - NAME_HASH_PREFIX) == 0;
+}
+
+/*
+ * Add a name.
+ *
+ * Walking from the home bucket, the new item takes the place of the first
+ * item that is closer to its own home, which then moves along in search
+ * of a slot in turn.  An item with the same name would have been met
+ * before that first swap, so we only need to compare up to there.
+ *
+ * If an item ends up too far from home to record, we fail, and the item
+ * being carried is lost; the caller has to discard the table.
+ */
+long mzNameHashAdd(NameHash* pTable, const char* name, size_t nameLen,
+    unsigned int index)
+{
+    unsigned int mask = pTable->tableSize - 1;
+    unsigned int idx;
+    NameHashSlot item;
+    bool swapped = false;
+
+    if (nameLen > 0xffff || pTable->numItems >= pTable->maxItems)
+        return -1;
+
+    memset(&item, 0, sizeof(item));
+    item.hash = computeNameHash(name, nameLen);
+    item.nameLen = nameLen;
+    item.dist = 1;
+    item.index = index;
+    memcpy(item.prefix, name,
+        nameLen < NAME_HASH_PREFIX ? nameLen : NAME_HASH_PREFIX);
+    item.name = name;
+
+    for (idx = item.hash & mask; ; idx = (idx + 1) & mask) {
+        NameHashSlot* pSlot = &pTable->pSlots[idx];
+
+        if (pSlot->dist == 0) {
+            *pSlot = item;
+            pTable->numItems++;
+            return index;
+        }
+        if (pSlot->dist < item.dist) {
+            NameHashSlot tmp = *pSlot;
+            *pSlot = item;
+            item = tmp;
+            swapped = true;
+        } else if (!swapped && pSlot->dist == item.dist &&
+            slotMatches(pSlot, item.hash, name, nameLen))
+        {
+            return pSlot->index;
+        }
+
+        if (item.dist == NAME_HASH_MAX_DIST) {
+            LOGW("Name hash probe limit reached (%u items)\n",
+                pTable->numItems);
+            return -1;
+        }
+        item.dist++;
+    }
+}
+
+/*
+ * Look up a name.
+ */
+long mzNameHashFind(const NameHash* pTable, const char* name, size_t nameLen)
+{
+    unsigned int mask = pTable->tableSize - 1;
+    unsigned int hash, idx, dist;
+
+    if (nameLen > 0xffff)
+        return -1;
+
+    hash = computeNameHash(name, nameLen);
+    for (idx = hash & mask, dist = 1; ; idx = (idx + 1) & mask, dist++) {
+        const NameHashSlot* pSlot = &pTable->pSlots[idx];
+
+        /* empty, or an item closer to home than ours would be */
+        if (pSlot->dist < dist)
+            return -1;
+        if (slotMatches(pSlot, hash, name, nameLen))
+            return pSlot->index;
+    }
+}
+
+/*
+ * Evaluate the amount of probing required for the specified table.
+ *
+ * Every slot records how far its item is from home, so the cost of
+ * finding each item can be read straight out of the table.  A search
+ * for a missing name steps over every item at least as far from home as
+ * the search is, which we total up for each possible home bucket.
+ */
+void mzNameHashProbeCount(const NameHash* pTable)
+{
+    unsigned int mask = pTable->tableSize - 1;
+    unsigned int i;
+    int numItems, minProbe, maxProbe, totalProbe;
+    long long missProbe;
+
+    numItems = maxProbe = totalProbe = 0;
+    minProbe = 65536*32767;
+    missProbe = 0;
+
+    for (i = 0; i < pTable->tableSize; i++) {
+        const NameHashSlot* pSlot = &pTable->pSlots[i];
+        unsigned int idx, dist;
+
+        if (pSlot->dist != 0) {
+            int count = pSlot->dist - 1;
+
+            numItems++;
+            if (count < minProbe)
+                minProbe = count;
+            if (count > maxProbe)
+                maxProbe = count;
+            totalProbe += count;
+        }
+
+        for (idx = i, dist = 1; pTable->pSlots[idx].dist >= dist;
+            idx = (idx + 1) & mask, dist++)
+        {
+            missProbe++;
+        }
+    }
+
+    LOGI("Probe: min=%d max=%d, total=%d in %d (%u), avg=%.3f, miss avg=%.3f\n",
+        minProbe, maxProbe, totalProbe, numItems, pTable->tableSize,
+        numItems ? (float) totalProbe / (float) numItems : 0.0f,
+        (float) missProbe / (float) pTable->tableSize);
+}
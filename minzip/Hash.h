@@ -183,4 +183,78 @@ typedef unsigned int (*HashCalcFunc)(const void* item);
 void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
     HashCompareFunc cmpFunc);
 
+/*
+ * Typed hash table mapping byte-string names to item indices, for tables
+ * that are built once and then only searched (eg. Zip entry names).
+ *
+ * Open addressing with Robin Hood insertion.  Each slot carries the full
+ * hash, the name length and the first few bytes of the name, so a probe
+ * that doesn't match is rejected without touching the caller's data;
+ * names no longer than NAME_HASH_PREFIX are compared entirely in the
+ * slot.  "dist" is the slot's distance from its home bucket plus one, so
+ * zero marks an empty slot, and a search stops as soon as it reaches a
+ * slot closer to home than the one it is looking for.
+ *
+ * This structure should be considered opaque.
+ */
+#define NAME_HASH_PREFIX 12
+
+typedef struct NameHashSlot {
+    unsigned int    hash;
+    unsigned short  nameLen;
+    unsigned short  dist;           /* 0 == empty */
+    unsigned int    index;
+    char            prefix[NAME_HASH_PREFIX];
+    const char*     name;           /* caller's copy, not null-terminated */
+} NameHashSlot;
+
+typedef struct NameHash {
+    unsigned int    tableSize;      /* must be power of 2 */
+    unsigned int    numItems;
+    unsigned int    maxItems;
+    NameHashSlot*   pSlots;
+} NameHash;
+
+/*
+ * Create a table with room for "maxItems" names.  The table doesn't
+ * grow, and doesn't copy the names; they have to outlive it.
+ *
+ * Returns NULL if unable to allocate the table.
+ */
+NameHash* mzNameHashCreate(size_t maxItems);
+
+/*
+ * Free a table.
+ */
+void mzNameHashFree(NameHash* pTable);
+
+/*
+ * Add "name" with item index "index", unless it's already there.
+ *
+ * Returns "index" if the name was added, the index stored for it if it
+ * was already present, or -1 if the table is full or the name is longer
+ * than 65535 bytes.
+ */
+long mzNameHashAdd(NameHash* pTable, const char* name, size_t nameLen,
+    unsigned int index);
+
+/*
+ * Look up "name".  Returns its item index, or -1 if it isn't present.
+ */
+long mzNameHashFind(const NameHash* pTable, const char* name, size_t nameLen);
+
+/*
+ * Get total size of the table (for memory usage calculations).
+ */
+INLINE size_t mzNameHashMemUsage(const NameHash* pTable) {
+    return sizeof(NameHash) + pTable->tableSize * sizeof(NameHashSlot);
+}
+
+/*
+ * Evaluate table performance, like mzHashTableProbeCount(): logs the
+ * number of extra probes needed to find each item, and the number a
+ * search for a missing name needs on average.
+ */
+void mzNameHashProbeCount(const NameHash* pTable);
+
 #endif /*_MINZIP_HASH*/
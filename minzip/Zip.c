@@ -3,15 +3,22 @@
  *
  * Simple Zip file support.
  */
-#include "safe_iop.h"
 #include "zlib.h"
 
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <stdint.h>     // for uintptr_t
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stdint.h>     // for intptr_t, uintptr_t
 #include <stdlib.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
@@ -64,6 +71,20 @@ enum {
     EXTSIZ =  8,
     EXTLEN = 12,
 
+    ZIP64_ENDSIG = 0x06064b50,  // PK66
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDTOT = 32,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_LOCSIG = 0x07064b50,  // PK67
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_EXTID = 0x0001,       // Zip64 extended information extra field
+
     LOCSIG = 0x04034b50,      // PK34
     LOCHDR = 30,
 
@@ -91,71 +112,81 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
+    LOGI("   off=%lld comp=%lld uncomp=%lld how=%d\n", pEntry->offset,
         pEntry->compLen, pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
-/*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
- */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static bool addEntryToHashTable(ZipArchive* pArchive, unsigned int i)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    const ZipEntry* pEntry = &pArchive->pEntries[i];
+    long found;
+
+    found = mzNameHashAdd(pArchive->pHash, pEntry->fileName,
+                pEntry->fileNameLen, i);
+    if (found < 0) {
+        LOGW("Can't index '%.*s' in Zip\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    if (found != (long) i) {
+        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        /* keep going */
+    }
+    return true;
 }
 
+#if SORT_ENTRIES
 /*
- * (This is a mzHashTableLookup callback.)
+ * (This is a qsort callback.)
  *
- * find a ZipEntry struct by name.
+ * Order entries bytewise by name, shorter first on a common prefix.
+ * Duplicate names keep their central directory order.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static int compareZipEntries(const void* ventry1, const void* ventry2)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    unsigned int len = entry1->fileNameLen < entry2->fileNameLen ?
+            entry1->fileNameLen : entry2->fileNameLen;
+    int diff = memcmp(entry1->fileName, entry2->fileName, len);
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    if (diff != 0)
+        return diff;
+    if (entry1->fileNameLen != entry2->fileNameLen)
+        return entry1->fileNameLen < entry2->fileNameLen ? -1 : 1;
+    /* The names sit in the central directory in entry order. */
+    return entry1->fileName < entry2->fileName ? -1 :
+            entry1->fileName > entry2->fileName;
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
- *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * Return the index of the first entry whose name begins with prefix,
+ * or numEntries if there is none.  Relies on the entries being sorted:
+ * everything sharing a prefix is contiguous and starts at the lower
+ * bound of the prefix itself.
  */
-static unsigned int computeHash(const char* name, int nameLen)
-{
-    unsigned int hash = 2;
-
-    while (nameLen--)
-        hash = hash * 31 + *name++;
-
-    return hash;
-}
-
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+static unsigned int findFirstWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int prefixLen)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    unsigned int low = 0, high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        const ZipEntry* pEntry = &pArchive->pEntries[mid];
+        unsigned int len = pEntry->fileNameLen < prefixLen ?
+                pEntry->fileNameLen : prefixLen;
+        int diff = memcmp(pEntry->fileName, prefix, len);
+
+        if (diff < 0 || (diff == 0 && pEntry->fileNameLen < prefixLen))
+            low = mid + 1;
+        else
+            high = mid;
     }
+    return low;
 }
+#endif
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
 {
@@ -178,47 +209,57 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
 }
 
 /*
- * Parse the contents of a Zip archive.  After confirming that the file
- * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * Read "len" bytes at file offset "off", without moving the fd offset.
+ */
+static bool readFully(int fd, void* buf, size_t len, long long off)
+{
+    unsigned char* p = (unsigned char*) buf;
+
+    while (len > 0) {
+        ssize_t n = pread64(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * Locate the central directory, which runs to the end of the window
+ * [base, base + baseLen); "baseOffset" is the window's file offset and
+ * the window must end at the end of the file.
  *
- * Returns "true" on success.
+ * The EOCD only has room for 16-bit entry counts and 32-bit offsets.
+ * When either is saturated, the real values are in the Zip64 EOCD
+ * record, found through the locator just before the EOCD.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool findCentralDir(const unsigned char* base, size_t baseLen,
+    long long baseOffset, long long* pCdOffset, long long* pNumEntries)
 {
-    bool result = false;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
-    unsigned int val;
+    unsigned long long numEntries, cdOffset;
 
-    /*
-     * The first 4 bytes of the file will either be the local header
-     * signature for the first file (LOCSIG) or, if the archive doesn't
-     * have any files in it, the end-of-central-directory signature (ENDSIG).
-     */
-    val = get4LE(pMap->addr);
-    if (val == ENDSIG) {
-        LOGI("Found Zip archive, but it looks empty\n");
-        goto bail;
-    } else if (val != LOCSIG) {
-        LOGV("Not a Zip archive (found 0x%08x)\n", val);
-        goto bail;
-    }
+    if (baseLen < ENDHDR)
+        return false;
 
     /*
      * Find the EOCD.  We'll find it immediately unless they have a file
      * comment.
      */
-    ptr = pMap->addr + pMap->length - ENDHDR;
+    ptr = base + baseLen - ENDHDR;
 
-    while (ptr >= (const unsigned char*) pMap->addr) {
+    while (ptr >= base) {
         if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
             break;
         ptr--;
     }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    if (ptr < base) {
         LOGI("Could not find end-of-central-directory in Zip\n");
-        goto bail;
+        return false;
     }
 
     /*
@@ -229,30 +270,166 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     numEntries = get2LE(ptr + ENDSUB);
     cdOffset = get4LE(ptr + ENDOFF);
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    if (numEntries == 0xffff || cdOffset == 0xffffffff ||
+            get4LE(ptr + ENDSIZ) == 0xffffffff) {
+        const unsigned char* loc = ptr - ZIP64_LOCHDR;
+        const unsigned char* rec;
+        unsigned long long recOffset;
+
+        if (ptr - base >= ZIP64_LOCHDR && get4LE(loc) == ZIP64_LOCSIG) {
+            recOffset = get8LE(loc + ZIP64_LOCOFF);
+            if ((size_t)(loc - base) < ZIP64_ENDHDR ||
+                recOffset < (unsigned long long) baseOffset ||
+                recOffset - baseOffset > (size_t)(loc - base) - ZIP64_ENDHDR)
+            {
+                LOGW("Bad Zip64 end-of-central-directory offset %llu\n",
+                    recOffset);
+                return false;
+            }
+            rec = base + (recOffset - baseOffset);
+            if (get4LE(rec) != ZIP64_ENDSIG) {
+                LOGW("Missed the Zip64 end-of-central-directory sig\n");
+                return false;
+            }
+            numEntries = get8LE(rec + ZIP64_ENDTOT);
+            cdOffset = get8LE(rec + ZIP64_ENDOFF);
+        }
+    }
+
+    LOGVV("numEntries=%llu cdOffset=%llu\n", numEntries, cdOffset);
+    if (numEntries == 0 || numEntries > UINT_MAX / sizeof(ZipEntry) ||
+        cdOffset >= (unsigned long long)(baseOffset + baseLen))
+    {
+        LOGW("Invalid entries=%llu offset=%llu (len=%lld)\n",
+            numEntries, cdOffset, baseOffset + (long long) baseLen);
+        return false;
+    }
+
+    *pCdOffset = cdOffset;
+    *pNumEntries = numEntries;
+    return true;
+}
+
+/*
+ * Replace a saturated 32-bit size or offset with the next value from a
+ * Zip64 extra field.
+ */
+static bool takeZip64Value(long long* pValue, const unsigned char** pData,
+    unsigned int* pLeft)
+{
+    unsigned long long val;
+
+    if (*pValue != 0xffffffffLL)
+        return true;
+    if (*pLeft < 8)
+        return false;
+    val = get8LE(*pData);
+    if (val > LLONG_MAX)
+        return false;
+    *pValue = val;
+    *pData += 8;
+    *pLeft -= 8;
+    return true;
+}
+
+/*
+ * Pick the 64-bit values out of a central directory entry's Zip64 extra
+ * field.  They appear in a fixed order, each only if the corresponding
+ * 32-bit field is 0xffffffff.
+ */
+static bool parseZip64Extra(const unsigned char* extra, unsigned int extraLen,
+    ZipEntry* pEntry, long long* pLocalHdrOffset)
+{
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int size = get2LE(extra + 2);
+
+        if (size > extraLen - 4)
+            break;
+        if (id == ZIP64_EXTID) {
+            const unsigned char* data = extra + 4;
+            return takeZip64Value(&pEntry->uncompLen, &data, &size) &&
+                takeZip64Value(&pEntry->compLen, &data, &size) &&
+                takeZip64Value(pLocalHdrOffset, &data, &size);
+        }
+        extra += 4 + size;
+        extraLen -= 4 + size;
+    }
+    return false;
+}
+
+/*
+ * Parse the contents of a Zip archive.  After confirming that the file
+ * is in fact a Zip, we scan out the contents of the central directory and
+ * store it in a hash table.
+ *
+ * "pMap" holds the file from "mapOffset" to the end, which is either all
+ * of it or just the central directory onwards.  Local headers outside the
+ * map are read from the fd.
+ *
+ * Returns "true" on success.
+ */
+static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap,
+    long long mapOffset)
+{
+    bool result = false;
+    const unsigned char* base = (const unsigned char*) pMap->addr;
+    const unsigned char* end = base + pMap->length;
+    const unsigned char* ptr;
+    unsigned char buf[LOCHDR];
+    long long fileLength = mapOffset + pMap->length;
+    long long cdOffset, numEntries64;
+    unsigned int i, numEntries;
+    unsigned int val;
+
+    /*
+     * The first 4 bytes of the file will either be the local header
+     * signature for the first file (LOCSIG) or, if the archive doesn't
+     * have any files in it, the end-of-central-directory signature (ENDSIG).
+     */
+    if (mapOffset == 0) {
+        val = get4LE(base);
+    } else if (readFully(pArchive->fd, buf, 4, 0)) {
+        val = get4LE(buf);
+    } else {
+        LOGW("Can't read start of zip file\n");
+        goto bail;
+    }
+    if (val == ENDSIG) {
+        LOGI("Found Zip archive, but it looks empty\n");
+        goto bail;
+    } else if (val != LOCSIG) {
+        LOGV("Not a Zip archive (found 0x%08x)\n", val);
+        goto bail;
+    }
+
+    if (!findCentralDir(base, pMap->length, mapOffset, &cdOffset,
+            &numEntries64))
+        goto bail;
+    if (cdOffset < mapOffset) {
+        LOGW("Central directory at %lld is outside the map\n", cdOffset);
         goto bail;
     }
+    numEntries = numEntries64;
 
     /*
      * Create data structures to hold entries.
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
+    pArchive->pHash = mzNameHashCreate(numEntries);
     if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
         goto bail;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = base + (cdOffset - mapOffset);
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
+        unsigned int fileNameLen, extraLen, commentLen;
+        long long localHdrOffset;
         const unsigned char* localHdr;
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if (ptr + CENHDR > end) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -266,7 +443,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if (fileName + fileNameLen > (const char*)end) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -275,60 +452,9 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
-        //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
+        //LOGI("%d: localHdr=%lld fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
 
         pEntry->fileNameLen = fileNameLen;
@@ -340,6 +466,20 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
 
+        if (pEntry->compLen == 0xffffffffLL ||
+            pEntry->uncompLen == 0xffffffffLL ||
+            localHdrOffset == 0xffffffffLL)
+        {
+            const unsigned char* extra = (const unsigned char*) fileName +
+                fileNameLen;
+            if (extra + extraLen > end ||
+                !parseZip64Extra(extra, extraLen, pEntry, &localHdrOffset))
+            {
+                LOGW("Bad Zip64 extra field (at %d)\n", i);
+                goto bail;
+            }
+        }
+
         /* These two are necessary for finding the mode of the file.
          */
         pEntry->versionMadeBy = get2LE(ptr + CENVEM);
@@ -352,16 +492,19 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        // localHdrOffset is untrusted; everything here is 64-bit so none
+        // of the sums below can overflow once it is known to be in range.
+        if (localHdrOffset > fileLength - LOCHDR) {
+            LOGW("Bad offset to local header: %lld (at %d)\n",
+                localHdrOffset, i);
             goto bail;
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        if (localHdrOffset >= mapOffset) {
+            localHdr = base + (localHdrOffset - mapOffset);
+        } else if (readFully(pArchive->fd, buf, LOCHDR, localHdrOffset)) {
+            localHdr = buf;
+        } else {
+            LOGW("Can't read local header (at %d)\n", i);
             goto bail;
         }
         if (get4LE(localHdr) != LOCSIG) {
@@ -370,11 +513,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->offset = localHdrOffset + LOCHDR
             + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        if (pEntry->compLen > fileLength - pEntry->offset) {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -384,7 +523,8 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
          * Can't do this now if we're sorting, because entries
          * will move around.
          */
-        addEntryToHashTable(pArchive->pHash, pEntry);
+        if (!addEntryToHashTable(pArchive, i))
+            goto bail;
 #endif
 
         //dumpEntry(pEntry);
@@ -392,14 +532,17 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     }
 
 #if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort once now that everything is parsed; inserting each entry
+     * into place as we went cost a memmove per entry.  The hash table
+     * has to wait until all entries are in their final places,
+     * otherwise the pointers will probably point to the wrong things.
      */
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), compareZipEntries);
     for (i = 0; i < numEntries; i++) {
         /* Add to hash table; no need to lock here.
          */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
+        if (!addEntryToHashTable(pArchive, i))
+            goto bail;
     }
 #endif
 
@@ -407,7 +550,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
+        mzNameHashFree(pArchive->pHash);
         pArchive->pHash = NULL;
     }
     return result;
@@ -429,48 +572,191 @@ bail:
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
-    MemMapping map;
-    int err;
+    int fd;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
-    map.addr = NULL;
-    memset(pArchive, 0, sizeof(*pArchive));
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) {
+        int err = errno ? errno : -1;
+        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
+        memset(pArchive, 0, sizeof(*pArchive));
+        pArchive->fd = -1;
+        return err;
+    }
+
+    return mzOpenZipArchiveFd(fd, pArchive);
+}
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
-    if (pArchive->fd < 0) {
-        err = errno ? errno : -1;
+/*
+ * The largest central directory we'll copy into memory when the archive
+ * can't be mapped.  Even 64k entries with long names come in well under.
+ */
+#define MAX_CD_WINDOW (64 * 1024 * 1024)
+
+/*
+ * Copy the end of the file, from the start of the central directory on,
+ * into a heap buffer that stands in for the mapping.  This is how we open
+ * archives that are too big to map, such as packages over 2GB on a
+ * 32-bit device, or over the 32-bit off_t that mmap() takes there.
+ */
+static int loadCentralDir(int fd, long long fileLength, ZipArchive* pArchive)
+{
+    /* Enough for the EOCD, the longest comment and the Zip64 records. */
+    long long start = fileLength - (ENDHDR + 0xffff + ZIP64_LOCHDR +
+        ZIP64_ENDHDR);
+    long long cdOffset, numEntries;
+    unsigned char* buf;
+    size_t len;
+
+    if (start < 0)
+        start = 0;
+    len = fileLength - start;
+    buf = (unsigned char*) malloc(len);
+    if (buf == NULL || !readFully(fd, buf, len, start))
+        goto fail;
+
+    if (!findCentralDir(buf, len, start, &cdOffset, &numEntries))
+        goto fail;
+    if (cdOffset < start) {
+        if (fileLength - cdOffset > MAX_CD_WINDOW) {
+            LOGW("Central directory too large (%lld bytes)\n",
+                fileLength - cdOffset);
+            goto fail;
+        }
+        free(buf);
+        start = cdOffset;
+        len = fileLength - start;
+        buf = (unsigned char*) malloc(len);
+        if (buf == NULL || !readFully(fd, buf, len, start))
+            goto fail;
+    }
+
+    pArchive->cdBuf = buf;
+    pArchive->map.addr = buf;
+    pArchive->map.length = len;
+    pArchive->map.baseAddr = NULL;
+    pArchive->map.baseLength = 0;
+    pArchive->mapOffset = start;
+    return 0;
+
+fail:
+    free(buf);
+    return -1;
+}
+
+/*
+ * Open a Zip archive from a file descriptor that is already open for
+ * reading, eg. one inherited from recovery.  The archive takes ownership
+ * of "fd" and closes it in mzCloseZipArchive(), including on failure.
+ *
+ * The whole file is mapped, regardless of the current offset, unless it
+ * is too large; then only the central directory is kept in memory.
+ */
+int mzOpenZipArchiveFd(int fd, ZipArchive* pArchive)
+{
+    int err = mzMapZipArchiveFd(fd, pArchive);
+    if (err != 0)
+        return err;
+    return mzParseZipArchive(pArchive);
+}
+
+/*
+ * First half of mzOpenZipArchive(): open and map the file, but don't
+ * look at its contents, so that a caller can check the signature of an
+ * untrusted package before any of it is parsed.
+ */
+int mzMapZipArchive(const char* fileName, ZipArchive* pArchive)
+{
+    int fd;
+
+    LOGV("Mapping archive '%s' %p\n", fileName, pArchive);
+
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) {
+        int err = errno ? errno : -1;
         LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
-        goto bail;
+        memset(pArchive, 0, sizeof(*pArchive));
+        pArchive->fd = -1;
+        return err;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
+    return mzMapZipArchiveFd(fd, pArchive);
+}
+
+/*
+ * Like mzMapZipArchive(), for an already-open file.  A file too large to
+ * map is left unmapped here; mzParseZipArchive() reads its central
+ * directory.
+ */
+int mzMapZipArchiveFd(int fd, ZipArchive* pArchive)
+{
+    long long fileLength;
+    int err;
+
+    memset(pArchive, 0, sizeof(*pArchive));
+
+    pArchive->fd = fd;
+
+    fileLength = lseek64(fd, 0, SEEK_END);
+    if (fileLength < 0) {
         err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
+        LOGW("Can't find length of fd %d: %s\n", fd, strerror(errno));
         goto bail;
     }
+    if (fileLength < ENDHDR) {
+        err = -1;
+        LOGV("File too small to be zip (%lld)\n", fileLength);
+        goto bail;
+    }
+    pArchive->fileLength = fileLength;
+
+    if ((unsigned long long) fileLength > SIZE_MAX ||
+        lseek(fd, 0, SEEK_SET) != 0 ||
+        sysMapFileInShmem(fd, &pArchive->map) != 0)
+    {
+        memset(&pArchive->map, 0, sizeof(pArchive->map));
+        LOGI("Zip archive is %lld bytes; reading it in place\n", fileLength);
+    }
+    lseek64(fd, 0, SEEK_SET);
+
+    err = 0;
+
+bail:
+    if (err != 0)
+        mzCloseZipArchive(pArchive);
+    return err;
+}
+
+/*
+ * Second half of mzOpenZipArchive(): find and parse the central
+ * directory of an archive opened by mzMapZipArchive().  The archive is
+ * closed if this fails.
+ */
+int mzParseZipArchive(ZipArchive* pArchive)
+{
+    int fd = pArchive->fd;
+    int err;
 
-    if (map.length < ENDHDR) {
+    if (pArchive->map.addr == NULL &&
+        loadCentralDir(fd, pArchive->fileLength, pArchive) != 0)
+    {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+        LOGW("Map of fd %d failed\n", fd);
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (!parseZipArchive(pArchive, &pArchive->map, pArchive->mapOffset)) {
         err = -1;
-        LOGV("Parsing '%s' failed\n", fileName);
+        LOGV("Parsing fd %d failed\n", fd);
         goto bail;
     }
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
 
 bail:
     if (err != 0)
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
     return err;
 }
 
@@ -483,86 +769,452 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 {
     LOGV("Closing archive %p\n", pArchive);
 
+    mzStopPrefetch(pArchive);
+
     if (pArchive->fd >= 0)
         close(pArchive->fd);
-    if (pArchive->map.addr != NULL)
+    if (pArchive->cdBuf != NULL)
+        free(pArchive->cdBuf);
+    else if (pArchive->map.addr != NULL)
         sysReleaseShmem(&pArchive->map);
 
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
+    mzNameHashFree(pArchive->pHash);
+
+    pArchive->fd = -1;
+    pArchive->cdBuf = NULL;
+    pArchive->map.addr = NULL;
+    pArchive->pHash = NULL;
+    pArchive->pEntries = NULL;
+}
+
+/*
+ * Find a matching entry.
+ *
+ * Returns NULL if no matching entry found.
+ */
+const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
+        const char* entryName)
+{
+    long i = mzNameHashFind(pArchive->pHash, entryName, strlen(entryName));
+
+    if (i < 0)
+        return NULL;
+    return &pArchive->pEntries[i];
+}
+
+/*
+ * Return true if the entry is a symbolic link.
+ */
+bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
+{
+    if ((pEntry->versionMadeBy & 0xff00) == CENVEM_UNIX) {
+        return S_ISLNK(pEntry->externalFileAttributes >> 16);
+    }
+    return false;
+}
+
+/*
+ * ===========================================================================
+ *      Readahead
+ * ===========================================================================
+ */
+
+/*
+ * The most we ask for in one posix_fadvise() call, which is also how much
+ * room has to open up in the budget before the prefetch thread is woken.
+ * Neighbouring entries less than PREFETCH_GAP apart are requested
+ * together, local headers and all.
+ */
+#define PREFETCH_SLICE (1024 * 1024)
+#define PREFETCH_GAP (64 * 1024)
+
+/*
+ * The plan is the queued entries in reading order.  Positions along it
+ * are counted in compressed bytes, "ends[i]" being the position just
+ * past slot i; the reader's position moves as queued entries are read,
+ * and the prefetch thread keeps its own at most "budget" bytes ahead.
+ */
+typedef struct ZipPrefetch {
+    int                 fd;
+    const ZipEntry*     pEntries;
+    size_t              budget;
+
+    unsigned int*       plan;       // entry index per slot
+    long long*          ends;
+    int*                next;       // next slot for the same entry, or -1
+    int*                first;      // first slot per entry, or -1
+    unsigned int        numPlanned;
+    unsigned int        maxPlanned;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           thread;
+    bool                started;
+    bool                stop;
+    int                 readSlot;   // -1 until a queued entry is read
+    long long           readPos;
+    unsigned int        issueSlot;
+    long long           issuePos;
+} ZipPrefetch;
+
+static long long planStart(const ZipPrefetch *pf, unsigned int slot)
+{
+    return slot == 0 ? 0 : pf->ends[slot - 1];
+}
+
+static void adviseWillNeed(int fd, long long offset, long long len)
+{
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise64(fd, offset, len, POSIX_FADV_WILLNEED);
+#else
+    readahead(fd, offset, len);
+#endif
+}
+
+static bool prefetchQueue(ZipArchive *pArchive, unsigned int index)
+{
+    ZipPrefetch *pf = pArchive->pPrefetch;
+    unsigned int slot;
+    int *pLink;
+
+    if (pf == NULL) {
+        unsigned int i;
+
+        pf = (ZipPrefetch *)calloc(1, sizeof(ZipPrefetch));
+        if (pf == NULL)
+            return false;
+        pf->first = (int *)malloc(pArchive->numEntries * sizeof(int));
+        if (pf->first == NULL) {
+            free(pf);
+            return false;
+        }
+        for (i = 0; i < pArchive->numEntries; i++)
+            pf->first[i] = -1;
+        pf->fd = pArchive->fd;
+        pf->pEntries = pArchive->pEntries;
+        pf->readSlot = -1;
+        pArchive->pPrefetch = pf;
+    }
+    if (pf->started)
+        return false;
+
+    if (pf->numPlanned == pf->maxPlanned) {
+        unsigned int newMax = pf->maxPlanned ? pf->maxPlanned * 2 : 64;
+        unsigned int *plan;
+        long long *ends;
+        int *next;
+
+        if (newMax > INT_MAX / sizeof(long long))
+            return false;
+        plan = (unsigned int *)realloc(pf->plan, newMax * sizeof(*plan));
+        if (plan == NULL)
+            return false;
+        pf->plan = plan;
+        ends = (long long *)realloc(pf->ends, newMax * sizeof(*ends));
+        if (ends == NULL)
+            return false;
+        pf->ends = ends;
+        next = (int *)realloc(pf->next, newMax * sizeof(*next));
+        if (next == NULL)
+            return false;
+        pf->next = next;
+        pf->maxPlanned = newMax;
+    }
+
+    slot = pf->numPlanned++;
+    pf->plan[slot] = index;
+    pf->ends[slot] = planStart(pf, slot) + pArchive->pEntries[index].compLen;
+    pf->next[slot] = -1;
+    for (pLink = &pf->first[index]; *pLink >= 0; pLink = &pf->next[*pLink])
+        ;
+    *pLink = slot;
+    return true;
+}
+
+/*
+ * Queue "pEntry" for readahead.
+ */
+bool mzPrefetchZipEntry(ZipArchive *pArchive, const ZipEntry *pEntry)
+{
+    return prefetchQueue(pArchive, mzGetZipEntryIndex(pArchive, pEntry));
+}
+
+/*
+ * Queue everything under "zipDir", in the order mzExtractRecursive()
+ * visits it.
+ */
+bool mzPrefetchZipDir(ZipArchive *pArchive, const char *zipDir)
+{
+    size_t zipDirLen = strlen(zipDir);
+    char *zpath;
+    unsigned int i = 0;
+    bool seenMatch = false;
+    bool ok = true;
+
+    /* Same canonical form as mzExtractRecursive(): one trailing slash,
+     * unless zipDir is empty.
+     */
+    zpath = (char *)malloc(zipDirLen + 2);
+    if (zpath == NULL)
+        return false;
+    memcpy(zpath, zipDir, zipDirLen);
+    if (zipDirLen > 0 && zpath[zipDirLen - 1] != '/')
+        zpath[zipDirLen++] = '/';
+    zpath[zipDirLen] = '\0';
+
+#if SORT_ENTRIES
+    i = findFirstWithPrefix(pArchive, zpath, zipDirLen);
+#endif
+    for (; ok && i < pArchive->numEntries; i++) {
+        const ZipEntry *pEntry = &pArchive->pEntries[i];
+
+        if (pEntry->fileNameLen < zipDirLen ||
+                strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
+#if SORT_ENTRIES
+            if (seenMatch)
+                break;
+#endif
+            continue;
+        }
+        seenMatch = true;
+        ok = prefetchQueue(pArchive, i);
+    }
+    free(zpath);
+    return ok;
+}
+
+static void *prefetchThread(void *arg)
+{
+    ZipPrefetch *pf = (ZipPrefetch *)arg;
+
+    pthread_mutex_lock(&pf->lock);
+    while (!pf->stop) {
+        const ZipEntry *pEntry;
+        unsigned int slot;
+        long long limit, start, end, count;
+
+        /* Don't bother with whatever the reader has already passed. */
+        if (pf->issuePos < pf->readPos)
+            pf->issuePos = pf->readPos;
+        while (pf->issueSlot < pf->numPlanned &&
+                pf->ends[pf->issueSlot] <= pf->issuePos)
+            pf->issueSlot++;
+
+        limit = pf->readPos + pf->budget;
+        if (pf->issueSlot >= pf->numPlanned || pf->issuePos >= limit) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+        if (limit - pf->issuePos > PREFETCH_SLICE)
+            limit = pf->issuePos + PREFETCH_SLICE;
+
+        /* One slice: the rest of this entry, plus as many of the next
+         * as are close by in the file.
+         */
+        slot = pf->issueSlot;
+        pEntry = &pf->pEntries[pf->plan[slot]];
+        start = pEntry->offset + (pf->issuePos - planStart(pf, slot));
+        count = pf->ends[slot] - pf->issuePos;
+        if (count > limit - pf->issuePos)
+            count = limit - pf->issuePos;
+        end = start + count;
+        while (++slot < pf->numPlanned && pf->issuePos + count < limit &&
+                end == pEntry->offset + pEntry->compLen) {
+            long long take;
+
+            pEntry = &pf->pEntries[pf->plan[slot]];
+            if (pEntry->offset < end || pEntry->offset - end > PREFETCH_GAP)
+                break;
+            take = pEntry->compLen;
+            if (take > limit - pf->issuePos - count)
+                take = limit - pf->issuePos - count;
+            end = pEntry->offset + take;
+            count += take;
+        }
+        pf->issuePos += count;
+
+        pthread_mutex_unlock(&pf->lock);
+        adviseWillNeed(pf->fd, start, end - start);
+        pthread_mutex_lock(&pf->lock);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+/*
+ * Start reading ahead through the queued entries.
+ */
+bool mzStartPrefetch(ZipArchive *pArchive, size_t budget)
+{
+    ZipPrefetch *pf = pArchive->pPrefetch;
 
-    pArchive->fd = -1;
-    pArchive->pHash = NULL;
-    pArchive->pEntries = NULL;
+    if (pf == NULL || pf->started || pf->numPlanned == 0)
+        return false;
+    if (budget < PREFETCH_SLICE)
+        budget = PREFETCH_SLICE;
+    pf->budget = budget;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    if (pthread_create(&pf->thread, NULL, prefetchThread, pf) != 0) {
+        LOGW("Can't start prefetch thread\n");
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->lock);
+        return false;
+    }
+    pf->started = true;
+    LOGI("Prefetching %u entries (%lld bytes), %zu bytes ahead\n",
+        pf->numPlanned, pf->ends[pf->numPlanned - 1], budget);
+    return true;
 }
 
 /*
- * Find a matching entry.
- *
- * Returns NULL if no matching entry found.
+ * Stop the prefetch thread and forget the plan.
  */
-const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
-        const char* entryName)
+void mzStopPrefetch(ZipArchive *pArchive)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    ZipPrefetch *pf = pArchive->pPrefetch;
+
+    if (pf == NULL)
+        return;
+    if (pf->started) {
+        pthread_mutex_lock(&pf->lock);
+        pf->stop = true;
+        pthread_cond_signal(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+        pthread_join(pf->thread, NULL);
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->lock);
+    }
+    free(pf->plan);
+    free(pf->ends);
+    free(pf->next);
+    free(pf->first);
+    free(pf);
+    pArchive->pPrefetch = NULL;
+}
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+/*
+ * Tell the prefetch thread that "done" bytes of "pEntry"'s compressed
+ * data have been read.  A read of an entry that isn't queued, or was
+ * only queued before the current read position, is ignored.
+ */
+static void prefetchNote(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    long long done)
+{
+    ZipPrefetch *pf = pArchive->pPrefetch;
+    int slot;
+    long long pos;
+
+    if (pf == NULL || !pf->started)
+        return;
+
+    pthread_mutex_lock(&pf->lock);
+    slot = pf->readSlot;
+    if (slot < 0 || &pf->pEntries[pf->plan[slot]] != pEntry) {
+        slot = pf->first[pEntry - pf->pEntries];
+        while (slot >= 0 && slot <= pf->readSlot)
+            slot = pf->next[slot];
+    }
+    if (slot >= 0) {
+        if (done > pEntry->compLen)
+            done = pEntry->compLen;
+        pos = planStart(pf, slot) + done;
+        /* A new slot never starts behind the reader; going back over
+         * the current one (eg. to check it, then extract it) is ignored.
+         */
+        if (slot != pf->readSlot || pos > pf->readPos) {
+            pf->readSlot = slot;
+            pf->readPos = pos;
+            if (pf->issueSlot < pf->numPlanned &&
+                    pos + (long long)pf->budget >= pf->issuePos + PREFETCH_SLICE)
+                pthread_cond_signal(&pf->cond);
+        }
+    }
+    pthread_mutex_unlock(&pf->lock);
 }
 
 /*
- * Return true if the entry is a symbolic link.
+ * zlib-compatible crc32().  Zip uses the same CRC-32 polynomial as the
+ * ARMv8 CRC32 instructions, so use those when the compiler targets them;
+ * otherwise it's zlib's table-driven version.
  */
-bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
+static unsigned long computeCrc(unsigned long crc, const unsigned char *data,
+        size_t len)
 {
-    if ((pEntry->versionMadeBy & 0xff00) == CENVEM_UNIX) {
-        return S_ISLNK(pEntry->externalFileAttributes >> 16);
+#if defined(__ARM_FEATURE_CRC32)
+    uint32_t c = ~(uint32_t)crc;
+
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        c = __crc32b(c, *data++);
+        len--;
     }
-    return false;
+    while (len >= 8) {
+        c = __crc32d(c, *(const uint64_t *)data);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = __crc32b(c, *data++);
+        len--;
+    }
+    return ~c;
+#else
+    while (len > 0) {
+        uInt n = len > 0x40000000 ? 0x40000000 : (uInt)len;
+        crc = crc32(crc, data, n);
+        data += n;
+        len -= n;
+    }
+    return crc;
+#endif
 }
 
 /* Call processFunction on the uncompressed data of a STORED entry.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+    void *cookie, unsigned long *pCrc)
 {
-    size_t bytesLeft = pEntry->compLen;
+    long long bytesLeft = pEntry->compLen;
     while (bytesLeft > 0) {
         unsigned char buf[32 * 1024];
         ssize_t n;
         size_t count;
         bool ret;
 
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
+        count = sizeof(buf);
+        if (bytesLeft < (long long)count) {
+            count = bytesLeft;
         }
         n = read(pArchive->fd, buf, count);
         if (n < 0 || (size_t)n != count) {
             LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
             return false;
         }
+        bytesLeft -= count;
+        prefetchNote(pArchive, pEntry, pEntry->compLen - bytesLeft);
+        *pCrc = computeCrc(*pCrc, buf, n);
         ret = processFunction(buf, n, cookie);
         if (!ret) {
             return false;
         }
-        bytesLeft -= count;
     }
     return true;
 }
 
 static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+    void *cookie, unsigned long *pCrc)
 {
-    long result = -1;
+    long long result = -1;
+    long long totalOut = 0;
     unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
+    long long compRemaining;
 
     compRemaining = pEntry->compLen;
 
@@ -600,9 +1252,9 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     do {
         /* read as much as we can */
         if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
+            long getSize = (compRemaining > (long long)sizeof(readBuf)) ?
+                        (long)sizeof(readBuf) : (long)compRemaining;
+            LOGVV("+++ reading %ld bytes (%lld left)\n",
                 getSize, compRemaining);
 
             int cc = read(pArchive->fd, readBuf, getSize);
@@ -612,6 +1264,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             }
 
             compRemaining -= getSize;
+            prefetchNote(pArchive, pEntry, pEntry->compLen - compRemaining);
 
             zstream.next_in = readBuf;
             zstream.avail_in = getSize;
@@ -630,11 +1283,13 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
         {
             long procSize = zstream.next_out - procBuf;
             LOGVV("+++ processing %d bytes\n", (int) procSize);
+            *pCrc = computeCrc(*pCrc, procBuf, procSize);
             bool ret = processFunction(procBuf, procSize, cookie);
             if (!ret) {
                 LOGW("Process function elected to fail (in inflate)\n");
                 goto z_bail;
             }
+            totalOut += procSize;
 
             zstream.next_out = procBuf;
             zstream.avail_out = sizeof(procBuf);
@@ -643,8 +1298,8 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
 
     assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
 
-    // success!
-    result = zstream.total_out;
+    // success!  (zstream.total_out is only a uLong, too small for Zip64.)
+    result = totalOut;
 
 z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
@@ -652,7 +1307,7 @@ z_bail:
 bail:
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
                 result, pEntry->uncompLen);
         return false;
     }
@@ -660,50 +1315,86 @@ bail:
 }
 
 /*
- * Stream the uncompressed data through the supplied function,
- * passing cookie to it each time it gets called.  processFunction
- * may be called more than once.
- *
- * If processFunction returns false, the operation is abandoned and
- * mzProcessZipEntryContents() immediately returns false.
- *
- * This is useful for calculating the hash of an entry's uncompressed contents.
+ * Run the uncompressed data of "pEntry" through processFunction, and
+ * leave the CRC of that data in "pCrc".
  */
-bool mzProcessZipEntryContents(const ZipArchive *pArchive,
+static bool processEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+    void *cookie, unsigned long *pCrc)
 {
     bool ret = false;
-    off_t oldOff;
+    long long oldOff;
+
+    *pCrc = crc32(0L, Z_NULL, 0);
 
     /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
+    oldOff = lseek64(pArchive->fd, 0, SEEK_CUR);
 
     /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
+    lseek64(pArchive->fd, pEntry->offset, SEEK_SET);
+    prefetchNote(pArchive, pEntry, 0);
 
     switch (pEntry->compression) {
     case STORED:
-        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
+        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie,
+                pCrc);
         break;
     case DEFLATED:
-        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
+        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie,
+                pCrc);
         break;
     default:
-        LOGE("Unsupported compression type %d for entry '%s'\n",
-                pEntry->compression, pEntry->fileName);
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
         break;
     }
 
     /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
+    lseek64(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
-static bool crcProcessFunction(const unsigned char *data, int dataLen,
-        void *crc)
+/*
+ * Compare the CRC of an entry's data, computed as it went by, with the
+ * one in the central directory.  A mismatch is always logged, but only
+ * counts as a failure if "strict" is set.
+ */
+static bool checkEntryCrc(const ZipEntry *pEntry, unsigned long crc,
+    bool strict)
+{
+    if (crc == (unsigned long)pEntry->crc32)
+        return true;
+    LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+            pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+    return !strict;
+}
+
+/*
+ * Stream the uncompressed data through the supplied function,
+ * passing cookie to it each time it gets called.  processFunction
+ * may be called more than once.
+ *
+ * If processFunction returns false, the operation is abandoned and
+ * mzProcessZipEntryContents() immediately returns false.  The data is
+ * CRC-checked on the way through; in strict mode a mismatch makes this
+ * return false, once processFunction has seen all of it.
+ *
+ * This is useful for calculating the hash of an entry's uncompressed contents.
+ */
+bool mzProcessZipEntryContents(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    unsigned long crc;
+
+    if (!processEntry(pArchive, pEntry, processFunction, cookie, &crc))
+        return false;
+    return checkEntryCrc(pEntry, crc, pArchive->strictCrc);
+}
+
+static bool skipProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
 {
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
     return true;
 }
 
@@ -714,21 +1405,12 @@ static bool crcProcessFunction(const unsigned char *data, int dataLen,
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
 {
     unsigned long crc;
-    bool ret;
 
-    crc = crc32(0L, Z_NULL, 0);
-    ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
-            (void *)&crc);
-    if (!ret) {
+    if (!processEntry(pArchive, pEntry, skipProcessFunction, NULL, &crc)) {
         LOGE("Can't calculate CRC for entry\n");
         return false;
     }
-    if (crc != (unsigned long)pEntry->crc32) {
-        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
-                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
-        return false;
-    }
-    return true;
+    return checkEntryCrc(pEntry, crc, true);
 }
 
 typedef struct {
@@ -749,6 +1431,120 @@ static bool copyProcessFunction(const unsigned char *data, int dataLen,
     return false;
 }
 
+/*
+ * The mapped read path produces its output, and takes the CRC of it,
+ * this much at a time, so that the CRC reads the data back while it is
+ * still in cache rather than in a second pass over the whole buffer.
+ */
+#define MAPPED_CRC_CHUNK (256 * 1024)
+
+/*
+ * Inflate all of "src" into "buf", which holds exactly uncompLen bytes,
+ * folding the output into "*pCrc" as it is produced.
+ */
+static bool inflateMapped(const ZipEntry *pEntry, const unsigned char *src,
+    unsigned char *buf, unsigned long *pCrc)
+{
+    z_stream zstream;
+    unsigned long crc = *pCrc;
+    long long done = 0;
+    int zerr;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.next_in = (Bytef *)src;
+    zstream.avail_in = pEntry->compLen;
+
+    /* No zlib header; see processDeflatedEntry(). */
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    do {
+        long long left = pEntry->uncompLen - done;
+
+        zstream.next_out = buf + done;
+        zstream.avail_out = left > MAPPED_CRC_CHUNK ? MAPPED_CRC_CHUNK : left;
+        zerr = inflate(&zstream, Z_NO_FLUSH);
+        crc = computeCrc(crc, buf + done, zstream.next_out - (buf + done));
+        done = zstream.next_out - buf;
+    } while (zerr == Z_OK);
+    inflateEnd(&zstream);
+    if (zerr != Z_STREAM_END || done != pEntry->uncompLen) {
+        LOGW("Inflate of '%.*s' failed (zerr=%d, %lld of %lld bytes)\n",
+            pEntry->fileNameLen, pEntry->fileName, zerr,
+            done, pEntry->uncompLen);
+        return false;
+    }
+    *pCrc = crc;
+    return true;
+}
+
+/*
+ * Where "pEntry"'s data is in the archive's mapping, or NULL if it isn't
+ * all mapped.
+ */
+static const unsigned char *mappedEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    if (pEntry->offset < pArchive->mapOffset ||
+        pEntry->offset - pArchive->mapOffset >
+            (long long)pArchive->map.length - pEntry->compLen)
+        return NULL;
+    return (const unsigned char *)pArchive->map.addr +
+        (pEntry->offset - pArchive->mapOffset);
+}
+
+/*
+ * When the whole entry is in memory and its uncompressed size is known,
+ * there's no need for the streaming loop and its two bounce buffers:
+ * inflate (or copy) straight from the mapping into the caller's buffer,
+ * in chunks big enough to keep zlib in its fast inner loop, taking the
+ * CRC of each chunk as it lands.
+ *
+ * Returns 1 on success, 0 if the entry isn't mapped (use the streaming
+ * path instead), or -1 if the data is bad.
+ */
+static int readMappedEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    unsigned char *buf)
+{
+    const unsigned char *src;
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    long long off;
+
+    src = mappedEntryData(pArchive, pEntry);
+    if (src == NULL)
+        return 0;
+    if (pEntry->compLen > UINT_MAX || pEntry->uncompLen > UINT_MAX)
+        return 0;
+    prefetchNote(pArchive, pEntry, 0);
+
+    switch (pEntry->compression) {
+    case STORED:
+        if (pEntry->compLen != pEntry->uncompLen) {
+            LOGW("Stored entry '%.*s' has mismatched sizes\n",
+                pEntry->fileNameLen, pEntry->fileName);
+            return -1;
+        }
+        for (off = 0; off < pEntry->uncompLen; off += MAPPED_CRC_CHUNK) {
+            size_t n = pEntry->uncompLen - off > MAPPED_CRC_CHUNK ?
+                MAPPED_CRC_CHUNK : (size_t)(pEntry->uncompLen - off);
+            memcpy(buf + off, src + off, n);
+            crc = computeCrc(crc, buf + off, n);
+        }
+        break;
+    case DEFLATED:
+        if (!inflateMapped(pEntry, src, buf, &crc))
+            return -1;
+        break;
+    default:
+        return 0;
+    }
+    prefetchNote(pArchive, pEntry, pEntry->compLen);
+
+    return checkEntryCrc(pEntry, crc, pArchive->strictCrc) ? 1 : -1;
+}
+
 /*
  * Read an entry into a buffer allocated by the caller.
  */
@@ -758,6 +1554,15 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
     CopyProcessArgs args;
     bool ret;
 
+    if (bufLen >= 0 && pEntry->uncompLen <= bufLen) {
+        int mapped = readMappedEntry(pArchive, pEntry, (unsigned char *)buf);
+        if (mapped != 0) {
+            if (mapped < 0)
+                LOGE("Can't extract entry to buffer.\n");
+            return mapped > 0;
+        }
+    }
+
     args.buf = buf;
     args.bufLen = bufLen;
     ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
@@ -772,7 +1577,7 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
 static bool writeProcessFunction(const unsigned char *data, int dataLen,
                                  void *cookie)
 {
-    int fd = (int)cookie;
+    int fd = (int)(intptr_t)cookie;
 
     ssize_t soFar = 0;
     while (true) {
@@ -795,14 +1600,175 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
     }
 }
 
+/*
+ * Where mzExtractZipEntryToFile() and mzExtractRecursive() put the data.
+ * Inflate hands it over 32K at a time; collecting that into large writes
+ * (which stay aligned, since the file starts at a chunk boundary) keeps
+ * extraction from being bound on write() calls.
+ */
+#define SINK_CHUNK_SIZE (32 * 1024)
+#define SINK_BUF_SIZE (256 * 1024)
+
+typedef struct {
+    int fd;
+    unsigned char *buf;     // SINK_BUF_SIZE bytes, allocated on first use
+    size_t used;
+} ExtractSink;
+
+static bool sinkFlush(ExtractSink *sink)
+{
+    bool ret = true;
+
+    if (sink->used > 0) {
+        ret = writeProcessFunction(sink->buf, sink->used,
+                (void *)(intptr_t)sink->fd);
+        sink->used = 0;
+    }
+    return ret;
+}
+
+static bool sinkProcessFunction(const unsigned char *data, int dataLen,
+    void *cookie)
+{
+    ExtractSink *sink = (ExtractSink *)cookie;
+
+    if (sink->used + dataLen > SINK_BUF_SIZE && !sinkFlush(sink))
+        return false;
+    if (dataLen >= SINK_BUF_SIZE)
+        return writeProcessFunction(data, dataLen,
+                (void *)(intptr_t)sink->fd);
+    memcpy(sink->buf + sink->used, data, dataLen);
+    sink->used += dataLen;
+    return true;
+}
+
+/*
+ * Tell the filesystem how much is coming, so it can allocate the blocks
+ * in one go instead of as the writes trickle in.  Only a hint: yaffs2,
+ * vfat and pipes don't support it, and that's fine.
+ *
+ * This is the raw syscall since bionic has no fallocate().  On 32-bit
+ * kernels each 64-bit argument is passed as two words, low word first
+ * (arm EABI and x86 alike).
+ */
+static void preallocate(int fd, long long len)
+{
+#ifdef __NR_fallocate
+    long long start = lseek64(fd, 0, SEEK_CUR);
+
+    if (start < 0)
+        return;
+    if (sizeof(long) >= 8)
+        syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE, (long)start,
+            (long)len);
+    else
+        syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE,
+            (long)(start & 0xffffffff), (long)(start >> 32),
+            (long)(len & 0xffffffff), (long)(len >> 32));
+#endif
+}
+
+/*
+ * Copy a STORED entry straight from the package with sendfile(), so the
+ * data never passes through our buffers.  Returns 1 on success, 0 if
+ * sendfile() can't be used here and nothing was written, or -1 on error.
+ */
+static int sendStoredEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    off_t off = pEntry->offset;
+    long long left = pEntry->compLen;
+
+    /* sendfile() takes an off_t, which may be only 32 bits. */
+    if (sizeof(off_t) == 4 && pEntry->offset + left > INT_MAX)
+        return 0;
+
+    prefetchNote(pArchive, pEntry, 0);
+    while (left > 0) {
+        size_t count = left > SSIZE_MAX ? SSIZE_MAX : (size_t)left;
+        ssize_t n;
+
+        /* Let the readahead window move along with us. */
+        if (pArchive->pPrefetch != NULL && count > PREFETCH_SLICE)
+            count = PREFETCH_SLICE;
+        n = sendfile(fd, pArchive->fd, &off, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (left == pEntry->compLen &&
+                    (n == 0 || errno == EINVAL || errno == ENOSYS))
+                return 0;
+            LOGE("sendfile of %lld bytes failed: %s\n", left,
+                n == 0 ? "unexpected EOF" : strerror(errno));
+            return -1;
+        }
+        left -= n;
+        prefetchNote(pArchive, pEntry, pEntry->compLen - left);
+    }
+    return 1;
+}
+
+/*
+ * Write the uncompressed data of "pEntry" to "fd" at its current offset.
+ * "sink" provides the write buffer, so that callers extracting many
+ * entries can share one; its buffer is left for the caller to free.
+ */
+static bool extractEntryToFd(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd, ExtractSink *sink)
+{
+    bool ret;
+
+    if (pEntry->uncompLen > SINK_CHUNK_SIZE)
+        preallocate(fd, pEntry->uncompLen);
+
+    /* sendfile() data never passes through here, so the CRC is taken
+     * from the mapping instead, while the pages sendfile() just read are
+     * still cached.  Entries that aren't mapped take the checked copy.
+     */
+    if (pEntry->compression == STORED && pEntry->compLen > 0 &&
+            pEntry->compLen == pEntry->uncompLen) {
+        const unsigned char *src = mappedEntryData(pArchive, pEntry);
+        if (src != NULL) {
+            int sent = sendStoredEntry(pArchive, pEntry, fd);
+            if (sent < 0)
+                return false;
+            if (sent > 0)
+                return checkEntryCrc(pEntry,
+                    computeCrc(crc32(0L, Z_NULL, 0), src, pEntry->compLen),
+                    pArchive->strictCrc);
+        }
+    }
+
+    /* An entry that fits in one chunk gets one write() anyway. */
+    if (pEntry->uncompLen <= SINK_CHUNK_SIZE)
+        return mzProcessZipEntryContents(pArchive, pEntry,
+                writeProcessFunction, (void *)(intptr_t)fd);
+
+    if (sink->buf == NULL) {
+        sink->buf = (unsigned char *)malloc(SINK_BUF_SIZE);
+        if (sink->buf == NULL)
+            return mzProcessZipEntryContents(pArchive, pEntry,
+                    writeProcessFunction, (void *)(intptr_t)fd);
+    }
+    sink->fd = fd;
+    sink->used = 0;
+    ret = mzProcessZipEntryContents(pArchive, pEntry, sinkProcessFunction,
+            (void *)sink);
+    return sinkFlush(sink) && ret;
+}
+
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)fd);
+    ExtractSink sink;
+    bool ret;
+
+    sink.buf = NULL;
+    ret = extractEntryToFd(pArchive, pEntry, fd, &sink);
+    free(sink.buf);
     if (!ret) {
         LOGE("Can't extract entry to file.\n");
         return false;
@@ -812,7 +1778,7 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 
 typedef struct {
     unsigned char* buffer;
-    long len;
+    long long len;
 } BufferExtractCookie;
 
 static bool bufferProcessFunction(const unsigned char *data, int dataLen,
@@ -834,6 +1800,13 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
     BufferExtractCookie bec;
+    int mapped = readMappedEntry(pArchive, pEntry, buffer);
+    if (mapped != 0) {
+        if (mapped < 0)
+            LOGE("Can't extract entry to memory buffer.\n");
+        return mapped > 0;
+    }
+
     bec.buffer = buffer;
     bec.len = mzGetZipEntryUncompLen(pEntry);
 
@@ -907,6 +1880,153 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/*
+ * The directories under targetDir that one mzExtractRecursive() call has
+ * made or found, each held open so that the next level down and the files
+ * inside can be created relative to it.  Entries come out sorted, so
+ * everything in one directory is adjacent and the chain leading to the
+ * current directory is all that needs remembering: another file in the
+ * same directory costs no path walk at all, and moving on to a sibling
+ * only reopens the levels that differ.
+ */
+#define DIR_CACHE_DEPTH 32
+
+typedef struct {
+    int rootFd;                             // targetDir, or -1 until needed
+    int depth;                              // levels held below targetDir
+    int fds[DIR_CACHE_DEPTH];
+    unsigned int ends[DIR_CACHE_DEPTH];     // path[0..ends[i]) is level i
+    char path[PATH_MAX];                    // relative to targetDir
+} DirCache;
+
+static void dirCacheTrim(DirCache *cache, int depth)
+{
+    while (cache->depth > depth) {
+        close(cache->fds[--cache->depth]);
+    }
+}
+
+static void dirCacheFree(DirCache *cache)
+{
+    dirCacheTrim(cache, 0);
+    if (cache->rootFd >= 0) {
+        close(cache->rootFd);
+        cache->rootFd = -1;
+    }
+}
+
+/*
+ * Set the times of the file open as "fd" (which is at "path").  This is
+ * futimens(), made through the syscall since older libcs don't have it;
+ * kernels without utimensat() get a utime() of the path instead.
+ */
+static int setFdTimestamp(int fd, const char *path,
+        const struct utimbuf *timestamp)
+{
+#ifdef __NR_utimensat
+    struct timespec times[2];
+
+    times[0].tv_sec = timestamp->actime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = timestamp->modtime;
+    times[1].tv_nsec = 0;
+    if (syscall(__NR_utimensat, fd, NULL, times, 0) == 0)
+        return 0;
+    if (errno != ENOSYS)
+        return -1;
+#endif
+    return utime(path, timestamp);
+}
+
+/*
+ * Make sure the directory holding an entry exists, and return an fd for
+ * it.  "targetPath" is the entry's full target path, whose part relative
+ * to targetDir starts at "relStart"; the directory is the first "dirLen"
+ * bytes of that part, which are either none or end in a slash.
+ *
+ * Directories too deep to cache are made by path instead, and AT_FDCWD
+ * is returned, so the caller should use the full path with it.
+ *
+ * Returns -1 with errno set on failure.
+ */
+static int dirCacheOpen(DirCache *cache, const char *targetDir,
+        char *targetPath, unsigned int relStart, unsigned int dirLen,
+        const struct utimbuf *timestamp)
+{
+    const char *rel = targetPath + relStart;
+    unsigned int start = 0;
+    int level = 0;
+
+    if (cache->rootFd < 0) {
+        if (dirCreateHierarchy(targetDir, UNZIP_DIRMODE, timestamp, false) != 0)
+            return -1;
+        cache->rootFd = open(targetDir, O_RDONLY | O_DIRECTORY);
+        if (cache->rootFd < 0)
+            return -1;
+    }
+
+    /* Keep the levels this directory shares with the last one.
+     */
+    while (level < cache->depth && cache->ends[level] <= dirLen &&
+            memcmp(cache->path + start, rel + start,
+                cache->ends[level] - start) == 0) {
+        start = cache->ends[level++];
+    }
+    dirCacheTrim(cache, level);
+
+    while (start < dirLen) {
+        unsigned int nameStart = start, end;
+        bool created = false;
+        int parent, fd, err;
+
+        while (rel[nameStart] == '/' && nameStart < dirLen)
+            nameStart++;
+        if (nameStart == dirLen)
+            break;
+        if (level == DIR_CACHE_DEPTH) {
+            if (dirCreateHierarchy(targetPath, UNZIP_DIRMODE, timestamp,
+                        true) != 0)
+                return -1;
+            return AT_FDCWD;
+        }
+        for (end = nameStart; rel[end] != '/'; end++)
+            ;
+
+        /* Terminate the path after this level for the calls below.
+         */
+        parent = level > 0 ? cache->fds[level - 1] : cache->rootFd;
+        targetPath[relStart + end] = '\0';
+        if (mkdirat(parent, rel + nameStart, UNZIP_DIRMODE) == 0) {
+            created = true;
+        } else if (errno != EEXIST) {
+            err = errno;
+            targetPath[relStart + end] = '/';
+            errno = err;
+            return -1;
+        }
+        fd = openat(parent, rel + nameStart, O_RDONLY | O_DIRECTORY);
+        err = errno;
+        if (fd >= 0 && created && timestamp != NULL)
+            setFdTimestamp(fd, targetPath, timestamp);
+        targetPath[relStart + end] = '/';
+        if (fd < 0) {
+            errno = err;
+            return -1;
+        }
+
+        memcpy(cache->path + start, rel + start, end + 1 - start);
+        cache->fds[level] = fd;
+        cache->ends[level] = end + 1;
+        cache->depth = ++level;
+        start = end + 1;
+    }
+
+    return level > 0 ? cache->fds[level - 1] : cache->rootFd;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -976,15 +2096,24 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    DirCache dirCache;
+    dirCache.rootFd = -1;
+    dirCache.depth = 0;
+
+    ExtractSink sink;
+    sink.buf = NULL;
+
     /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+     * with zpath.  The entries are sorted, so start at the first match
+     * and stop after the first non-match.
      */
-    unsigned int i;
+    unsigned int i = 0;
     bool seenMatch = false;
     int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
+#if SORT_ENTRIES
+    i = findFirstWithPrefix(pArchive, zpath, zipDirLen);
+#endif
+    for (; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
         if (pEntry->fileNameLen < zipDirLen) {
 //TODO: look out for a single empty directory entry that matches zpath, but
@@ -1040,13 +2169,13 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
+        unsigned int relStart = helper.targetDirLen;
+        unsigned int relLen = strlen(targetFile + relStart);
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
-                        targetFile, UNZIP_DIRMODE, timestamp, false);
-                if (ret != 0) {
+                int dirFd = dirCacheOpen(&dirCache, targetDir,
+                        helper.buf, relStart, relLen, timestamp);
+                if (dirFd == -1) {
                     LOGE("Can't create containing directory for \"%s\": %s\n",
                             targetFile, strerror(errno));
                     ok = false;
@@ -1058,9 +2187,15 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true);
-            if (ret != 0) {
+            unsigned int dirLen = relLen;
+            while (dirLen > 0 && targetFile[relStart + dirLen - 1] != '/')
+                dirLen--;
+            int dirFd = dirCacheOpen(&dirCache, targetDir,
+                    helper.buf, relStart, dirLen, timestamp);
+            const char *leafName = dirFd == AT_FDCWD ?
+                    targetFile : targetFile + relStart + dirLen;
+            int ret;
+            if (dirFd == -1) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
                         targetFile, strerror(errno));
                 ok = false;
@@ -1081,6 +2216,12 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     ok = false;
                     break;
                 }
+                if (pEntry->uncompLen >= PATH_MAX) {
+                    LOGE("Symlink entry \"%s\" target is too long\n",
+                            targetFile);
+                    ok = false;
+                    break;
+                }
                 char *linkTarget = malloc(pEntry->uncompLen + 1);
                 if (linkTarget == NULL) {
                     ok = false;
@@ -1113,7 +2254,8 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 /* The entry is a regular file.
                  * Open the target for writing.
                  */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
+                int fd = openat(dirFd, leafName,
+                        O_WRONLY | O_CREAT | O_TRUNC, UNZIP_FILEMODE);
                 if (fd < 0) {
                     LOGE("Can't create target file \"%s\": %s\n",
                             targetFile, strerror(errno));
@@ -1121,19 +2263,23 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
+                ok = extractEntryToFd(pArchive, pEntry, fd, &sink);
                 if (!ok) {
                     LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
+                    close(fd);
                     break;
                 }
 
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
+                /* Through the fd, so the path isn't looked up again.
+                 */
+                if (timestamp != NULL &&
+                        setFdTimestamp(fd, targetFile, timestamp) != 0) {
                     LOGE("Error touching \"%s\"\n", targetFile);
+                    close(fd);
                     ok = false;
                     break;
                 }
+                close(fd);
 
                 LOGD("Extracted file \"%s\"\n", targetFile);
             }
@@ -1142,6 +2288,18 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    /* One filesystem-wide flush at the end instead of an fsync() per
+     * file.
+     */
+    if (ok && (flags & MZ_EXTRACT_SYNC) && dirCache.rootFd >= 0) {
+#ifdef __NR_syncfs
+        if (syscall(__NR_syncfs, dirCache.rootFd) != 0)
+#endif
+            sync();
+    }
+
+    dirCacheFree(&dirCache);
+    free(sink.buf);
     free(helper.buf);
     free(zpath);
 
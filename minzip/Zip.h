@@ -25,9 +25,9 @@
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
+    long long    offset;         // of the data, past the local header
+    long long    compLen;
+    long long    uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -42,8 +42,13 @@ typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
     ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
+    NameHash*   pHash;          // maps file name to index in pEntries
     MemMapping  map;
+    long long   mapOffset;      // file offset of map.addr
+    long long   fileLength;
+    void*       cdBuf;          // heap copy backing "map", if not mmap()ed
+    bool        strictCrc;      // fail reads whose data fails its CRC check
+    struct ZipPrefetch* pPrefetch;  // readahead plan, if any
 } ZipArchive;
 
 /*
@@ -63,6 +68,34 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Like mzOpenZipArchive(), but maps an already-open file.  The archive
+ * takes ownership of "fd", even when this fails.
+ */
+int mzOpenZipArchiveFd(int fd, ZipArchive* pArchive);
+
+/*
+ * mzOpenZipArchive() in two steps.  mzMapZipArchive() (or, taking
+ * ownership of "fd", mzMapZipArchiveFd()) opens and maps the file
+ * without reading any of it, which lets the caller verify an untrusted
+ * file first; mzParseZipArchive() then reads the central directory.
+ * Both close the archive if they fail.  Until it is parsed, an archive
+ * may only be closed or have "map", "fd" and "fileLength" looked at.
+ */
+int mzMapZipArchive(const char* fileName, ZipArchive* pArchive);
+int mzMapZipArchiveFd(int fd, ZipArchive* pArchive);
+int mzParseZipArchive(ZipArchive* pArchive);
+
+/*
+ * Returns true if "map" covers the whole file.  Archives too large to
+ * map (eg. over 2GB on a 32-bit device) only keep the central directory
+ * and what follows it in memory, and have to be read through "fd".
+ */
+INLINE bool mzIsZipArchiveMapped(const ZipArchive* pArchive) {
+    return pArchive->mapOffset == 0 &&
+        (long long)pArchive->map.length == pArchive->fileLength;
+}
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -114,10 +147,10 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -197,6 +230,8 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_SYNC - make sure everything is on disk before returning,
+ *         with one flush at the end rather than an fsync per file
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
@@ -204,10 +239,27 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2, MZ_EXTRACT_SYNC = 4 };
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
         void (*callback)(const char *fn, void*), void *cookie);
 
+/*
+ * Readahead.  Queue the entries that are about to be read, in the order
+ * they will be read, then start a thread that asks the kernel to read
+ * them in ahead of time, keeping at most "budget" bytes of queued data
+ * ahead of the reader.  Reads of queued entries move the window along;
+ * anything else is read as usual.
+ *
+ * mzPrefetchZipDir() queues the entries mzExtractRecursive() would
+ * extract from zipDir.  Entries can only be queued before
+ * mzStartPrefetch(), which returns false (and reads go on without
+ * readahead) if it can't start.  mzCloseZipArchive() stops prefetching.
+ */
+bool mzPrefetchZipEntry(ZipArchive *pArchive, const ZipEntry *pEntry);
+bool mzPrefetchZipDir(ZipArchive *pArchive, const char *zipDir);
+bool mzStartPrefetch(ZipArchive *pArchive, size_t budget);
+void mzStopPrefetch(ZipArchive *pArchive);
+
 #endif /*_MINZIP_ZIP*/
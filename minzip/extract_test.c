@@ -0,0 +1,340 @@
+/*
+ * Checks that mzExtractRecursive() and mzReadZipEntry() report entries
+ * whose data doesn't match their CRC when the archive is strict, and
+ * still extract them (logging the mismatch) when it isn't.  Also checks
+ * that mzExtractZipEntryToFile() allocates an entry's blocks before it
+ * writes the data.
+ *
+ * Writes small archives into a scratch directory (default
+ * /data/local/tmp, which must support fallocate()) and extracts them
+ * there.
+ *
+ *     minzip_extract_test [scratch-dir]
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define LOG_TAG "extract_test"
+#include "Log.h"
+#include "Zip.h"
+
+typedef struct {
+    const char* name;
+    unsigned int len;
+    int badCrc;
+} TestEntry;
+
+/* "dir/b" is big enough to go through the buffered write path; the
+ * others are written in one go.
+ */
+static const TestEntry kEntries[] = {
+    { "dir/a", 1000, 0 },
+    { "dir/b", 100 * 1024, 1 },
+    { "dir/c", 1000, 0 },
+};
+#define NUM_ENTRIES (sizeof(kEntries) / sizeof(kEntries[0]))
+
+static void put16(unsigned char* p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char* p, unsigned long v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static unsigned char* entryData(const TestEntry* e)
+{
+    unsigned char* data = (unsigned char*) malloc(e->len);
+    unsigned int i;
+
+    for (i = 0; data != NULL && i < e->len; i++)
+        data[i] = (unsigned char) (i * 7 + e->len);
+    return data;
+}
+
+/* An entry as written to the archive: "data" is what goes in the file,
+ * compressed or not.
+ */
+typedef struct {
+    const char* name;
+    const unsigned char* data;
+    unsigned int compLen;
+    unsigned int uncompLen;
+    int method;                 /* 0 stored, 8 deflated */
+    unsigned long crc;
+} RawEntry;
+
+#define MAX_RAW_ENTRIES 8
+
+static int writeZip(const char* path, const RawEntry* entries,
+        unsigned int count)
+{
+    unsigned char cd[MAX_RAW_ENTRIES * 64];
+    unsigned char hdr[64];
+    size_t cdLen = 0;
+    long offset = 0;
+    unsigned int i;
+    FILE* f;
+
+    if (count > MAX_RAW_ENTRIES || (f = fopen(path, "wb")) == NULL)
+        return -1;
+    for (i = 0; i < count; i++) {
+        const RawEntry* e = &entries[i];
+        size_t nameLen = strlen(e->name);
+
+        memset(hdr, 0, sizeof(hdr));
+        put32(hdr, 0x04034b50);
+        put16(hdr + 4, 20);
+        put16(hdr + 8, e->method);
+        put32(hdr + 14, e->crc);
+        put32(hdr + 18, e->compLen);
+        put32(hdr + 22, e->uncompLen);
+        put16(hdr + 26, nameLen);
+        fwrite(hdr, 1, 30, f);
+        fwrite(e->name, 1, nameLen, f);
+        fwrite(e->data, 1, e->compLen, f);
+
+        memset(cd + cdLen, 0, 46);
+        put32(cd + cdLen, 0x02014b50);
+        put16(cd + cdLen + 4, 20);
+        put16(cd + cdLen + 6, 20);
+        put16(cd + cdLen + 10, e->method);
+        put32(cd + cdLen + 16, e->crc);
+        put32(cd + cdLen + 20, e->compLen);
+        put32(cd + cdLen + 24, e->uncompLen);
+        put16(cd + cdLen + 28, nameLen);
+        put32(cd + cdLen + 42, offset);
+        memcpy(cd + cdLen + 46, e->name, nameLen);
+        cdLen += 46 + nameLen;
+        offset += 30 + nameLen + e->compLen;
+    }
+    fwrite(cd, 1, cdLen, f);
+
+    memset(hdr, 0, sizeof(hdr));
+    put32(hdr, 0x06054b50);
+    put16(hdr + 8, count);
+    put16(hdr + 10, count);
+    put32(hdr + 12, cdLen);
+    put32(hdr + 16, offset);
+    fwrite(hdr, 1, 22, f);
+    return fclose(f);
+}
+
+static int writeArchive(const char* path, int withBadCrc)
+{
+    RawEntry raw[NUM_ENTRIES];
+    unsigned char* data[NUM_ENTRIES];
+    unsigned int i;
+    int ret = -1;
+
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        const TestEntry* e = &kEntries[i];
+
+        data[i] = entryData(e);
+        if (data[i] == NULL)
+            goto done;
+        raw[i].name = e->name;
+        raw[i].data = data[i];
+        raw[i].compLen = raw[i].uncompLen = e->len;
+        raw[i].method = 0;
+        raw[i].crc = crc32(crc32(0L, Z_NULL, 0), data[i], e->len);
+        if (withBadCrc && e->badCrc)
+            raw[i].crc ^= 1;
+    }
+    ret = writeZip(path, raw, NUM_ENTRIES);
+done:
+    while (i-- > 0)
+        free(data[i]);
+    return ret;
+}
+
+/* Run mzExtractRecursive() with stdout, where minzip logs, going to
+ * "logPath" instead.
+ */
+static bool extractLogged(ZipArchive* zip, const char* outDir,
+        const char* logPath)
+{
+    int logFd = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int saved;
+    bool ok;
+
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    if (logFd >= 0)
+        dup2(logFd, STDOUT_FILENO);
+    ok = mzExtractRecursive(zip, "dir", outDir, MZ_EXTRACT_FILES_ONLY,
+            NULL, NULL, NULL);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    if (logFd >= 0)
+        close(logFd);
+    return ok;
+}
+
+static bool logMentions(const char* logPath, const char* text)
+{
+    char buf[4096];
+    FILE* f = fopen(logPath, "r");
+    bool found = false;
+
+    if (f == NULL)
+        return false;
+    while (!found && fgets(buf, sizeof(buf), f) != NULL)
+        found = strstr(buf, text) != NULL;
+    fclose(f);
+    return found;
+}
+
+static int run(const char* scratch, const char* what, int withBadCrc,
+        bool strict, bool expected)
+{
+    char zipPath[PATH_MAX], outDir[PATH_MAX], logPath[PATH_MAX];
+    ZipArchive zip;
+    unsigned int i;
+    bool ok, readOk = true, logged;
+
+    snprintf(zipPath, sizeof(zipPath), "%s/extract_test.zip", scratch);
+    snprintf(outDir, sizeof(outDir), "%s/extract_test.out", scratch);
+    snprintf(logPath, sizeof(logPath), "%s/extract_test.log", scratch);
+    if (writeArchive(zipPath, withBadCrc) != 0) {
+        fprintf(stderr, "can't write %s\n", zipPath);
+        return 1;
+    }
+    if (mzOpenZipArchive(zipPath, &zip) != 0) {
+        fprintf(stderr, "can't open %s\n", zipPath);
+        return 1;
+    }
+    zip.strictCrc = strict;
+    mkdir(outDir, 0755);
+    ok = extractLogged(&zip, outDir, logPath);
+    logged = logMentions(logPath, "CRC for entry dir/b ");
+    unlink(logPath);
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        const ZipEntry* pEntry = mzFindZipEntry(&zip, kEntries[i].name);
+        char* buf = (char*) malloc(kEntries[i].len);
+        if (pEntry == NULL || buf == NULL ||
+                !mzReadZipEntry(&zip, pEntry, buf, kEntries[i].len))
+            readOk = false;
+        free(buf);
+    }
+    mzCloseZipArchive(&zip);
+    unlink(zipPath);
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        char path[PATH_MAX + 16];
+        snprintf(path, sizeof(path), "%s/%s", outDir,
+                strchr(kEntries[i].name, '/') + 1);
+        unlink(path);
+    }
+    rmdir(outDir);
+
+    /* Every mismatch is logged, strict or not. */
+    printf("%s: %s (extract)\n", ok == expected ? "PASS" : "FAIL", what);
+    printf("%s: %s (read)\n", readOk == expected ? "PASS" : "FAIL", what);
+    printf("%s: %s (mismatch logged)\n",
+            logged == (withBadCrc != 0) ? "PASS" : "FAIL", what);
+    return (ok == expected ? 0 : 1) + (readOk == expected ? 0 : 1) +
+            (logged == (withBadCrc != 0) ? 0 : 1);
+}
+
+/* A deflated entry whose data goes bad halfway through.  Extraction
+ * fails there, so whatever is allocated past the end of what was
+ * written was allocated before the writes.
+ */
+#define PREALLOC_LEN (1024 * 1024)
+
+static int runPreallocate(const char* scratch)
+{
+    char zipPath[PATH_MAX], outPath[PATH_MAX];
+    unsigned char* data = (unsigned char*) malloc(PREALLOC_LEN);
+    uLong compBound = compressBound(PREALLOC_LEN) + 64;
+    unsigned char* comp = (unsigned char*) malloc(compBound);
+    ZipArchive zip;
+    z_stream zs;
+    RawEntry raw;
+    struct stat st;
+    unsigned int i;
+    int fd, failed = 1;
+    bool ok;
+
+    snprintf(zipPath, sizeof(zipPath), "%s/extract_test.zip", scratch);
+    snprintf(outPath, sizeof(outPath), "%s/extract_test.out", scratch);
+    if (data == NULL || comp == NULL)
+        goto done;
+
+    /* Incompressible data, so level 0 puts it in stored blocks of 64K
+     * less a byte, each behind a 5-byte header: LEN, then NLEN = ~LEN.
+     * Breaking NLEN of the eighth block stops inflate after about half.
+     */
+    for (i = 0; i < PREALLOC_LEN; i++)
+        data[i] = (unsigned char) ((i * 2654435761u) >> 24);
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 0, Z_DEFLATED, -MAX_WBITS, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+        goto done;
+    zs.next_in = data;
+    zs.avail_in = PREALLOC_LEN;
+    zs.next_out = comp;
+    zs.avail_out = compBound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        goto done;
+    }
+    deflateEnd(&zs);
+    comp[8 * (65535 + 5) + 3] ^= 0xff;
+
+    raw.name = "big";
+    raw.data = comp;
+    raw.compLen = zs.total_out;
+    raw.uncompLen = PREALLOC_LEN;
+    raw.method = 8;
+    raw.crc = crc32(crc32(0L, Z_NULL, 0), data, PREALLOC_LEN);
+    if (writeZip(zipPath, &raw, 1) != 0 ||
+            mzOpenZipArchive(zipPath, &zip) != 0) {
+        fprintf(stderr, "can't write %s\n", zipPath);
+        goto done;
+    }
+    fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        mzCloseZipArchive(&zip);
+        goto done;
+    }
+    ok = mzExtractZipEntryToFile(&zip, mzFindZipEntry(&zip, "big"), fd);
+    fstat(fd, &st);
+    close(fd);
+    mzCloseZipArchive(&zip);
+
+    failed = ok || st.st_size >= PREALLOC_LEN ||
+            (long long) st.st_blocks * 512 < PREALLOC_LEN;
+    printf("%s: blocks allocated up front (%lld of %d bytes written, "
+            "%lld allocated)\n", failed ? "FAIL" : "PASS",
+            (long long) st.st_size, PREALLOC_LEN,
+            (long long) st.st_blocks * 512);
+done:
+    unlink(zipPath);
+    unlink(outPath);
+    free(data);
+    free(comp);
+    return failed;
+}
+
+int main(int argc, char** argv)
+{
+    const char* scratch = argc > 1 ? argv[1] : "/data/local/tmp";
+    int failures = 0;
+
+    failures += run(scratch, "intact archive, strict", 0, true, true);
+    failures += run(scratch, "bad crc, strict", 1, true, false);
+    failures += run(scratch, "bad crc, not strict", 1, false, true);
+    failures += runPreallocate(scratch);
+    return failures != 0;
+}
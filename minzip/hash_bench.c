@@ -0,0 +1,176 @@
+/*
+ * Probe-count benchmark for the Zip entry name index.
+ *
+ * For each archive, builds the generic HashTable that used to index the
+ * entries alongside the archive's NameHash, reports the probe counts of
+ * both (mzHashTableProbeCount() / mzNameHashProbeCount()), and times a
+ * round of lookups for every entry name and for a name that is missing.
+ *
+ *     minzip_hash_bench [-n rounds] archive.zip...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "hash_bench"
+#include "Log.h"
+#include "Zip.h"
+
+static unsigned int legacyHash(const char* name, int nameLen)
+{
+    unsigned int hash = 2;
+
+    while (nameLen--)
+        hash = hash * 31 + *name++;
+
+    return hash;
+}
+
+static unsigned int legacyHashEntry(const void* ventry)
+{
+    const ZipEntry* entry = (const ZipEntry*) ventry;
+    return legacyHash(entry->fileName, entry->fileNameLen);
+}
+
+static int legacyCmpEntry(const void* ventry1, const void* ventry2)
+{
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+
+    if (entry1->fileNameLen != entry2->fileNameLen)
+        return entry1->fileNameLen - entry2->fileNameLen;
+    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+}
+
+static int legacyCmpName(const void* ventry, const void* vname)
+{
+    const ZipEntry* entry = (const ZipEntry*) ventry;
+    const char* name = (const char*) vname;
+    unsigned int nameLen = strlen(name);
+
+    if (entry->fileNameLen != nameLen)
+        return entry->fileNameLen - nameLen;
+    return memcmp(entry->fileName, name, nameLen);
+}
+
+static double now_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int bench(const char* path, int rounds)
+{
+    ZipArchive zip;
+    HashTable* pLegacy;
+    char** names;
+    unsigned int i, n;
+    int r, found;
+    double t;
+
+    if (mzOpenZipArchive(path, &zip) != 0) {
+        fprintf(stderr, "%s: can't open\n", path);
+        return 1;
+    }
+    n = mzZipEntryCount(&zip);
+
+    /* Null-terminated copies of the names, plus a near miss for each:
+     * same length and prefix, so only the last byte tells them apart.
+     */
+    names = (char**) calloc(2 * n, sizeof(char*));
+    pLegacy = mzHashTableCreate(mzHashSize(n), NULL);
+    if (names == NULL || pLegacy == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        const ZipEntry* pEntry = mzGetZipEntryAt(&zip, i);
+        UnterminatedString fn = mzGetZipEntryFileName(pEntry);
+
+        names[i] = strndup(fn.str, fn.len);
+        names[n + i] = strndup(fn.str, fn.len);
+        if (names[i] == NULL || names[n + i] == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        if (fn.len > 0)
+            names[n + i][fn.len - 1] ^= 0x80;
+        mzHashTableLookup(pLegacy, legacyHashEntry(pEntry), (void*) pEntry,
+            legacyCmpEntry, true);
+    }
+
+    /* Look them up in no particular order; archives list related names
+     * together, and walking them in order flatters whichever table puts
+     * neighbours in neighbouring slots.
+     */
+    srand(1);
+    for (i = 2 * n; i > 1; i--) {
+        unsigned int j = rand() % i;
+        char* tmp = names[i - 1];
+        names[i - 1] = names[j];
+        names[j] = tmp;
+    }
+
+    printf("%s: %u entries\n", path, n);
+    printf("  HashTable: %d bytes\n  ", mzHashTableMemUsage(pLegacy));
+    mzHashTableProbeCount(pLegacy, legacyHashEntry, legacyCmpEntry);
+    printf("  NameHash:  %zu bytes\n  ", mzNameHashMemUsage(zip.pHash));
+    mzNameHashProbeCount(zip.pHash);
+
+    found = 0;
+    t = now_msec();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < 2 * n; i++) {
+            if (mzHashTableLookup(pLegacy, legacyHash(names[i],
+                    strlen(names[i])), names[i], legacyCmpName, false) != NULL)
+                found++;
+        }
+    }
+    printf("  HashTable: %.3f ms (%d found)\n", now_msec() - t, found);
+
+    found = 0;
+    t = now_msec();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < 2 * n; i++) {
+            if (mzFindZipEntry(&zip, names[i]) != NULL)
+                found++;
+        }
+    }
+    printf("  NameHash:  %.3f ms (%d found)\n", now_msec() - t, found);
+
+    for (i = 0; i < 2 * n; i++)
+        free(names[i]);
+    free(names);
+    mzHashTableFree(pLegacy);
+    mzCloseZipArchive(&zip);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int rounds = 100;
+    int result = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n rounds] archive.zip...\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-n rounds] archive.zip...\n", argv[0]);
+        return 2;
+    }
+
+    for (; optind < argc; optind++)
+        result |= bench(argv[optind], rounds);
+    return result;
+}
@@ -8,6 +8,12 @@ ifeq ($(BOARD_HAS_LARGE_FILESYSTEM),true)
 LOCAL_CFLAGS += -DBOARD_HAS_LARGE_FILESYSTEM
 endif
 
+# Discard eMMC volumes before formatting them.  Only for parts whose
+# discard support is known to work.
+ifeq ($(BOARD_USES_EMMC_DISCARD),true)
+LOCAL_CFLAGS += -DBOARD_USES_EMMC_DISCARD
+endif
+
 LOCAL_SRC_FILES := \
 	mmcutils.c
 
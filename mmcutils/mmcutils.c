@@ -33,6 +33,9 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
@@ -338,8 +341,62 @@ run_exec_process ( char **argv) {
     return 0;
 }
 
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD _IO(0x12,125)
+#endif
+
+#ifdef BOARD_USES_EMMC_DISCARD
+int format_discard_mode = FORMAT_DISCARD;
+#else
+int format_discard_mode = FORMAT_DISCARD_OFF;
+#endif
+
+int
+discard_block_device (const char *device, int secure) {
+    int fd = open(device, O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    uint64_t range[2];
+    range[0] = 0;
+    if (ioctl(fd, BLKGETSIZE64, &range[1]) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (ioctl(fd, secure ? BLKSECDISCARD : BLKDISCARD, &range) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int
+discard_for_format (const char *device) {
+    if (format_discard_mode == FORMAT_DISCARD_OFF)
+        return 0;
+
+    int secure = format_discard_mode == FORMAT_DISCARD_SECURE;
+    if (discard_block_device(device, secure) < 0) {
+        // Not a block device, or the controller can't do it (loop
+        // devices, older kernels); the format itself still goes ahead.
+        printf("%s of %s not done (%s)\n",
+               secure ? "secure discard" : "discard", device, strerror(errno));
+        return -1;
+    }
+    printf("%s %s\n", secure ? "securely discarded" : "discarded", device);
+    return 0;
+}
+
 int
 format_ext3_device (const char *device) {
+    discard_for_format(device);
 #ifdef BOARD_HAS_LARGE_FILESYSTEM
     char *const mke2fs[] = {MKE2FS_BIN, "-j", "-q", device, NULL};
     char *const tune2fs[] = {TUNE2FS_BIN, "-C", "1", device, NULL};
@@ -376,6 +433,8 @@ format_ext3_device (const char *device) {
 
 int
 format_ext2_device (const char *device) {
+    discard_for_format(device);
+
     // Run mke2fs
     char *const mke2fs[] = {MKE2FS_BIN, device, NULL};
     if(run_exec_process(mke2fs))
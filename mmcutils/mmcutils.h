@@ -86,6 +86,29 @@ int mmc_raw_write (const MmcPartition *partition, char *data, int data_size);
 int format_ext2_device(const char *device);
 int format_ext3_device(const char *device);
 
+/* How formats treat the old contents of a block device.  With
+ * FORMAT_DISCARD the whole device is discarded (BLKDISCARD) before mkfs
+ * so the controller knows the blocks are free; FORMAT_DISCARD_SECURE
+ * uses BLKSECDISCARD so the old data is physically erased too.  Off
+ * unless the board sets BOARD_USES_EMMC_DISCARD, since some older eMMC
+ * parts mishandle discard.
+ */
+#define FORMAT_DISCARD_OFF      0
+#define FORMAT_DISCARD          1
+#define FORMAT_DISCARD_SECURE   2
+
+extern int format_discard_mode;
+
+/* Discard all of a block device.  Returns 0 on success, -1 (errno set)
+ * if the discard couldn't be done.
+ */
+int discard_block_device(const char *device, int secure);
+
+/* Discard according to format_discard_mode ahead of a format.  Failure
+ * is logged and otherwise ignored.  Returns 0 if discarded or off.
+ */
+int discard_for_format(const char *device);
+
 #endif  // MMCUTILS_H_
 
 
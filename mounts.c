@@ -19,6 +19,9 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
@@ -27,68 +30,183 @@ typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+
+    /* Backing store for the strings in "volumes": the last contents of
+     * /proc/mounts, split in place.
+     */
+    char *buf;
+    size_t buf_allocd;
+
+    /* Open-addressed indexes into "volumes", keyed by mount point and
+     * by device.  Each holds index+1, 0 meaning empty.
+     */
+    int *by_mount_point;
+    int *by_device;
+    unsigned int index_size;
+
+    /* Kept open so poll() can tell us when the table has changed. */
+    int fd;
+    int valid;
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    NULL,   // buf
+    0,      // buf_allocd
+    NULL,   // by_mount_point
+    NULL,   // by_device
+    0,      // index_size
+    -1,     // fd
+    0       // valid
 };
 
-static inline void
-free_volume_internals(const MountedVolume *volume, int zero)
+#define PROC_MOUNTS_FILENAME   "/proc/mounts"
+
+static unsigned int
+hash_string(const char *str)
 {
-    free((char *)volume->device);
-    free((char *)volume->mount_point);
-    free((char *)volume->filesystem);
-    free((char *)volume->flags);
-    if (zero) {
-        memset((void *)volume, 0, sizeof(*volume));
+    unsigned int hash = 5381;
+    while (*str != '\0') {
+        hash = hash * 33 + (unsigned char)*str++;
     }
+    return hash;
 }
 
-#define PROC_MOUNTS_FILENAME   "/proc/mounts"
+/* Each volume is inserted into both indexes, duplicates included, in
+ * /proc/mounts order; lookups walk the probe sequence and return the
+ * first live match, which is the same entry a linear scan would find.
+ */
+static int
+build_indexes(void)
+{
+    unsigned int size = 16;
+    while (size < (unsigned int)g_mounts_state.volume_count * 2) {
+        size *= 2;
+    }
+    if (size > g_mounts_state.index_size) {
+        int *mp = realloc(g_mounts_state.by_mount_point, size * sizeof(int));
+        if (mp == NULL) {
+            return -1;
+        }
+        g_mounts_state.by_mount_point = mp;
+        int *dev = realloc(g_mounts_state.by_device, size * sizeof(int));
+        if (dev == NULL) {
+            return -1;
+        }
+        g_mounts_state.by_device = dev;
+        g_mounts_state.index_size = size;
+    }
+    size = g_mounts_state.index_size;
+    memset(g_mounts_state.by_mount_point, 0, size * sizeof(int));
+    memset(g_mounts_state.by_device, 0, size * sizeof(int));
+
+    int i;
+    for (i = 0; i < g_mounts_state.volume_count; i++) {
+        const MountedVolume *v = &g_mounts_state.volumes[i];
+        unsigned int h = hash_string(v->mount_point) & (size - 1);
+        while (g_mounts_state.by_mount_point[h] != 0) {
+            h = (h + 1) & (size - 1);
+        }
+        g_mounts_state.by_mount_point[h] = i + 1;
+
+        h = hash_string(v->device) & (size - 1);
+        while (g_mounts_state.by_device[h] != 0) {
+            h = (h + 1) & (size - 1);
+        }
+        g_mounts_state.by_device[h] = i + 1;
+    }
+    return 0;
+}
+
+/* Read all of /proc/mounts, however long it is, into g_mounts_state.buf.
+ */
+static ssize_t
+read_proc_mounts(int fd)
+{
+    size_t used = 0;
+
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        return -1;
+    }
+    for (;;) {
+        if (g_mounts_state.buf_allocd - used < 1024) {
+            size_t allocd = g_mounts_state.buf_allocd ?
+                    g_mounts_state.buf_allocd * 2 : 4096;
+            char *buf = realloc(g_mounts_state.buf, allocd);
+            if (buf == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            g_mounts_state.buf = buf;
+            g_mounts_state.buf_allocd = allocd;
+        }
+        ssize_t n = read(fd, g_mounts_state.buf + used,
+                         g_mounts_state.buf_allocd - used - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        used += n;
+    }
+    g_mounts_state.buf[used] = '\0';
+    return used;
+}
+
+/* Returns true if the mount table may have changed since we last read
+ * it.  The kernel flags /proc/mounts with POLLPRI|POLLERR whenever the
+ * namespace's mount list changes.
+ */
+static int
+mounts_changed(void)
+{
+    if (!g_mounts_state.valid || g_mounts_state.fd < 0) {
+        return 1;
+    }
+    struct pollfd pfd;
+    pfd.fd = g_mounts_state.fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, 0);
+    if (ret < 0) {
+        return 1;
+    }
+    return (pfd.revents & (POLLPRI | POLLERR | POLLNVAL)) != 0;
+}
 
 int
 scan_mounted_volumes()
 {
-    char buf[2048];
-    const char *bufp;
-    int fd;
+    char *bufp;
     ssize_t nbytes;
 
-    if (g_mounts_state.volumes == NULL) {
-        const int numv = 32;
-        MountedVolume *volumes = malloc(numv * sizeof(*volumes));
-        if (volumes == NULL) {
-            errno = ENOMEM;
-            return -1;
-        }
-        g_mounts_state.volumes = volumes;
-        g_mounts_state.volumes_allocd = numv;
-        memset(volumes, 0, numv * sizeof(*volumes));
-    } else {
-        /* Free the old volume strings.
-         */
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            free_volume_internals(&g_mounts_state.volumes[i], 1);
-        }
+    if (!mounts_changed()) {
+        return 0;
     }
+    g_mounts_state.valid = 0;
     g_mounts_state.volume_count = 0;
 
-    /* Open and read the file contents.
+    /* Open the file once and keep it; every later scan rewinds it.  A
+     * fresh fd starts with no change pending.  After that, the change
+     * is cleared by the poll() in mounts_changed() reporting it, not by
+     * reading, so the table must be re-read from offset 0 every time
+     * that poll() fires: skip the re-read and the change is lost.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
+    if (g_mounts_state.fd < 0) {
+        g_mounts_state.fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
+        if (g_mounts_state.fd < 0) {
+            return -1;
+        }
+        fcntl(g_mounts_state.fd, F_SETFD, FD_CLOEXEC);
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
+    nbytes = read_proc_mounts(g_mounts_state.fd);
     if (nbytes < 0) {
-        goto bail;
+        close(g_mounts_state.fd);
+        g_mounts_state.fd = -1;
+        return -1;
     }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -103,92 +221,96 @@ scan_mounted_volumes()
      *
      * The zeroes at the end are dummy placeholder fields to make the
      * output match Linux's /etc/mtab, but don't represent anything here.
+     *
+     * The volume strings point straight into the buffer.
      */
-    bufp = buf;
-    while (nbytes > 0) {
-        char device[64];
-        char mount_point[64];
-        char filesystem[64];
-        char flags[128];
-        int matches;
-
-        /* %as is a gnu extension that malloc()s a string for each field.
-         */
-        matches = sscanf(bufp, "%63s %63s %63s %127s",
-                device, mount_point, filesystem, flags);
+    bufp = g_mounts_state.buf;
+    while (*bufp != '\0') {
+        char *eol = strchr(bufp, '\n');
+        char *next = eol ? eol + 1 : g_mounts_state.buf + nbytes;
+        char *save;
+        if (eol != NULL) {
+            *eol = '\0';
+        }
 
-        if (matches == 4) {
-            device[sizeof(device)-1] = '\0';
-            mount_point[sizeof(mount_point)-1] = '\0';
-            filesystem[sizeof(filesystem)-1] = '\0';
-            flags[sizeof(flags)-1] = '\0';
+        char *device = strtok_r(bufp, " \t", &save);
+        char *mount_point = strtok_r(NULL, " \t", &save);
+        char *filesystem = strtok_r(NULL, " \t", &save);
+        char *flags = strtok_r(NULL, " \t", &save);
 
+        if (flags != NULL) {
+            if (g_mounts_state.volume_count == g_mounts_state.volumes_allocd) {
+                int numv = g_mounts_state.volumes_allocd ?
+                        g_mounts_state.volumes_allocd * 2 : 32;
+                MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                                                 numv * sizeof(*volumes));
+                if (volumes == NULL) {
+                    errno = ENOMEM;
+                    goto bail;
+                }
+                g_mounts_state.volumes = volumes;
+                g_mounts_state.volumes_allocd = numv;
+            }
             MountedVolume *v =
                     &g_mounts_state.volumes[g_mounts_state.volume_count++];
-            v->device = strdup(device);
-            v->mount_point = strdup(mount_point);
-            v->filesystem = strdup(filesystem);
-            v->flags = strdup(flags);
-        } else {
-printf("matches was %d on <<%.40s>>\n", matches, bufp);
+            v->device = device;
+            v->mount_point = mount_point;
+            v->filesystem = filesystem;
+            v->flags = flags;
+        } else if (device != NULL) {
+            printf("short mounts line <<%.40s>>\n", device);
         }
 
-        /* Eat the line.
-         */
-        while (nbytes > 0 && *bufp != '\n') {
-            bufp++;
-            nbytes--;
-        }
-        if (nbytes > 0) {
-            bufp++;
-            nbytes--;
-        }
+        bufp = next;
     }
 
+    if (build_indexes() != 0) {
+        errno = ENOMEM;
+        goto bail;
+    }
+    g_mounts_state.valid = 1;
     return 0;
 
 bail:
-//TODO: free the strings we've allocated.
     g_mounts_state.volume_count = 0;
     return -1;
 }
 
-const MountedVolume *
-find_mounted_volume_by_device(const char *device)
+static const MountedVolume *
+find_in_index(const int *index, size_t field, const char *key)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->device != NULL) {
-                if (strcmp(v->device, device) == 0) {
-                    return v;
-                }
-            }
+    if (!g_mounts_state.valid || index == NULL) {
+        return NULL;
+    }
+    unsigned int mask = g_mounts_state.index_size - 1;
+    unsigned int h = hash_string(key) & mask;
+    const MountedVolume *found = NULL;
+    while (index[h] != 0) {
+        const MountedVolume *v = &g_mounts_state.volumes[index[h] - 1];
+        const char *value = *(const char **)((const char *)v + field);
+        /* May be null if it was unmounted and we haven't rescanned.
+         */
+        if (value != NULL && strcmp(value, key) == 0 &&
+            (found == NULL || v < found)) {
+            found = v;
         }
+        h = (h + 1) & mask;
     }
-    return NULL;
+    return found;
+}
+
+const MountedVolume *
+find_mounted_volume_by_device(const char *device)
+{
+    return find_in_index(g_mounts_state.by_device,
+                         offsetof(MountedVolume, device), device);
 }
 
 const MountedVolume *
 find_mounted_volume_by_mount_point(const char *mount_point)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->mount_point != NULL) {
-                if (strcmp(v->mount_point, mount_point) == 0) {
-                    return v;
-                }
-            }
-        }
-    }
-    return NULL;
+    return find_in_index(g_mounts_state.by_mount_point,
+                         offsetof(MountedVolume, mount_point), mount_point);
 }
 
 int
@@ -200,7 +322,10 @@ unmount_mounted_volume(const MountedVolume *volume)
      */
     int ret = umount(volume->mount_point);
     if (ret == 0) {
-        free_volume_internals(volume, 1);
+        /* The strings live in the shared buffer; just forget them.  The
+         * next scan will see the change and re-read the table.
+         */
+        memset((void *)volume, 0, sizeof(*volume));
         return 0;
     }
     return ret;
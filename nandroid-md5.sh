@@ -1,12 +1,26 @@
 #!/sbin/sh
 cd $1
 rm -f /tmp/nandroid.md5
-md5sum * .* > /tmp/nandroid.md5
+touch /tmp/nandroid.md5
+# Everything but the sums themselves and the journals nandroid keeps
+# here while a backup or restore is in progress.
+for f in * .*
+do
+  case "$f" in
+    nandroid.md5|nandroid.journal|nandroid.restore.journal)
+      ;;
+    *)
+      if [ -f "$f" ]
+      then
+        md5sum "$f" >> /tmp/nandroid.md5 || return 1
+      fi
+      ;;
+  esac
+done
 cp /tmp/nandroid.md5 .
-# need this because wildcard seems to cause md5sum to return 1
 if [ -f nandroid.md5 ]
 then
   return 0
 else
   return 1
-fi
\ No newline at end of file
+fi
@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 
 #include <signal.h>
+#include <pthread.h>
 #include <sys/wait.h>
 
 #include "bootloader.h"
@@ -41,6 +42,7 @@
 #include "safebootcommands.h"
 
 #include "flashutils/flashutils.h"
+#include "libcrecovery/common.h"
 #include <libgen.h>
 
 void nandroid_generate_timestamp_path(const char* backup_path, const char* sdcard_path)
@@ -228,7 +230,172 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
     return nandroid_backup_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_webtop, int skip_origsys) {
+// Checkpoint journal kept in the backup directory while a backup or
+// restore is in progress, so "nandroid resume <dir>" can pick up after
+// the last partition that finished.  One line per event, each written
+// with fsync after the partition's own data is on disk:
+//   backup <skip_webtop> <skip_origsys>       (or)
+//   restore <system> <data> <cache> <systemorig>
+//   verified                                  (restore: md5 check passed)
+//   hashed                                    (backup: nandroid.md5 written)
+//   done <root> <bytes>
+// A backup partition only counts as done if its files still add up to
+// <bytes>.  The journal is removed once the run completes.
+#define NANDROID_JOURNAL "nandroid.journal"
+#define NANDROID_RESTORE_JOURNAL "nandroid.restore.journal"
+#define NANDROID_JOURNAL_ENTRIES 16
+
+typedef struct {
+    char path[PATH_MAX];
+    char header[128];
+    char done[NANDROID_JOURNAL_ENTRIES][64];
+    long long done_bytes[NANDROID_JOURNAL_ENTRIES];
+    int count;
+    int verified;
+    int hashed;
+    pthread_mutex_t lock;
+} NandroidJournal;
+
+static void journal_append(NandroidJournal* j, const char* line) {
+    int fd = open(j->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        LOGW("can't write %s: %s\n", j->path, strerror(errno));
+        return;
+    }
+    write(fd, line, strlen(line));
+    fsync(fd);
+    close(fd);
+}
+
+// Start a fresh journal (resume == 0) or load the existing one.
+// Returns -1 if resuming and there is no journal to resume from.
+static int journal_init(NandroidJournal* j, const char* dir, const char* name, const char* header, int resume) {
+    memset(j, 0, sizeof(*j));
+    pthread_mutex_init(&j->lock, NULL);
+    snprintf(j->path, sizeof(j->path), "%s/%s", dir, name);
+
+    if (!resume) {
+        unlink(j->path);
+        strlcpy(j->header, header, sizeof(j->header));
+        char line[160];
+        snprintf(line, sizeof(line), "%s\n", header);
+        journal_append(j, line);
+        return 0;
+    }
+
+    FILE* f = fopen(j->path, "r");
+    if (f == NULL)
+        return -1;
+    char line[256];
+    if (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        strlcpy(j->header, line, sizeof(j->header));
+    }
+    long offset = ftell(f);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char root[64];
+        long long bytes = 0;
+        if (strchr(line, '\n') == NULL) {
+            // A torn last line from an interrupted write; cut it off so
+            // the next entry starts on a line of its own.
+            truncate(j->path, offset);
+            break;
+        } else if (strcmp(line, "verified\n") == 0) {
+            j->verified = 1;
+        } else if (strcmp(line, "hashed\n") == 0) {
+            j->hashed = 1;
+        } else if (sscanf(line, "done %63s %lld", root, &bytes) == 2 &&
+                   j->count < NANDROID_JOURNAL_ENTRIES) {
+            strlcpy(j->done[j->count], root, sizeof(j->done[0]));
+            j->done_bytes[j->count] = bytes;
+            j->count++;
+            j->hashed = 0;
+        }
+        offset = ftell(f);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void journal_finish(NandroidJournal* j) {
+    unlink(j->path);
+    pthread_mutex_destroy(&j->lock);
+}
+
+// Sum the sizes of root's files in backup_path ("<name>.*"), fsyncing
+// each one if sync_files is set.
+static long long partition_backup_bytes(const char* backup_path, const char* root, int sync_files) {
+    const char* name = strrchr(root, '/');
+    name = name != NULL ? name + 1 : root;
+    size_t len = strlen(name);
+    long long total = 0;
+
+    DIR* d = opendir(backup_path);
+    if (d == NULL)
+        return -1;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, name, len) != 0 || de->d_name[len] != '.')
+            continue;
+        struct stat st;
+        int fd = openat(dirfd(d), de->d_name, O_RDONLY);
+        if (fd < 0)
+            continue;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (sync_files)
+                fsync(fd);
+            total += st.st_size;
+        }
+        close(fd);
+    }
+    closedir(d);
+    return total;
+}
+
+// Non-zero if root is already done.  For a backup, its files must still
+// be the size they were when it finished.
+static int journal_done(NandroidJournal* j, const char* backup_path, const char* root) {
+    int i;
+    for (i = 0; i < j->count; i++) {
+        if (strcmp(j->done[i], root) != 0)
+            continue;
+        if (backup_path == NULL ||
+                partition_backup_bytes(backup_path, root, 0) == j->done_bytes[i]) {
+            ui_print("%s already done, skipping.\n", root);
+            return 1;
+        }
+        ui_print("%s changed since it was backed up; redoing it.\n", root);
+        return 0;
+    }
+    return 0;
+}
+
+// Record root as done; safe to call from restore workers.  Anything
+// backed up after the sums were made needs new ones.
+static void journal_record(NandroidJournal* j, const char* root, long long bytes) {
+    char line[128];
+    snprintf(line, sizeof(line), "done %s %lld\n", root, bytes);
+    pthread_mutex_lock(&j->lock);
+    j->hashed = 0;
+    journal_append(j, line);
+    pthread_mutex_unlock(&j->lock);
+}
+
+// Back up one partition unless the journal says it is already done.
+static int backup_step(NandroidJournal* j, const char* backup_path, const char* root, int extended) {
+    int ret;
+    if (journal_done(j, backup_path, root))
+        return 0;
+    if (extended)
+        ret = nandroid_backup_partition_extended(backup_path, root, 0);
+    else
+        ret = nandroid_backup_partition(backup_path, root);
+    if (ret == 0)
+        journal_record(j, root, partition_backup_bytes(backup_path, root, 1));
+    return ret;
+}
+
+static int nandroid_backup_journaled(const char* backup_path, int skip_webtop, int skip_origsys, int resume) {
     //ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_reset_progress();  
 
@@ -259,19 +426,23 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
         ui_print("there may not be enough free space to complete backup... continuing...\n");
     
     char tmp[PATH_MAX];
-    sprintf(tmp, "mkdir -p %s", backup_path);
-    __system(tmp);
+    builtin_mkdir_p(backup_path, 0777);
+
+    NandroidJournal journal;
+    sprintf(tmp, "backup %d %d", skip_webtop, skip_origsys);
+    if (0 != journal_init(&journal, backup_path, NANDROID_JOURNAL, tmp, resume))
+        return print_and_error("nothing to resume in backup path.\n");
 
 #ifndef BOARD_HAS_LOCKED_BOOTLOADER
-    if  (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
+    if  (0 != (ret = backup_step(&journal, backup_path, "/boot", 0)))
         return ret;
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/recovery")))
+    if (0 != (ret = backup_step(&journal, backup_path, "/recovery", 0)))
         return ret;
 #endif
 
     Volume *vol = volume_for_path("/wimax");
-    if (vol != NULL && 0 == statfs(vol->device, &s))
+    if (vol != NULL && 0 == statfs(vol->device, &s) && !journal_done(&journal, backup_path, "/wimax"))
     {
         char serialno[PROPERTY_VALUE_MAX];
         ui_print("backing up WiMAX...\n");
@@ -281,13 +452,14 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
         ret = backup_raw_partition(vol->fs_type, vol->device, tmp);
         if (0 != ret)
             return print_and_error("error while dumping WiMAX image!\n");
+        journal_record(&journal, "/wimax", partition_backup_bytes(backup_path, "/wimax", 1));
     }
     
     /* backup original system */
-    if (skip_origsys == 0 && (0 != (ret = nandroid_backup_partition(backup_path, "/systemorig"))))
+    if (skip_origsys == 0 && (0 != (ret = backup_step(&journal, backup_path, "/systemorig", 0))))
         return ret;
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
+    if (0 != (ret = backup_step(&journal, backup_path, "/system", 0)))
         return ret;
 
     if(!skip_origsys)
@@ -295,11 +467,11 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
     else
 	ui_show_progress(0.28, 46);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
+    if (0 != (ret = backup_step(&journal, backup_path, "/data", 0)))
         return ret;
 
     if (has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/datadata")))
+        if (0 != (ret = backup_step(&journal, backup_path, "/datadata", 0)))
             return ret;
     }
 
@@ -313,7 +485,7 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
         if (0 != statfs("/sdcard/.android_secure", &s)) {
             ui_print("no /sdcard/.android_secure found. Skipping backup of applications on external storage.\n");
         } else {
-            if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/sdcard/.android_secure", 0)))
+            if (0 != (ret = backup_step(&journal, backup_path, "/sdcard/.android_secure", 1)))
                 return ret;
         }
     }
@@ -323,7 +495,7 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
     {
         if (0 == ensure_path_mounted("/emmc"))
             if (0 == stat("/emmc/.android_secure", &s))
-                if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/emmc/.android_secure", 0)))
+                if (0 != (ret = backup_step(&journal, backup_path, "/emmc/.android_secure", 1)))
                     return ret;
     }
 #endif
@@ -333,7 +505,7 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
     else
 	ui_show_progress(0.03, 5);
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
+    if (0 != (ret = backup_step(&journal, backup_path, "/cache", 1)))
         return ret;
 
 #ifdef BOARD_HAS_SDEXT
@@ -348,7 +520,7 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
     } else {
         if (0 != ensure_path_mounted("/sd-ext"))
             ui_print("could not mount sd-ext. sd-ext backup may not be supported on this device. skipping backup of sd-ext.\n");
-        else if (0 != (ret = nandroid_backup_partition(backup_path, "/sd-ext")))
+        else if (0 != (ret = backup_step(&journal, backup_path, "/sd-ext", 0)))
             return ret;
     }
 #endif
@@ -359,7 +531,7 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
     {
         if (0 != ensure_path_mounted("/osh"))
             ui_print("could not mount webtop. webtop backup may not be supported on this device. skipping backup of webtop.\n");
-        else if (0 != (ret = nandroid_backup_partition(backup_path, "/osh")))
+        else if (0 != (ret = backup_step(&journal, backup_path, "/osh", 0)))
             return ret;
     }
 #endif
@@ -368,25 +540,36 @@ int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_w
     else
 	ui_show_progress(0.45, 73);
 
-    ui_print("generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
-        ui_print("error while generating md5 sum!\n");
-        return ret;
+    // nandroid-md5.sh leaves the journals out of nandroid.md5, so the
+    // journal can stay until the sums are on disk and a run cut short
+    // while hashing just hashes again.
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    if (!journal.hashed || access(tmp, F_OK) != 0) {
+        ui_print("generating md5 sum...\n");
+        sprintf(tmp, "nandroid-md5.sh %s", backup_path);
+        if (0 != (ret = __system(tmp))) {
+            ui_print("error while generating md5 sum!\n");
+            return ret;
+        }
+        sync();
+        journal_append(&journal, "hashed\n");
     }
  
     sync();
+    journal_finish(&journal);
     ui_print("\nbackup complete!\n");
     ui_reset_progress();
     return 0;
 }
 
+int nandroid_backup(const char* backup_path, const char* sdcard_path, int skip_webtop, int skip_origsys) {
+    return nandroid_backup_journaled(backup_path, skip_webtop, skip_origsys, 0);
+}
+
 typedef int (*format_function)(char* root);
 
 static void ensure_directory(const char* dir) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "mkdir -p %s", dir);
-    __system(tmp);
+    builtin_mkdir_p(dir, 0777);
 }
 
 typedef int (*nandroid_restore_handler)(const char* backup_file_image, const char* backup_path, int callback);
@@ -446,9 +629,37 @@ static nandroid_restore_handler get_restore_handler(const char *backup_path) {
     return tar_extract_wrapper;
 }
 
-int nandroid_restore_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
+// One partition's worth of restore work.  Formatting and mounting touch
+// the mount table and make_ext4fs, neither of which is thread safe, so
+// they happen on the main thread; only the extraction itself runs on a
+// worker thread.
+typedef struct {
+    const char* mount_point;
+    int umount_when_finished;
+    char image[PATH_MAX];
+    nandroid_restore_handler handler;  // NULL: nothing left to extract
+    pthread_t thread;
+    int started;
+    int ret;
+} RestoreJob;
+
+#define NANDROID_RESTORE_THREADS 4
+
+// unyaffs keeps its state in globals, so only one may run at a time.
+static pthread_mutex_t unyaffs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int locked_unyaffs_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    pthread_mutex_lock(&unyaffs_lock);
+    int ret = unyaffs_wrapper(backup_file_image, backup_path, callback);
+    pthread_mutex_unlock(&unyaffs_lock);
+    return ret;
+}
+
+// Find the backup image for mount_point, format and mount the target,
+// and pick the handler that will extract it.  Returns non-zero on error;
+// a missing backup is not an error and leaves job->handler NULL.
+static int prepare_restore_partition(const char* backup_path, const char* mount_point, int umount_when_finished, RestoreJob* job) {
     int ret = 0;
-    int callback = 0; /* disable detailed progress bar */
     
     char* name = basename(mount_point);
 
@@ -460,7 +671,13 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     if (vol != NULL)
         device = vol->device;
 
-    char tmp[PATH_MAX];
+    job->mount_point = mount_point;
+    job->umount_when_finished = umount_when_finished;
+    job->handler = NULL;
+    job->started = 0;
+    job->ret = 0;
+
+    char* tmp = job->image;
     sprintf(tmp, "%s/%s.img", backup_path, name);
     struct statfs file_info;
     if (0 != (ret = statfs(tmp, &file_info))) {
@@ -530,16 +747,65 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
         ui_print("error finding an appropriate restore handler.\n");
         return -2;
     }
-    if (0 != (ret = restore_handler(tmp, mount_point, callback))) {
-        ui_print("error while restoring %s!\n", mount_point);
+    if (restore_handler == unyaffs_wrapper)
+        restore_handler = locked_unyaffs_wrapper;
+    job->handler = restore_handler;
+    return 0;
+}
+
+static int run_restore_partition(RestoreJob* job) {
+    int callback = 0; /* disable detailed progress bar */
+    int ret;
+    if (0 != (ret = job->handler(job->image, job->mount_point, callback))) {
+        ui_print("error while restoring %s!\n", job->mount_point);
         return ret;
     }
+    // not basename(): bionic's returns a shared static buffer
+    const char* name = strrchr(job->mount_point, '/');
+    ui_print("restoring %s completed.\n", name != NULL ? name + 1 : job->mount_point);
+    return 0;
+}
+
+static void finish_restore_partition(RestoreJob* job) {
+    if (job->handler != NULL && job->umount_when_finished) {
+        ensure_path_unmounted(job->mount_point);
+    }
+}
 
-    if (umount_when_finished) {
-        ensure_path_unmounted(mount_point);
+int nandroid_restore_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
+    RestoreJob job;
+    int ret = prepare_restore_partition(backup_path, mount_point, umount_when_finished, &job);
+    if (ret != 0 || job.handler == NULL)
+        return ret;
+    if (0 != (ret = run_restore_partition(&job)))
+        return ret;
+    finish_restore_partition(&job);
+    return 0;
+}
+
+// Raw (mtd/bml/emmc) partitions are erased and flashed right away; there
+// is nothing left for a worker to do afterwards.
+static int is_raw_volume(Volume* vol) {
+    return strcmp(vol->fs_type, "mtd") == 0 ||
+            strcmp(vol->fs_type, "bml") == 0 ||
+            strcmp(vol->fs_type, "emmc") == 0;
+}
+
+static int restore_raw_volume(const char* backup_path, const char* root, Volume* vol) {
+    char tmp[PATH_MAX];
+    int ret;
+    const char* name = basename(root);
+    ui_print("erasing %s before restore...\n", name);
+    if (0 != (ret = format_volume(root))) {
+        ui_print("error while erasing %s image!", name);
+        return ret;
+    }
+    sprintf(tmp, "%s%s.img", backup_path, root);
+    ui_print("restoring %s image...\n", name);
+    if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp))) {
+        ui_print("error while flashing %s image!", name);
+        return ret;
     }
-    
-    ui_print("restoring %s completed.\n", name);
     return 0;
 }
 
@@ -550,48 +816,147 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
         return 0;
 
     // see if we need a raw restore (mtd)
-    char tmp[PATH_MAX];
-    if (strcmp(vol->fs_type, "mtd") == 0 ||
-            strcmp(vol->fs_type, "bml") == 0 ||
-            strcmp(vol->fs_type, "emmc") == 0) {
-        int ret;
-        const char* name = basename(root);
-        ui_print("erasing %s before restore...\n", name);
-        if (0 != (ret = format_volume(root))) {
-            ui_print("error while erasing %s image!", name);
+    if (is_raw_volume(vol))
+        return restore_raw_volume(backup_path, root, vol);
+    return nandroid_restore_partition_extended(backup_path, root, 1);
+}
+
+// The restore scheduler: the main thread formats and mounts each target
+// in turn and hands it to a worker to extract, then moves straight on to
+// formatting the next target while earlier ones are still extracting.
+// Extraction streams from the backup to the target (tar and unyaffs both
+// read and write as they go), so a full restore takes about as long as
+// its slowest partition rather than the sum of all of them.
+typedef struct {
+    RestoreJob jobs[8];
+    int count;
+    int running;
+    NandroidJournal* journal;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} RestoreScheduler;
+
+typedef struct {
+    RestoreScheduler* sched;
+    RestoreJob* job;
+} RestoreWorkerArgs;
+
+// Once a partition's data is on disk, journal it as done.
+static void restore_checkpoint(RestoreScheduler* sched, const char* root) {
+    sync();
+    journal_record(sched->journal, root, 0);
+}
+
+static void* restore_worker(void* arg) {
+    RestoreWorkerArgs* args = (RestoreWorkerArgs*)arg;
+    RestoreScheduler* sched = args->sched;
+    RestoreJob* job = args->job;
+    free(args);
+
+    int ret = run_restore_partition(job);
+    if (ret == 0)
+        restore_checkpoint(sched, job->mount_point);
+
+    pthread_mutex_lock(&sched->lock);
+    job->ret = ret;
+    sched->running--;
+    pthread_cond_signal(&sched->done);
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+// Prepare root and start its extraction.  Returns non-zero if
+// preparation failed; extraction errors are collected by
+// restore_scheduler_wait().
+static int restore_scheduler_add(RestoreScheduler* sched, const char* backup_path, const char* root, int raw_ok, int umount_when_finished) {
+    int ret;
+    if (journal_done(sched->journal, NULL, root))
+        return 0;
+
+    if (raw_ok) {
+        Volume *vol = volume_for_path(root);
+        if (vol == NULL || vol->fs_type == NULL)
+            return 0;
+        if (is_raw_volume(vol)) {
+            if (0 == (ret = restore_raw_volume(backup_path, root, vol)))
+                restore_checkpoint(sched, root);
             return ret;
         }
-        sprintf(tmp, "%s%s.img", backup_path, root);
-        ui_print("restoring %s image...\n", name);
-        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp))) {
-            ui_print("error while flashing %s image!", name);
-            return ret;
+    }
+
+    if (sched->count == (int)(sizeof(sched->jobs) / sizeof(sched->jobs[0]))) {
+        if (0 == (ret = nandroid_restore_partition_extended(backup_path, root, umount_when_finished)))
+            restore_checkpoint(sched, root);
+        return ret;
+    }
+
+    RestoreJob* job = &sched->jobs[sched->count];
+    ret = prepare_restore_partition(backup_path, root, umount_when_finished, job);
+    if (ret != 0 || job->handler == NULL)
+        return ret;
+    sched->count++;
+
+    RestoreWorkerArgs* args = malloc(sizeof(RestoreWorkerArgs));
+    pthread_mutex_lock(&sched->lock);
+    while (sched->running >= NANDROID_RESTORE_THREADS)
+        pthread_cond_wait(&sched->done, &sched->lock);
+    if (args != NULL) {
+        args->sched = sched;
+        args->job = job;
+        if (pthread_create(&job->thread, NULL, restore_worker, args) == 0) {
+            job->started = 1;
+            sched->running++;
+        } else {
+            free(args);
         }
-        return 0;
     }
-    return nandroid_restore_partition_extended(backup_path, root, 1);
+    pthread_mutex_unlock(&sched->lock);
+
+    if (!job->started) {
+        // No thread to be had; extract it here instead.
+        if (0 == (job->ret = run_restore_partition(job)))
+            restore_checkpoint(sched, root);
+    }
+    return 0;
 }
 
-int nandroid_restore(const char* backup_path,
-     int restore_system, int restore_data, int restore_cache, int restore_systemorig)
+// Wait for every extraction, unmount what was asked for, and return the
+// first error in restore order.
+static int restore_scheduler_wait(RestoreScheduler* sched) {
+    int ret = 0;
+    int i;
+    for (i = 0; i < sched->count; i++) {
+        RestoreJob* job = &sched->jobs[i];
+        if (job->started)
+            pthread_join(job->thread, NULL);
+        if (job->ret == 0)
+            finish_restore_partition(job);
+        else if (ret == 0)
+            ret = job->ret;
+    }
+    sched->count = 0;
+    return ret;
+}
+
+static int nandroid_restore_journaled(const char* backup_path,
+     int restore_system, int restore_data, int restore_cache, int restore_systemorig, int resume)
 {
     float total_restore_time = 0;
-    float system_restore_time = SYSTEM_RESTORE_TIME;
-    float systemorig_restore_time = SYSTEMORIG_RESTORE_TIME;
-    float data_restore_time = DATA_RESTORE_TIME;
-    float cache_restore_time = CACHE_RESTORE_TIME;
+    float restore_time = 0;
     float md5_restore_time = MD5_RESTORE_TIME;
 
     total_restore_time += MD5_RESTORE_TIME;
 
-    if(restore_system)
-	total_restore_time += SYSTEM_RESTORE_TIME;
-    if(restore_systemorig)
-	total_restore_time += SYSTEMORIG_RESTORE_TIME;
-    if(restore_data)
-	total_restore_time += DATA_RESTORE_TIME;
-    if(restore_cache)
-	total_restore_time += CACHE_RESTORE_TIME;
+    // Partitions restore side by side, so the slowest one sets the pace.
+    if(restore_system && restore_time < SYSTEM_RESTORE_TIME)
+	restore_time = SYSTEM_RESTORE_TIME;
+    if(restore_systemorig && restore_time < SYSTEMORIG_RESTORE_TIME)
+	restore_time = SYSTEMORIG_RESTORE_TIME;
+    if(restore_data && restore_time < DATA_RESTORE_TIME)
+	restore_time = DATA_RESTORE_TIME;
+    if(restore_cache && restore_time < CACHE_RESTORE_TIME)
+	restore_time = CACHE_RESTORE_TIME;
+    total_restore_time += restore_time;
 
     //ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_reset_progress();  
@@ -606,80 +971,132 @@ int nandroid_restore(const char* backup_path,
     }
 
     char tmp[PATH_MAX];
+    NandroidJournal journal;
+    sprintf(tmp, "restore %d %d %d %d", restore_system, restore_data, restore_cache, restore_systemorig);
+    if (0 != journal_init(&journal, backup_path, NANDROID_RESTORE_JOURNAL, tmp, resume))
+        return print_and_error("nothing to resume in backup path.\n");
     
-    ui_show_progress((md5_restore_time / total_restore_time), md5_restore_time); 
-
-    ui_print("checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
-        return print_and_error("mD5 mismatch.\n");
-    
-    int ret;
-
-    struct stat s;
-
-    if (restore_systemorig)
-        ui_show_progress((systemorig_restore_time / total_restore_time), systemorig_restore_time); 
-
-    if (restore_systemorig && 0 != (ret = nandroid_restore_partition(backup_path, "/systemorig")))
-	return ret;
-    //else ui_set_progress(0.45);
-    if (restore_system)
-        ui_show_progress((system_restore_time / total_restore_time), system_restore_time); 
+    if (!journal.verified) {
+        ui_show_progress((md5_restore_time / total_restore_time), md5_restore_time); 
+
+        ui_print("checking MD5 sums...\n");
+        sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
+        if (0 != __system(tmp))
+            return print_and_error("mD5 mismatch.\n");
+        journal_append(&journal, "verified\n");
+    }
     
-    if (restore_system && 0 != (ret = nandroid_restore_partition(backup_path, "/system")))
-        return ret;
-    //else ui_set_progress(0.65);
-
-    if (restore_data)
-        ui_show_progress((data_restore_time / total_restore_time), data_restore_time); 
-
-    if (restore_data) {
-        if (0 != (ret = nandroid_restore_partition(backup_path, "/data")))
-            return ret;
+    int ret = 0;
+    RestoreScheduler sched;
+    sched.count = 0;
+    sched.running = 0;
+    sched.journal = &journal;
+    pthread_mutex_init(&sched.lock, NULL);
+    pthread_cond_init(&sched.done, NULL);
+
+    if (restore_time > 0)
+        ui_show_progress((restore_time / total_restore_time), restore_time); 
+
+    // On the first failure stop scheduling new work, but still wait for
+    // whatever is already extracting.
+    do {
+        if (restore_systemorig && 0 != (ret = restore_scheduler_add(&sched, backup_path, "/systemorig", 1, 1)))
+            break;
+        if (restore_system && 0 != (ret = restore_scheduler_add(&sched, backup_path, "/system", 1, 1)))
+            break;
+
+        if (restore_data) {
+            if (0 != (ret = restore_scheduler_add(&sched, backup_path, "/data", 1, 1)))
+                break;
 
-        if (has_datadata()) {
-            if (0 != (ret = nandroid_restore_partition(backup_path, "/datadata")))
-                return ret;
-        }
-	
+            if (has_datadata()) {
+                if (0 != (ret = restore_scheduler_add(&sched, backup_path, "/datadata", 1, 1)))
+                    break;
+            }
 	
-        if (0 != (ret = nandroid_restore_partition_extended(backup_path, "/sdcard/.android_secure", 0)))
-            return ret;
+            if (0 != (ret = restore_scheduler_add(&sched, backup_path, "/sdcard/.android_secure", 0, 0)))
+                break;
 #ifdef BOARD_HAS_SDCARD_INTERNAL
-        if (0 != (ret = nandroid_restore_partition_extended(backup_path, "/emmc/.android_secure", 0)))
-            return ret;
+            if (0 != (ret = restore_scheduler_add(&sched, backup_path, "/emmc/.android_secure", 0, 0)))
+                break;
 #endif
-    }
-    //else ui_set_progress(0.80);
+        }
 
-    if (restore_cache)
-        ui_show_progress((cache_restore_time / total_restore_time), cache_restore_time); 
-    if (restore_cache && 0 != (ret = nandroid_restore_partition_extended(backup_path, "/cache", 0)))
-        return ret;
-    //else ui_set_progress(0.85);
+        if (restore_cache && 0 != (ret = restore_scheduler_add(&sched, backup_path, "/cache", 0, 0)))
+            break;
 
 #ifdef BOARD_HAS_SDEXT
-    if (restore_sdext && 0 != (ret = nandroid_restore_partition(backup_path, "/sd-ext")))
-        return ret;
+        if (restore_sdext && 0 != (ret = restore_scheduler_add(&sched, backup_path, "/sd-ext", 1, 1)))
+            break;
 #endif
 
 #ifdef BOARD_HAS_WEBTOP
-    if (restore_osh && 0 != (ret = nandroid_restore_partition_extended(backup_path, "/osh", 0)))
-        return ret;
+        if (restore_osh && 0 != (ret = restore_scheduler_add(&sched, backup_path, "/osh", 0, 0)))
+            break;
 #endif
+    } while (0);
+
+    int wait_ret = restore_scheduler_wait(&sched);
+    if (ret == 0)
+        ret = wait_ret;
+    pthread_cond_destroy(&sched.done);
+    pthread_mutex_destroy(&sched.lock);
+    if (ret != 0)
+        return ret;
     
     sync();
+    journal_finish(&journal);
     //ui_set_background(BACKGROUND_ICON_NONE);
     ui_print("\nrestore complete!\n");
     ui_reset_progress();
     return 0;
 }
 
+int nandroid_restore(const char* backup_path,
+     int restore_system, int restore_data, int restore_cache, int restore_systemorig)
+{
+    return nandroid_restore_journaled(backup_path, restore_system, restore_data, restore_cache, restore_systemorig, 0);
+}
+
+// Continue an interrupted backup or restore from its journal.
+static int nandroid_resume(const char* backup_path)
+{
+    char path[PATH_MAX];
+    char header[128];
+    int a, b, c, d;
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("can't mount backup path.\n");
+
+    // A restore journal means the last run was a restore from here.
+    const char* journals[] = { NANDROID_RESTORE_JOURNAL, NANDROID_JOURNAL, NULL };
+    int i;
+    for (i = 0; journals[i] != NULL; i++) {
+        sprintf(path, "%s/%s", backup_path, journals[i]);
+        FILE* f = fopen(path, "r");
+        if (f == NULL)
+            continue;
+        header[0] = '\0';
+        fgets(header, sizeof(header), f);
+        fclose(f);
+
+        if (sscanf(header, "restore %d %d %d %d", &a, &b, &c, &d) == 4) {
+            ui_print("resuming restore from %s\n", backup_path);
+            return nandroid_restore_journaled(backup_path, a, b, c, d, 1);
+        }
+        if (sscanf(header, "backup %d %d", &a, &b) == 2) {
+            ui_print("resuming backup to %s\n", backup_path);
+            return nandroid_backup_journaled(backup_path, a, b, 1);
+        }
+    }
+    return print_and_error("no interrupted backup or restore found.\n");
+}
+
 int nandroid_usage()
 {
     printf("usage: nandroid backup\n");
     printf("usage: nandroid restore <directory>\n");
+    printf("usage: nandroid resume <directory>\n");
     return 1;
 }
 
@@ -705,6 +1122,13 @@ int nandroid_main(int argc, char** argv)
         int safemode=get_safe_mode();
 	return nandroid_restore(argv[2], 1, 1, 1, (safemode) ? 0 : 1 );
     }
+
+    if (strcmp("resume", argv[1]) == 0)
+    {
+        if (argc != 3)
+            return nandroid_usage();
+        return nandroid_resume(argv[2]);
+    }
     
     return nandroid_usage();
 }
@@ -47,8 +47,10 @@
 
 #include "extendedcommands.h"
 #include "flashutils/flashutils.h"
+#include "mmcutils/mmcutils.h"
 
 #include "safebootcommands.h"
+#include "logger.h"
 
 #include "console.h"
 
@@ -61,6 +63,7 @@ static const struct option OPTIONS[] = {
   { "wipe_cache", no_argument, NULL, 'c' },
   { "set_encrypted_filesystems", required_argument, NULL, 'e' },
   { "show_text", no_argument, NULL, 't' },
+  { "secure_wipe", no_argument, NULL, 'S' },
   { NULL, 0, NULL, 0 },
 };
 
@@ -88,6 +91,7 @@ static int poweroff;
  *   --wipe_data - erase user data (and cache), then reboot
  *   --wipe_cache - wipe cache (but not user data), then reboot
  *   --set_encrypted_filesystem=on|off - enables / diasables encrypted fs
+ *   --secure_wipe - wipes securely erase (BLKSECDISCARD) the old data
  *
  * After completing, we remove /cache/recovery/command and reboot.
  * Arguments may also be supplied in the bootloader control block (BCB).
@@ -272,6 +276,8 @@ copy_log_file(const char* destination, int append) {
     if (log == NULL) {
         LOGE("can't open %s\n", destination);
     } else {
+        // Get everything logged so far into the temp log first.
+        logger_flush();
         FILE *tmplog = fopen(TEMPORARY_LOG_FILE, "r");
         if (tmplog == NULL) {
             LOGE("can't open %s\n", TEMPORARY_LOG_FILE);
@@ -279,8 +285,11 @@ copy_log_file(const char* destination, int append) {
             if (append) {
                 fseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
             }
-            char buf[4096];
-            while (fgets(buf, sizeof(buf), tmplog)) fputs(buf, log);
+            char buf[64 * 1024];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), tmplog)) > 0) {
+                if (fwrite(buf, 1, n, log) != n) break;
+            }
             if (append) {
                 tmplog_offset = ftell(tmplog);
             }
@@ -684,8 +693,10 @@ main(int argc, char **argv) {
     time_t start = time(NULL);
 
     // If these fail, there's not really anywhere to complain...
-    freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
-    freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    if (logger_init(TEMPORARY_LOG_FILE) != 0) {
+        freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
+        freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    }
     printf("starting recovery on %s", ctime(&start));
 
     ui_init();
@@ -718,6 +729,7 @@ main(int argc, char **argv) {
         case 'c': wipe_cache = 1; break;
         case 'e': encrypted_fs_mode = optarg; toggle_secure_fs = 1; break;
         case 't': ui_show_text(1); break;
+        case 'S': format_discard_mode = FORMAT_DISCARD_SECURE; break;
         case '?':
             LOGE("invalid command argument\n");
             continue;
@@ -32,7 +32,9 @@
 #endif
 
 #include "flashutils/flashutils.h"
+#include "mmcutils/mmcutils.h"
 #include "extendedcommands.h"
+#include "libcrecovery/common.h"
 
 int num_volumes;
 Volume* device_volumes;
@@ -157,9 +159,7 @@ int try_mount(const char* device, const char* mount_point, const char* fs_type,
                        MS_NOATIME | MS_NODEV | MS_NODIRATIME, "");
     }
     else {
-        char mount_cmd[PATH_MAX];
-        sprintf(mount_cmd, "mount -t %s -o%s %s %s", fs_type, fs_options, device, mount_point);
-        ret = __system(mount_cmd);
+        ret = builtin_mount(device, mount_point, fs_type, fs_options);
     }
     if (ret == 0)
         return 0;
@@ -246,33 +246,22 @@ int ensure_path_mounted_at_mount_point(const char* path, const char* mount_point
             return 0;
         return result;
     } else {
-        // let's try mounting with the mount binary and hope for the best.
-	char mount_cmd[PATH_MAX];
-	char mount_cmd_umount_systemorig[PATH_MAX];
-	char mount_cmd_mount_systemorig[PATH_MAX];
-        char mount_cmd_umount_proc[PATH_MAX];
-	char mount_cmd_mount_proc[PATH_MAX];
-
-	printf("Trying to mount partition on \"%s\" with mount binary\n", path);
+        // let's try mounting the way the mount binary would, from /etc/fstab.
+	printf("Trying to mount partition on \"%s\" from /etc/fstab\n", path);
 	
 	if (!(path == NULL)) {
 	  if(strcmp(path, "/systemorig") == 0) {
-	    sprintf(mount_cmd_umount_proc, "umount /proc");
-	    sprintf(mount_cmd_mount_proc, "mount -t proc /dev/proc /proc");
-	    sprintf(mount_cmd_umount_systemorig, "umount %s", path);
-	    sprintf(mount_cmd_mount_systemorig, "mount /dev/block/mmcblk1p21 %s", path);
-	    int proc_umount_res = __system(mount_cmd_umount_proc);
+	    int proc_umount_res = builtin_umount("/proc", 0);
 	    printf("proc umount res: \"%d\"\n", proc_umount_res);
-	    int	proc_mount_res  = __system(mount_cmd_mount_proc);
+	    int	proc_mount_res  = builtin_mount("/dev/proc", "/proc", "proc", NULL);
 	    printf("proc mount res: \"%d\"\n", proc_mount_res);
-	    int systemorig_umount_res = __system(mount_cmd_umount_systemorig);
+	    int systemorig_umount_res = builtin_umount(path, 0);
 	    printf("systemorig umount res: \"%d\"\n", systemorig_umount_res);
-	    return __system(mount_cmd_mount_systemorig);
+	    return builtin_mount("/dev/block/mmcblk1p21", path, NULL, NULL);
 	  }
         }
 		
-        sprintf(mount_cmd, "mount %s", path);
-        return __system(mount_cmd);
+        return builtin_mount_fstab(path);
     }
 
     LOGE("unknown fs_type \"%s\" for %s\n", v->fs_type, mount_point);
@@ -371,6 +360,7 @@ int format_volume(const char* volume) {
     }
 
     if (strcmp(v->fs_type, "ext4") == 0) {
+        discard_for_format(v->device);
         reset_ext4fs_info();
         int result = make_ext4fs(v->device, NULL, NULL, 0, 0, 0);
         if (result != 0) {
@@ -33,6 +33,8 @@
 #include "mtdutils/mtdutils.h"
 
 #include "safebootcommands.h"
+#include "libcrecovery/common.h"
+#include "minzip/DirUtil.h"
 
 #define MENU_HEADER_COLS 55
 
@@ -47,7 +49,7 @@ int check_systemorig_mount() {
     }
     const MountedVolume* mv = find_mounted_volume_by_mount_point("/systemorig");
     if (mv == NULL) {
-	__system("mount /dev/block/systemorig /systemorig");
+	builtin_mount("/dev/block/systemorig", "/systemorig", NULL, NULL);
 	result = scan_mounted_volumes();
 	if (result < 0) {
 	    LOGE("failed to scan mounted volumes\n");
@@ -164,12 +166,12 @@ void quick_toggle_safe_mode() {
         /* 4. touch SAFE_SYSTEM_FILE */
         sprintf(cmd, "touch %s", SAFE_SYSTEM_FILE);
         ui_print("\n%s\n", cmd);
-        __system(cmd);
+        builtin_touch(SAFE_SYSTEM_FILE);
     } else {
         /* 4. rm SAFE_SYSTEM_FILE */
         sprintf(cmd, "rm %s", SAFE_SYSTEM_FILE);
         ui_print("\n%s\n", cmd);
-        __system(cmd);
+        unlink(SAFE_SYSTEM_FILE);
     }
     safemode = get_safe_mode();
     ui_print("safe system is now: %s!\n", safemode ? "ENABLED" : "DISABLED");
@@ -207,8 +209,7 @@ void toggle_safe_mode() {
     //ui_show_indeterminate_progress();
     if (!safemode) {
    
-        sprintf(cmd, "mkdir -p %s", orig_backup_path);
-        __system(cmd);
+        builtin_mkdir_p(orig_backup_path, 0777);
 	
 	ui_show_progress(0.22,46);	
 
@@ -236,22 +237,21 @@ void toggle_safe_mode() {
 	ui_show_progress(0.03, 5);
 
         /* 3. wipe Dalvik Cache */
-        __system("rm -r /data/dalvik-cache");
-        __system("rm -r /cache/dalvik-cache");
-        //__system("rm -r /sd-ext/dalvik-cache");
+        dirUnlinkHierarchy("/data/dalvik-cache");
+        dirUnlinkHierarchy("/cache/dalvik-cache");
+        //dirUnlinkHierarchy("/sd-ext/dalvik-cache");
         //ui_set_progress(0.95);
 
         /* 4. touch SAFE_SYSTEM_FILE */
         sprintf(cmd, "touch %s", SAFE_SYSTEM_FILE);
         ui_print("\n%s\n", cmd);
-        __system(cmd);
+        builtin_touch(SAFE_SYSTEM_FILE);
 
 	ui_print("swap to safe system complete.\n");
 
     } else {
 
-        sprintf(cmd, "mkdir -p %s", safe_backup_path);
-        __system(cmd);
+        builtin_mkdir_p(safe_backup_path, 0777);
 
 	ui_show_progress(0.22,46);	
 
@@ -279,14 +279,14 @@ void toggle_safe_mode() {
         //ui_set_progress(0.90);
 
         /* 3. wipe Dalvik Cache */
-        __system("rm -r /data/dalvik-cache");
-        __system("rm -r /cache/dalvik-cache");
-        //__system("rm -r /sd-ext/dalvik-cache");
+        dirUnlinkHierarchy("/data/dalvik-cache");
+        dirUnlinkHierarchy("/cache/dalvik-cache");
+        //dirUnlinkHierarchy("/sd-ext/dalvik-cache");
 
         /* 4. rm SAFE_SYSTEM_FILE */
         sprintf(cmd, "rm %s", SAFE_SYSTEM_FILE);
         ui_print("\n%s\n", cmd);
-        __system(cmd);
+        unlink(SAFE_SYSTEM_FILE);
 
 	ui_print("swap to original system complete.\n");
     }
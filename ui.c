@@ -39,8 +39,10 @@
 #include "minui/minui.h"
 #include "recovery_ui.h"
 #include "safebootcommands.h"
+#include "logger.h"
 
 extern int __system(const char *command);
+extern int builtin_tail(const char *path, int lines, FILE *out);
 
 #ifdef BOARD_HAS_NO_SELECT_BUTTON
 static int gShowBackButton = 1;
@@ -1286,18 +1288,31 @@ void ui_printlogtail(int nb_lines) {
     int line=0;
     //don't log output to recovery.log
     ui_log_stdout=0;
-    sprintf(tmp, "tail -n %d /tmp/recovery.log > /tmp/tail.log", nb_lines);
-    __system(tmp);
-    f = fopen("/tmp/tail.log", "rb");
-    if (f != NULL) {
+    if (logger_running()) {
+        // the last lines are already in memory; no need to touch the file
+        int max = nb_lines < LOGGER_RING_LINES ? nb_lines : LOGGER_RING_LINES;
+        LogLine* lines = malloc(max * sizeof(LogLine));
+        if (lines != NULL) {
+            int n = logger_tail(lines, max);
+            for (line = 0; line < n; line++)
+                ui_print("%s\n", lines[line].text);
+            free(lines);
+        }
+        ui_log_stdout=1;
+        return;
+    }
+    f = fopen("/tmp/tail.log", "w+b");
+    if (f != NULL && builtin_tail("/tmp/recovery.log", nb_lines, f) == 0) {
+        rewind(f);
         while (line < nb_lines) {
             log_data = fgets(tmp, PATH_MAX, f);
             if (log_data == NULL) break;
             ui_print("%s", tmp);
             line++;
         }
-        fclose(f);
     }
+    if (f != NULL)
+        fclose(f);
     ui_log_stdout=1;
 }
 
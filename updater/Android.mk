@@ -6,6 +6,8 @@ updater_src_files := \
 	install.c \
 	../mounts.c \
 	updater.c \
+	perms.c \
+	trace.c \
 	../roots.c \
 #
 # Build a statically-linked binary to include in OTA packages
@@ -83,6 +85,23 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 include $(BUILD_EXECUTABLE)
 
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := perms_test.c perms.c trace.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+
+LOCAL_MODULE := updater_perms_test
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_STATIC_LIBRARIES := libedify libc
+
+include $(BUILD_EXECUTABLE)
+
+
 file := $(PRODUCT_OUT)/utilities/update-binary
 ALL_PREBUILT += $(file)
 $(file) : $(TARGET_OUT)/bin/updater | $(ACP)
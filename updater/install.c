@@ -20,6 +20,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -43,8 +44,11 @@
 #include "minzip/DirUtil.h"
 #include "mtdutils/mtdutils.h"
 #include "updater.h"
+#include "perms.h"
+#include "trace.h"
 #include "applypatch/applypatch.h"
 #include "flashutils/flashutils.h"
+#include "mmcutils/mmcutils.h"
 #include "../roots.h"
 #include "../mounts.h"
 #include "../safebootcommands.h"
@@ -111,6 +115,20 @@ allow_flash_non_safe()
 
 int safe_mode;
 
+// When not in safe mode, a script that touches /system means the
+// stock system, which is mounted at /systemorig.  Returns 'path' with
+// that prefix swapped (or a plain copy), in scratch memory that lasts
+// until the end of the current statement.
+static char* systemorig_path(State* state, const char* path) {
+    if (strncmp(path, "/system", 7) != 0) {
+        return ArenaStrdup(state, path);
+    }
+    char* result = ArenaAlloc(state, strlen(path) + 5);
+    strcpy(result, "/systemorig");
+    strcat(result, path + 7);
+    return result;
+}
+
 // mount(fs_type, partition_type, location, mount_point)
 //
 //    fs_type="yaffs2" partition_type="MTD"     location=partition
@@ -333,6 +351,7 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
         result = location;
 #ifdef USE_EXT4
     } else if (strcmp(fs_type, "ext4") == 0) {
+        discard_for_format(location);
         reset_ext4fs_info();
         int status = make_ext4fs(location, NULL, NULL, 0, 0, 0);
         if (status != 0) {
@@ -375,90 +394,24 @@ done:
 
 
 Value* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char** paths = malloc(argc * sizeof(char*));
     safe_mode = get_safe_mode();
+    char** paths = ReadVarArgs(state, argc, argv);
+    if (paths == NULL) return NULL;
+
+    bool recursive = (strcmp(name, "delete_recursive") == 0);
+
     int i;
-    int paths_count;
     int success = 0;
-    char paths_copy[argc][PATH_MAX];
     for (i = 0; i < argc; ++i) {
-	    paths[i] = Evaluate(state, argv[i]);
-	    if (paths[i] == NULL) {
-		int j;
-		for (j = 0; j < i; ++i) {
-		    free(paths[j]);
-		}
-		free(paths);
-		return NULL;
-	    }
-    }
-
-    switch(safe_mode)
-    {
-	case 0:
-	{
-	    bool recursive = (strcmp(name, "delete_recursive") == 0);
-		
-	    for (paths_count=0; paths_count < argc; ++paths_count)
-	    {
-		if ( !(strncmp(paths[paths_count],"/system",7)) )
-		{
-		    strcpy(paths_copy[paths_count],paths[paths_count]);
-		    if(strlen(paths_copy[paths_count]))
-		    {
-			if(!strcmp(paths_copy[paths_count],"/system"))
-			{
-			    int length=strlen(paths[paths_count])+1;
-			    memmove(&paths_copy[paths_count][11], &paths_copy[paths_count][7],((length*sizeof(char))-7));
-			    paths_copy[paths_count][7] = 'o';
-			    paths_copy[paths_count][8] = 'r';
-			    paths_copy[paths_count][9] = 'i';
-			    paths_copy[paths_count][10] = 'g';
-			    paths_copy[paths_count][(strlen(paths_copy[paths_count]))] = '\0';
-			}
-		    }
-		}
-	    }
-
-	    for (i = 0; i < argc; ++i) 
-	    {
-	        if ((recursive ? dirUnlinkHierarchy(paths_copy[i]) : unlink(paths_copy[i])) == 0)
-	        {
-		    ++success;
-	        }
-	        free(paths[i]);
-	    }
-	break;
-	}
-	case 1:
-    	{
-	    for (i = 0; i < argc; ++i) 
-	    {
-		paths[i] = Evaluate(state, argv[i]);
-		if (paths[i] == NULL) {
-		    int j;
-		    for (j = 0; j < i; ++i) {
-			free(paths[j]);
-		    }
-		    free(paths);
-		    return NULL;
-		}
-	    }
-
-	    bool recursive = (strcmp(name, "delete_recursive") == 0);
-
-	    for (i = 0; i < argc; ++i) 
-	    {
-	        if ((recursive ? dirUnlinkHierarchy(paths[i]) : unlink(paths[i])) == 0)
-	        {
-		    ++success;
-	        }
-	        free(paths[i]);
-	    }
-	break;
+        const char* path = paths[i];
+        if (!safe_mode && strcmp(path, "/system") == 0) {
+            path = systemorig_path(state, path);
+        }
+        if ((recursive ? dirUnlinkHierarchy(path) : unlink(path)) == 0) {
+            ++success;
         }
+        free(paths[i]);
     }
-    
     free(paths);
 
     char buffer[10];
@@ -503,6 +456,13 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(frac_str);
 }
 
+// When tracing, each entry's span runs from the end of the previous
+// one (or the start of the extraction) to when it has been written.
+static void TraceExtractedEntry(const char* fn, void* cookie) {
+    TraceEnd("entry", fn, NULL);
+    TraceBegin();
+}
+
 // package_extract_dir(package_path, destination_path)
 Value* PackageExtractDirFn(const char* name, State* state,
                           int argc, Expr* argv[]) {
@@ -512,47 +472,35 @@ Value* PackageExtractDirFn(const char* name, State* state,
     safe_mode = get_safe_mode();
     char* zip_path;
     char* dest_path;
-    char dest_copy[PATH_MAX];
     if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
 
-    if (strlen(dest_path) == 0) 
-    {
+    if (strlen(dest_path) == 0) {
+        free(zip_path);
+        free(dest_path);
         return ErrorAbort(state, "dest_path argument to %s() can't be empty", name);
     }
-    else if ( !(safe_mode ) && !(strcmp(dest_path,"/system")) && allow_flash_non_safe())
-    {
-     	strcpy(dest_copy, dest_path);
-	if(strlen(dest_copy))
-	{
-	    if(!strcmp(dest_copy,"/system"))
-	    {
-		int tlength=strlen(dest_path)+1;
-		memmove(&dest_copy[11], &dest_copy[7],((tlength*sizeof(char))-7));
-		dest_copy[7] = 'o';
-		dest_copy[8] = 'r';
-		dest_copy[9] = 'i';
-		dest_copy[10] = 'g';
-		dest_copy[(strlen(dest_copy))] = '\0';
-	    }
-	}
-	dest_path = strdup(dest_copy);
-    }
-
-    fprintf(stderr,"\nPackageExtractDirFn: dest_path=\"%s\"\n", dest_path);
-    
+
+    const char* dest = dest_path;
+    if (!safe_mode && strcmp(dest_path, "/system") == 0 && allow_flash_non_safe()) {
+        dest = systemorig_path(state, dest_path);
+    }
+
+    fprintf(stderr,"\nPackageExtractDirFn: dest_path=\"%s\"\n", dest);
+
     ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
 
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
-    bool success;
-    if((safe_mode))
-    {
-        success = mzExtractRecursive(za, zip_path, dest_path, MZ_EXTRACT_FILES_ONLY, &timestamp, NULL, NULL);
-    }
-    else
-    {
-        success = mzExtractRecursive(za, zip_path, dest_copy, MZ_EXTRACT_FILES_ONLY, &timestamp, NULL, NULL);
-    }
+    // Have the tree on disk before the script goes on to act on it (and
+    // before a power cut can leave it half written), with one syncfs()
+    // of the target rather than an fsync() per file.
+    TraceBegin();
+    bool success = mzExtractRecursive(za, zip_path, dest,
+                                      MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_SYNC,
+                                      &timestamp,
+                                      Tracing() ? TraceExtractedEntry : NULL,
+                                      NULL);
+    TraceDiscard();
     free(zip_path);
     free(dest_path);
     return StringValue(strdup(success ? "t" : ""));
@@ -566,7 +514,6 @@ Value* PackageExtractDirFn(const char* name, State* state,
 Value* PackageExtractFileFn(const char* name, State* state,
                            int argc, Expr* argv[]) {
     safe_mode = get_safe_mode();
-    char dest_copy[PATH_MAX];
     if (argc != 1 && argc != 2) {
         return ErrorAbort(state, "%s() expects 1 or 2 args, got %d",
                           name, argc);
@@ -577,28 +524,17 @@ Value* PackageExtractFileFn(const char* name, State* state,
 
         char* zip_path;
         char* dest_path;
-	if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+        if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
 
-	if (strlen(dest_path) == 0) 
-    	{
+        if (strlen(dest_path) == 0) {
+            free(zip_path);
+            free(dest_path);
             return ErrorAbort(state, "dest_path argument to %s() can't be empty", name);
-    	}
-    	else if ( !(safe_mode ) && !(strcmp(dest_path,"/system")) && allow_flash_non_safe())
-    	{
-     	    strcpy(dest_copy, dest_path);
-	    if(strlen(dest_copy))
-	    {
-	    	if(!strncmp(dest_copy,"/system",(sizeof(char)*7)))
-	        {
-		    int tlength=strlen(dest_path)+1;
-		    memmove(&dest_copy[11], &dest_copy[7],((tlength*sizeof(char))-7));
-		    dest_copy[7] = 'o';
-		    dest_copy[8] = 'r';
-		    dest_copy[9] = 'i';
-		    dest_copy[10] = 'g';
-		    dest_copy[(strlen(dest_copy))] = '\0';
-	        }
-	    }
+        }
+
+        const char* dest = dest_path;
+        if (!safe_mode && strcmp(dest_path, "/system") == 0 && allow_flash_non_safe()) {
+            dest = systemorig_path(state, dest_path);
         }
 
         ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
@@ -607,25 +543,13 @@ Value* PackageExtractFileFn(const char* name, State* state,
             fprintf(stderr, "%s: no %s in package\n", name, zip_path);
             goto done2;
         }
-	FILE* f = NULL;
-        if((safe_mode))
-	{
-	    f = fopen(dest_path, "wb");
-	    if (f == NULL) {
-		fprintf(stderr, "%s: can't open %s for write: %s\n",
-			name, dest_path, strerror(errno));
-		goto done2;
-	    }
+
+        FILE* f = fopen(dest, "wb");
+        if (f == NULL) {
+            fprintf(stderr, "%s: can't open %s for write: %s\n",
+                    name, dest, strerror(errno));
+            goto done2;
         }
-	else
-	{
-    	    f = fopen(dest_copy, "wb");
-	    if (f == NULL) {
-		fprintf(stderr, "%s: can't open %s for write: %s\n",
-			name, dest_copy, strerror(errno));
-		goto done2;
-	    }
-	}
         success = mzExtractZipEntryToFile(za, entry, fileno(f));
         fclose(f);
 
@@ -638,13 +562,13 @@ Value* PackageExtractFileFn(const char* name, State* state,
         // as the result.
 
         char* zip_path;
+        if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
+
         Value* v = malloc(sizeof(Value));
         v->type = VAL_BLOB;
         v->size = -1;
         v->data = NULL;
 
-        if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
-
         ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
         if (entry == NULL) {
@@ -652,6 +576,11 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done1;
         }
 
+        if (mzGetZipEntryUncompLen(entry) > SSIZE_MAX) {
+            fprintf(stderr, "%s: %s is too large to load into memory\n",
+                    name, zip_path);
+            goto done1;
+        }
         v->size = mzGetZipEntryUncompLen(entry);
         v->data = malloc(v->size);
         if (v->data == NULL) {
@@ -683,105 +612,48 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
     safe_mode = get_safe_mode();
     fprintf(stderr,"SymlinkFn: safe_mode is \"%d\"\n",safe_mode);
     char* target;
-    char target_copy[PATH_MAX];
     target = Evaluate(state, argv[0]);
     if (target == NULL) return NULL;
-    
+
     char** srcs = ReadVarArgs(state, argc-1, argv+1);
     if (srcs == NULL) {
         free(target);
         return NULL;
     }
-    
-    int srcs_count;
-    char srcs_copy[argc][PATH_MAX];
 
-    switch (safe_mode)
-    {
-	case 0:
-	{
-	    /*strcpy(target_copy, target);
-	    if(strlen(target_copy))
-	    {
-                if(!strncmp(target_copy,"/system",(sizeof(char)*7)))
-		{
-		    int tlength=strlen(target)+1;
-		    memmove(&target_copy[2], &target_copy[7],((tlength*sizeof(char))-7));
-		    target_copy[0] = '.';
-		    target_copy[1] = '.';
-		    //target_copy[9] = 'i';
-		    //target_copy[10] = 'g';
-		    //target_copy[(strlen(target_copy))] = '\0';
-		}
-	    }*/
-	    
-	    for (srcs_count = 0; srcs_count < argc-1; ++srcs_count)
-	    {
-		strncpy(srcs_copy[srcs_count],srcs[srcs_count],strlen(srcs[srcs_count]));
-		if(strlen(srcs_copy[srcs_count]))
-		{
-		    if(!strncmp(srcs_copy[srcs_count],"/system",(sizeof(char)*7)))
-		    {
-			int length=strlen(srcs[srcs_count])+1;
-			memmove(&srcs_copy[srcs_count][11], &srcs_copy[srcs_count][7],((length*sizeof(char))-7));
-			srcs_copy[srcs_count][7] = 'o';
-			srcs_copy[srcs_count][8] = 'r';
-			srcs_copy[srcs_count][9] = 'i';
-			srcs_copy[srcs_count][10] = 'g';
-			srcs_copy[srcs_count][(strlen(srcs_copy[srcs_count]))] = '\0';
-		    }
-		}
-	    }
-	    int i;
-	    for (i = 0; i < argc-1; ++i)
-	    {
-		if (unlink(srcs_copy[i]) < 0) 
-		{
-		    if (errno != ENOENT)
-		    {
-			fprintf(stderr, "%s: failed to remove %s: %s\n", name, srcs_copy[i], strerror(errno));
-		    }
-		}
-		if (symlink(target, srcs_copy[i]) < 0)
-		{
-		    fprintf(stderr, "%s: failed to symlink %s to %s: %s\n", name, srcs_copy[i], target, strerror(errno));
-		}
-	        free(srcs[i]);
-	    }
-	break;
+    int i;
+    for (i = 0; i < argc-1; ++i) {
+        const char* src = safe_mode ? srcs[i] : systemorig_path(state, srcs[i]);
+        if (unlink(src) < 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "%s: failed to remove %s: %s\n",
+                        name, src, strerror(errno));
+            }
         }
-
-	case 1:
-	{
-	    int i;
-	    for (i = 0; i < argc-1; ++i)
-	    {
-		if (unlink(srcs[i]) < 0)
-		{
-		    if (errno != ENOENT)
-		    {
-			fprintf(stderr, "%s: failed to remove %s: %s\n", name, srcs[i], strerror(errno));
-		    }
-		}
-		if (symlink(target, srcs[i]) < 0)
-		{
-		    fprintf(stderr, "%s: failed to symlink %s to %s: %s\n", name, srcs[i], target, strerror(errno));
-		}
-	        free(srcs[i]);
-	    }
-    	break;
-	}
+        if (symlink(target, src) < 0) {
+            fprintf(stderr, "%s: failed to symlink %s to %s: %s\n",
+                    name, src, target, strerror(errno));
+        }
+        free(srcs[i]);
     }
-
     free(srcs);
+    free(target);
     return StringValue(strdup(""));
 }
 
+// set_perm and set_perm_recursive only queue their changes; see
+// perms.h.  The safe mode check mounts and unmounts /systemorig, so
+// it's done once per batch rather than once per call.
+static int perms_safe_mode;
+
 Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
-    safe_mode = get_safe_mode();
+    if (PendingPermissions() == 0) {
+        perms_safe_mode = get_safe_mode();
+    }
+    safe_mode = perms_safe_mode;
     bool recursive = (strcmp(name, "set_perm_recursive") == 0);
-    
+
     int min_args = 4 + (recursive ? 1 : 0);
     if (argc < min_args) {
         return ErrorAbort(state, "%s() expects %d+ args, got %d", name, argc);
@@ -791,9 +663,8 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (args == NULL) return NULL;
 
     char* end;
-    char args_copy[argc][64];
     int i;
-    
+
     int uid = strtoul(args[0], &end, 0);
     if (*end != '\0' || args[0][0] == 0) {
         ErrorAbort(state, "%s: \"%s\" not a valid uid", name, args[0]);
@@ -806,8 +677,7 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
-    if (recursive)
-    {
+    if (recursive) {
         int dir_mode = strtoul(args[2], &end, 0);
         if (*end != '\0' || args[2][0] == 0) {
             ErrorAbort(state, "%s: \"%s\" not a valid dirmode", name, args[2]);
@@ -821,102 +691,21 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
             goto done;
         }
 
-        
-	switch (safe_mode)
-	{
-	    case 0:
-	    {
-		for (i = 4; i < argc; ++i)
-		{
-		    strcpy(args_copy[i], args[i]);
-		    if(strlen(args_copy[i]))
-		    {
-			if(!strncmp(args_copy[i],"/system",(7*sizeof(char))))
-			{
-			    int alength=strlen(args[i])+1;
-			    memmove(&args_copy[i][11], &args_copy[i][7],((alength*sizeof(char))-7));
-			    args_copy[i][7] = 'o';
-			    args_copy[i][8] = 'r';
-			    args_copy[i][9] = 'i';
-			    args_copy[i][10] = 'g';
-			    args_copy[i][(strlen(args_copy[i]))] = '\0';
-			}
-		    }
-		    dirSetHierarchyPermissions(args_copy[i], uid, gid, dir_mode, file_mode);
-		}
-	    break;
-	    }
-	
-	    case 1:
-	    {
-		for (i = 4; i < argc; ++i)
-		{
-		    dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode);
-		}
-
-	    break;
-	    }
-
-	}
-	
-    } 
-    else
-    {
+        for (i = 4; i < argc; ++i) {
+            const char* path = safe_mode ? args[i] : systemorig_path(state, args[i]);
+            QueueRecursivePermissions(path, uid, gid, dir_mode, file_mode);
+        }
+    } else {
         int mode = strtoul(args[2], &end, 0);
-        if (*end != '\0' || args[2][0] == 0) 
-	{
+        if (*end != '\0' || args[2][0] == 0) {
             ErrorAbort(state, "%s: \"%s\" not a valid mode", name, args[2]);
             goto done;
         }
-	
-	switch (safe_mode)
-	{
-	    case 0:
-	    {
-		for (i = 3; i < argc; ++i) 
-		{
-		    char args_copy[argc][64];
-		    strcpy(args_copy[i], args[i]);
-		    if(!strncmp(args_copy[i],"/system",(sizeof(char)*7)))
-		    {
-			int alength=strlen(args[i])+1;
-			memmove(&args_copy[i][11], &args_copy[i][7],((alength*sizeof(char))-7));
-			args_copy[i][7] = 'o';
-			args_copy[i][8] = 'r';
-			args_copy[i][9] = 'i';
-			args_copy[i][10] = 'g';
-			args_copy[i][(strlen(args_copy[i]))] = '\0';
-		    }
-		    if (chown(args_copy[i], uid, gid) < 0) 
-		    {
-			fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n", name, args_copy[i], uid, gid, strerror(errno));
-		    }
-
-		    if (chmod(args_copy[i], mode) < 0) 
-		    {
-			fprintf(stderr, "%s: chmod of %s to %o failed: %s\n", name, args_copy[i], mode, strerror(errno));
-		    }
-		}
-	    break;
-	    }
-	    case 1:
-	    {
-		for (i = 3; i < argc; ++i) 
-		{
-		    if (chown(args[i], uid, gid) < 0) 
-		    {
-			fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n",
-				name, args[i], uid, gid, strerror(errno));
-		    }
-		    if (chmod(args[i], mode) < 0) 
-		    {
-			fprintf(stderr, "%s: chmod of %s to %o failed: %s\n",
-				name, args[i], mode, strerror(errno));
-		    }
-		}
-	    break;
-	    }
-	}
+
+        for (i = 3; i < argc; ++i) {
+            const char* path = safe_mode ? args[i] : systemorig_path(state, args[i]);
+            QueuePermissions(path, uid, gid, mode);
+        }
     }
     result = strdup("");
 
@@ -1242,6 +1031,112 @@ Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(buffer);
 }
 
+// Copy complete lines of a program's output to the log, and to the
+// screen via the ui_print command.
+typedef struct {
+    FILE* cmd_pipe;
+    char line[1024];
+    size_t len;
+} OutputLines;
+
+static void emit_output_line(OutputLines* out) {
+    out->line[out->len] = '\0';
+    fprintf(stderr, "%s\n", out->line);
+    fprintf(out->cmd_pipe, "ui_print %s\n", out->line);
+    out->len = 0;
+}
+
+// Read what's available on 'fd'.  Returns false at end of file.
+static bool read_output(OutputLines* out, int fd) {
+    char buffer[512];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) return true;
+    if (n <= 0) {
+        if (out->len > 0) emit_output_line(out);
+        return false;
+    }
+    ssize_t i;
+    for (i = 0; i < n; ++i) {
+        if (buffer[i] == '\n') {
+            emit_output_line(out);
+        } else {
+            out->line[out->len++] = buffer[i];
+            if (out->len == sizeof(out->line) - 1) emit_output_line(out);
+        }
+    }
+    return true;
+}
+
+// Wait for 'child' to exit and return its status.  If 'fd' isn't -1
+// the child's output is read from it and passed to the screen as it
+// arrives.  A child still running after 'timeout' seconds (if
+// nonzero) is killed.
+static int wait_for_program(pid_t child, int fd, FILE* cmd_pipe,
+                            int timeout, const char* program) {
+    OutputLines out;
+    out.cmd_pipe = cmd_pipe;
+    out.len = 0;
+
+    time_t deadline = timeout > 0 ? time(NULL) + timeout : 0;
+    bool killed = false;
+    int status = -1;
+
+    while (true) {
+        if (fd < 0 && (deadline == 0 || killed)) {
+            // Nothing left to watch for; just wait.
+            if (waitpid(child, &status, 0) == child || errno != EINTR) break;
+            continue;
+        }
+
+        // Otherwise check back at least every 100ms, so the deadline
+        // is noticed, and so is the child exiting while something it
+        // started holds the output pipe open.
+        if (fd >= 0) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 100) > 0 && !read_output(&out, fd)) {
+                close(fd);
+                fd = -1;
+            }
+        } else {
+            usleep(100 * 1000);
+        }
+
+        pid_t r = waitpid(child, &status, WNOHANG);
+        if (r == child || (r < 0 && errno != EINTR)) break;
+
+        if (deadline != 0 && !killed && time(NULL) >= deadline) {
+            fprintf(stderr, "run_program: %s still running after %d seconds; "
+                    "killing it\n", program, timeout);
+            kill(child, SIGKILL);
+            killed = true;
+        }
+    }
+
+    if (fd >= 0) {
+        // Pick up whatever the child wrote just before exiting.
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        while (poll(&pfd, 1, 0) > 0 && read_output(&out, fd));
+        if (out.len > 0) emit_output_line(&out);
+        close(fd);
+    }
+    return status;
+}
+
+// run_program([option, ...] program, arg, ...)
+//
+//   Options, which must come before the program:
+//     "--ui-print"      show the program's stdout and stderr on the
+//                       screen as it runs (it always goes to the log)
+//     "--timeout=SECS"  kill the program if it runs longer than SECS,
+//                       a positive whole number of seconds
+//
+//   Returns the program's wait status as a string.
 Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc < 1) {
         return ErrorAbort(state, "%s() expects at least 1 arg", name);
@@ -1251,84 +1146,108 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
         return NULL;
     }
     safe_mode = get_safe_mode();
-    char** args2 = malloc(sizeof(char*) * (argc+1));
-    memcpy(args2, args, sizeof(char*) * argc);
-    args2[argc] = NULL;
-    char args2_copy[argc][PATH_MAX];
-    int arg_total = argc;
-    int arg_count;
-
-    for(arg_count = 0; arg_count < arg_total; arg_count++)
-    {
-	
-        
-	if ( !(safe_mode ) && !(strncmp(args2[arg_count],"/system",(7*sizeof(char)))) && strncmp(args2[arg_count],"/systemorig",(11*sizeof(char))) && allow_flash_non_safe())
-	{
-	    strncpy(args2_copy[arg_count],args2[arg_count],strlen(args2[arg_count]));
-	    if(arg_count == 0)
-	    {
-		if(strlen(args2[arg_count]) == 0) 
-		{
-		    return ErrorAbort(state, "RunProgramFn: argument args2[%d] to %s() can't be empty", arg_count, name);
-		}
-	    }
-
-	    int a2length=strlen(args2[arg_count])+1;
-	    memmove(&args2_copy[arg_count][11], &args2_copy[arg_count][7],((a2length*sizeof(char))-7));
-	    args2_copy[arg_count][7] = 'o';
-	    args2_copy[arg_count][8] = 'r';
-	    args2_copy[arg_count][9] = 'i';
-	    args2_copy[arg_count][10] = 'g';
-	    args2_copy[arg_count][(strlen(args2_copy[arg_count]))] = '\0';
-	}
+    bool use_orig = !safe_mode && allow_flash_non_safe();
+
+    Value* result = NULL;
+    bool capture = false;
+    int timeout = 0;
+    int first;
+    int i;
+    for (first = 0; first < argc && strncmp(args[first], "--", 2) == 0; ++first) {
+        if (strcmp(args[first], "--ui-print") == 0) {
+            capture = true;
+        } else if (strncmp(args[first], "--timeout=", 10) == 0) {
+            const char* secs = args[first] + 10;
+            char* end;
+            errno = 0;
+            long value = strtol(secs, &end, 10);
+            if (*secs == '\0' || *end != '\0' || errno != 0 ||
+                value <= 0 || value > INT_MAX) {
+                ErrorAbort(state, "%s: \"%s\" is not a valid timeout "
+                           "(a positive number of seconds)", name, secs);
+                goto done;
+            }
+            timeout = value;
+        } else {
+            ErrorAbort(state, "%s: unknown option \"%s\"", name, args[first]);
+            goto done;
+        }
     }
-    
-    pid_t child = fork();
-    
-    if( !(safe_mode) && allow_flash_non_safe() )
-    {
-	fprintf(stderr, "about to run program [%s], argc = %d (includes [%s])\n", args2_copy[0], argc, args2_copy[0]);
-	if (child == 0)
-	{
-	    execv(args2_copy[0], args2_copy);
-	    fprintf(stderr, "run_program: execv failed: %s\n", strerror(errno));
-	    _exit(1);
-	}
+    if (first == argc || args[first][0] == '\0') {
+        ErrorAbort(state, "%s() expects a program to run", name);
+        goto done;
     }
-    else
-    {
-	fprintf(stderr, "about to run program [%s], argc = %d (includes [%s])\n", args2[0], argc, args2[0]);
-	if (child == 0)
-	{
-	    execv(args2[0], args2);
-	    fprintf(stderr, "run_program: execv failed: %s\n", strerror(errno));
-	    _exit(1);
-	}
-    }
-	
-    int status;
-    waitpid(child, &status, 0);
-    if (WIFEXITED(status)) {
-	if (WEXITSTATUS(status) != 0) {
-	    fprintf(stderr, "run_program: child exited with status %d\n",
-		    WEXITSTATUS(status));
-	}
-    } else if (WIFSIGNALED(status)) {
-	fprintf(stderr, "run_program: child terminated by signal %d\n",
-		WTERMSIG(status));
+
+    int exec_argc = argc - first;
+    char** exec_args = ArenaAlloc(state, (exec_argc+1) * sizeof(char*));
+    for (i = 0; i < exec_argc; ++i) {
+        char* arg = args[first+i];
+        if (use_orig && strncmp(arg, "/system", 7) == 0 &&
+            strncmp(arg, "/systemorig", 11) != 0) {
+            arg = systemorig_path(state, arg);
+        }
+        exec_args[i] = arg;
+    }
+    exec_args[exec_argc] = NULL;
+
+    fprintf(stderr, "about to run program [%s], argc = %d\n",
+            exec_args[0], exec_argc);
+
+    int pipefd[2];
+    if (capture && pipe(pipefd) < 0) {
+        fprintf(stderr, "run_program: can't capture output: %s\n",
+                strerror(errno));
+        capture = false;
+    }
+
+    // vfork rather than fork: the updater has the whole package
+    // mapped, and there's no point copying its page tables just to
+    // exec.  The child may only dup2, exec and _exit.
+    pid_t child = vfork();
+    if (child == 0) {
+        if (capture) {
+            close(pipefd[0]);
+            dup2(pipefd[1], STDOUT_FILENO);
+            dup2(pipefd[1], STDERR_FILENO);
+            if (pipefd[1] > STDERR_FILENO) close(pipefd[1]);
+        }
+        execv(exec_args[0], exec_args);
+        _exit(127);
+    }
+    if (capture) close(pipefd[1]);
+    if (child < 0) {
+        if (capture) close(pipefd[0]);
+        ErrorAbort(state, "%s: failed to start %s: %s",
+                   name, exec_args[0], strerror(errno));
+        goto done;
     }
 
-    int i;
-    for (i = 0; i < argc; ++i) {
-	free(args[i]);
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    int status = wait_for_program(child, capture ? pipefd[0] : -1,
+                                  ui->cmd_pipe, timeout, exec_args[0]);
+    if (WIFEXITED(status)) {
+        if (WEXITSTATUS(status) == 127) {
+            fprintf(stderr, "run_program: couldn't run %s (exit status 127)\n",
+                    exec_args[0]);
+        } else if (WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "run_program: child exited with status %d\n",
+                    WEXITSTATUS(status));
+        }
+    } else if (WIFSIGNALED(status)) {
+        fprintf(stderr, "run_program: child terminated by signal %d\n",
+                WTERMSIG(status));
     }
-    free(args);
-    free(args2);
 
     char buffer[20];
     sprintf(buffer, "%d", status);
+    result = StringValue(strdup(buffer));
 
-    return StringValue(strdup(buffer));
+  done:
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    return result;
 }
 
 // Take a sha-1 digest and return it as a newly-allocated hex string.
@@ -1402,6 +1321,100 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
     return args[i];
 }
 
+// sha1_check_file(filename)
+//    returns the sha1 of the file, hashing it as it is read rather
+//    than loading it into memory first.  filename may also be a
+//    partition spec, "MTD:<partition>:<size_1>:<sha1_1>:..." or
+//    "EMMC:<device>:<size_1>:<sha1_1>:...", as accepted by read_file;
+//    it needs at least one size:sha1 pair, since a partition's length
+//    can't be known otherwise.  A bare "MTD:<partition>" fails.
+//
+// sha1_check_file(filename, sha1_hex, [sha1_hex, ...])
+//    returns the sha1 of the file if it matches any of the hex
+//    strings passed, or "" if it does not equal any of them.  Each
+//    candidate may be written "<size>:<sha1_hex>"; if the file's size
+//    doesn't match any sized candidate (and there are no unsized
+//    ones) it isn't read at all.
+Value* Sha1CheckFileFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc < 1) {
+        return ErrorAbort(state, "%s() expects at least 1 arg", name);
+    }
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) {
+        return NULL;
+    }
+
+    char* result = NULL;
+    const char* filename = args[0];
+    bool partition = strncmp(filename, "MTD:", 4) == 0 ||
+                     strncmp(filename, "EMMC:", 5) == 0;
+    int i;
+
+    // Parse the candidates, and see whether the file's size already
+    // rules all of them out.
+    int candidates = argc - 1;
+    uint8_t* digests = ArenaAlloc(state, candidates * SHA_DIGEST_SIZE);
+    long long* sizes = ArenaAlloc(state, candidates * sizeof(long long));
+    bool any_possible = (candidates == 0);
+    struct stat st;
+    bool have_size = !partition && stat(filename, &st) == 0;
+    for (i = 0; i < candidates; ++i) {
+        const char* sha1 = args[i+1];
+        sizes[i] = -1;
+        char* colon = strchr(sha1, ':');
+        if (colon != NULL) {
+            sizes[i] = strtoll(sha1, NULL, 10);
+            sha1 = colon + 1;
+        }
+        if (ParseSha1(sha1, digests + i*SHA_DIGEST_SIZE) != 0) {
+            // Warn about bad args and skip them.
+            fprintf(stderr, "%s(): error parsing \"%s\" as sha-1; skipping\n",
+                    name, args[i+1]);
+            sizes[i] = -2;
+            continue;
+        }
+        if (sizes[i] < 0 || !have_size || sizes[i] == (long long)st.st_size) {
+            any_possible = true;
+        }
+    }
+    if (!any_possible) {
+        fprintf(stderr, "%s(): size of %s matches no candidate\n",
+                name, filename);
+        result = strdup("");
+        goto done;
+    }
+
+    FileContents fc;
+    if (HashFileContents(filename, &fc) != 0) {
+        fprintf(stderr, "%s(): failed to hash \"%s\"\n", name, filename);
+        result = strdup("");
+        goto done;
+    }
+
+    if (candidates == 0) {
+        result = PrintSha1(fc.sha1);
+        goto done;
+    }
+    for (i = 0; i < candidates; ++i) {
+        if (sizes[i] == -2) continue;
+        if (sizes[i] >= 0 && !partition && sizes[i] != (long long)fc.size) {
+            continue;
+        }
+        if (memcmp(fc.sha1, digests + i*SHA_DIGEST_SIZE, SHA_DIGEST_SIZE) == 0) {
+            result = PrintSha1(fc.sha1);
+            goto done;
+        }
+    }
+    result = strdup("");
+
+  done:
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    return StringValue(result);
+}
+
 // Read a local file and return its contents (the char* returned
 // is actually a FileContents*).
 Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -1431,6 +1444,14 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
     return v;
 }
 
+// Functions the script can call without flushing queued permission
+// changes first: set_perm itself, and ones that only talk to recovery.
+// Every other call (builtins and device extensions included) flushes.
+int KeepsPermissionsQueued(Function fn) {
+    return fn == SetPermFn || fn == UIPrintFn ||
+           fn == ShowProgressFn || fn == SetProgressFn;
+}
+
 void RegisterInstallFunctions() {
     RegisterFunction("mount", MountFn);
     RegisterFunction("is_mounted", IsMountedFn);
@@ -1456,6 +1477,7 @@ void RegisterInstallFunctions() {
 
     RegisterFunction("read_file", ReadFileFn);
     RegisterFunction("sha1_check", Sha1CheckFn);
+    RegisterFunction("sha1_check_file", Sha1CheckFileFn);
 
     RegisterFunction("ui_print", UIPrintFn);
 
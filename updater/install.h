@@ -17,10 +17,15 @@
 #ifndef _UPDATER_INSTALL_H_
 #define _UPDATER_INSTALL_H_
 
+#include "edify/expr.h"
+
 void
 RegisterInstallFunctions();
 
 int
 allow_flash_non_safe();
 
+int
+KeepsPermissionsQueued(Function fn);
+
 #endif
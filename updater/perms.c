@@ -0,0 +1,437 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "perms.h"
+#include "trace.h"
+
+typedef struct {
+    char* path;
+    int seq;            // order in which the script asked for it
+    int recursive;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;        // set_perm mode, or set_perm_recursive dir mode
+    mode_t file_mode;
+    int handled;
+} PermRequest;
+
+static PermRequest* requests = NULL;
+static int request_count = 0;
+static int request_alloc = 0;
+static int next_seq = 0;
+
+// A directory the walk has yet to scan.  It is opened relative to its
+// parent, which stays open until the last of its subdirectories has
+// been.
+typedef struct WalkItem {
+    struct WalkItem* parent;
+    struct WalkItem* next;      // on the work stack
+    char* path;                 // spelled the way the requests are
+    size_t name;                // offset of the last component in path
+    const PermRequest* active;  // latest recursive request above it
+    DIR* dir;                   // open once scanned
+    int pending;                // 1 for its own scan + unopened children
+} WalkItem;
+
+// Shared by the threads walking one tree.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    WalkItem* stack;
+    int live;                   // items not yet finished
+    int failures;
+} PermWalk;
+
+#define WALK_MAX_THREADS 4
+
+// Requests are matched to files by path, so store them the way the
+// walk spells them: no repeated slashes.  A trailing slash is kept,
+// since it makes lstat() follow a symlink to a directory.
+static char* normalize_path(const char* path) {
+    char* result = malloc(strlen(path) + 1);
+    char* p = result;
+    for (; *path; ++path) {
+        if (*path == '/' && p > result && p[-1] == '/') continue;
+        *p++ = *path;
+    }
+    *p = '\0';
+    return result;
+}
+
+// Spell a request's path the way the walk will reach the file it
+// names: absolute, with no symlinks, "." or ".." in it.  Otherwise a
+// path that goes through a symlinked directory or ".." is never
+// matched by the walk covering the same file, and ends up applied out
+// of order.  Both set_perm and set_perm_recursive follow a symlink at
+// the end of the path, so that is resolved too.  Paths that don't
+// exist are left alone; applying them fails either way.
+static void canonicalize(PermRequest* r) {
+    char resolved[PATH_MAX];
+    if (realpath(r->path, resolved) == NULL) return;
+    char* path = strdup(resolved);
+    if (path == NULL) return;
+    free(r->path);
+    r->path = path;
+}
+
+static void queue_request(const char* path, int recursive, int uid, int gid,
+                          int mode, int file_mode) {
+    if (request_count >= request_alloc) {
+        request_alloc = request_alloc*2 + 64;
+        requests = realloc(requests, request_alloc * sizeof(PermRequest));
+    }
+    PermRequest* r = &requests[request_count++];
+    r->path = normalize_path(path);
+    r->seq = next_seq++;
+    r->recursive = recursive;
+    r->uid = uid;
+    r->gid = gid;
+    r->mode = mode;
+    r->file_mode = file_mode;
+    r->handled = 0;
+}
+
+void QueuePermissions(const char* path, int uid, int gid, int mode) {
+    queue_request(path, 0, uid, gid, mode, 0);
+}
+
+void QueueRecursivePermissions(const char* path, int uid, int gid,
+                               int dir_mode, int file_mode) {
+    queue_request(path, 1, uid, gid, dir_mode, file_mode);
+}
+
+int PendingPermissions() {
+    return request_count;
+}
+
+static int compare_requests(const void* a, const void* b) {
+    const PermRequest* ra = (const PermRequest*)a;
+    const PermRequest* rb = (const PermRequest*)b;
+    int c = strcmp(ra->path, rb->path);
+    if (c != 0) return c;
+    return ra->seq - rb->seq;
+}
+
+// Index of the first (sorted) request for exactly 'path', or -1.
+static int find_requests(const char* path) {
+    int lo = 0;
+    int hi = request_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(requests[mid].path, path) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < request_count && strcmp(requests[lo].path, path) == 0) {
+        return lo;
+    }
+    return -1;
+}
+
+// Decide which request wins for the file at 'path'.  *active is the
+// latest recursive request covering its parent; it is updated with any
+// recursive request for 'path' itself, for use by the children.
+// Recursive requests never touch symlinks, so for those only a
+// set_perm naming the link can apply.
+static const PermRequest* resolve(const char* path,
+                                  const PermRequest** active, int is_link) {
+    const PermRequest* single = NULL;
+    int i = find_requests(path);
+    if (i >= 0) {
+        for (; i < request_count && strcmp(requests[i].path, path) == 0; ++i) {
+            PermRequest* r = &requests[i];
+            r->handled = 1;
+            if (r->recursive) {
+                if (*active == NULL || r->seq > (*active)->seq) *active = r;
+            } else {
+                if (single == NULL || r->seq > single->seq) single = r;
+            }
+        }
+    }
+    const PermRequest* result = is_link ? NULL : *active;
+    if (single != NULL && (result == NULL || single->seq > result->seq)) {
+        result = single;
+    }
+    return result;
+}
+
+// Set the owner and mode r asks for on 'name' in dirfd (which is
+// 'path').  Returns the number of changes that failed.
+static int apply(int dirfd, const char* name, const char* path,
+                 const PermRequest* r, int is_dir) {
+    mode_t mode = (r->recursive && !is_dir) ? r->file_mode : r->mode;
+    int failures = 0;
+    // chown first: it clears setuid/setgid bits that the mode may set.
+    // A failed chown doesn't stop the chmod, as with set_perm before.
+    if (fchownat(dirfd, name, r->uid, r->gid, 0) < 0) {
+        fprintf(stderr, "set_perm: chown of %s to %d %d failed: %s\n",
+                path, (int)r->uid, (int)r->gid, strerror(errno));
+        ++failures;
+    }
+    if (fchmodat(dirfd, name, mode, 0) < 0) {
+        fprintf(stderr, "set_perm: chmod of %s to %o failed: %s\n",
+                path, (int)mode, strerror(errno));
+        ++failures;
+    }
+    return failures;
+}
+
+// Drop one reference on 'item', closing it and walking up to its
+// parent when that was the last.  Called with the lock held.
+static void release_item(PermWalk* w, WalkItem* item) {
+    while (item != NULL && --item->pending == 0) {
+        WalkItem* parent = item->parent;
+        if (item->dir != NULL) closedir(item->dir);
+        free(item->path);
+        free(item);
+        if (--w->live == 0) pthread_cond_broadcast(&w->cond);
+        item = parent;
+    }
+}
+
+// Open the directory 'item' names, apply whatever applies to each of
+// its entries and queue its subdirectories.  Only the top of the tree
+// is opened by path; the rest are opened relative to their parents.
+// Each path is reached by exactly one thread, so the requests resolve()
+// marks as handled are never shared between them.
+static void scan_item(PermWalk* w, WalkItem* item) {
+    int failures = 0;
+    int fd;
+    if (item->parent == NULL) {
+        fd = open(item->path, O_RDONLY | O_DIRECTORY);
+    } else {
+        fd = openat(dirfd(item->parent->dir), item->path + item->name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        fprintf(stderr, "set_perm: can't read %s: %s\n",
+                item->path, strerror(errno));
+        if (fd >= 0) close(fd);
+        pthread_mutex_lock(&w->lock);
+        ++w->failures;
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+    // Children only see this once they're pushed, under the lock.
+    item->dir = dir;
+
+    // Children of "/" or "dir/" are "/x" and "dir/x".
+    size_t len = strlen(item->path);
+    if (len > 0 && item->path[len-1] == '/') --len;
+
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        size_t name_len = strlen(de->d_name);
+        if (len + 1 + name_len >= PATH_MAX) {
+            ++failures;
+            continue;
+        }
+
+        int type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                ++failures;
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR :
+                   S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+
+        char* path = malloc(len + 1 + name_len + 1);
+        if (path == NULL) {
+            ++failures;
+            continue;
+        }
+        memcpy(path, item->path, len);
+        path[len] = '/';
+        memcpy(path + len + 1, de->d_name, name_len + 1);
+
+        const PermRequest* child_active = item->active;
+        const PermRequest* r = resolve(path, &child_active, type == DT_LNK);
+        if (r != NULL) {
+            failures += apply(fd, de->d_name, path, r, type == DT_DIR);
+        }
+
+        if (type != DT_DIR) {
+            free(path);
+            continue;
+        }
+        WalkItem* child = calloc(1, sizeof(*child));
+        if (child == NULL) {
+            free(path);
+            ++failures;
+            continue;
+        }
+        child->parent = item;
+        child->path = path;
+        child->name = len + 1;
+        child->active = child_active;
+        child->pending = 1;
+
+        pthread_mutex_lock(&w->lock);
+        item->pending++;
+        w->live++;
+        child->next = w->stack;
+        w->stack = child;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->failures += failures;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void* walk_worker(void* cookie) {
+    PermWalk* w = (PermWalk*)cookie;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->stack == NULL && w->live > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->stack == NULL) break;
+        WalkItem* item = w->stack;
+        w->stack = item->next;
+        pthread_mutex_unlock(&w->lock);
+
+        scan_item(w, item);
+
+        pthread_mutex_lock(&w->lock);
+        // Its parent was only needed to open it.
+        release_item(w, item->parent);
+        item->parent = NULL;
+        release_item(w, item);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Walk the directory tree rooted at 'item' on up to one thread per CPU
+// (this one included); directories are scanned in parallel.
+static void walk_tree(PermWalk* w, WalkItem* item) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus < 1 ? 1 : cpus > WALK_MAX_THREADS ?
+            WALK_MAX_THREADS : (int)cpus;
+    pthread_t threads[WALK_MAX_THREADS];
+    int started = 0;
+    int i;
+
+    item->pending = 1;
+    w->stack = item;
+    w->live = 1;
+    for (i = 1; i < nthreads; ++i) {
+        if (pthread_create(&threads[started], NULL, walk_worker, w) != 0) {
+            break;
+        }
+        ++started;
+    }
+    walk_worker(w);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Apply everything queued for the tree rooted at root->path.
+static void walk_root(PermWalk* w, const PermRequest* root) {
+    const PermRequest* active = NULL;
+    if (strlen(root->path) >= PATH_MAX) {
+        resolve(root->path, &active, 0);
+        ++w->failures;
+        return;
+    }
+
+    struct stat st;
+    if (lstat(root->path, &st) < 0) {
+        resolve(root->path, &active, 0);
+        ++w->failures;
+        return;
+    }
+
+    const PermRequest* r = resolve(root->path, &active, S_ISLNK(st.st_mode));
+    if (r != NULL) {
+        w->failures += apply(AT_FDCWD, root->path, root->path, r,
+                             S_ISDIR(st.st_mode));
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        WalkItem* item = calloc(1, sizeof(*item));
+        if (item == NULL || (item->path = strdup(root->path)) == NULL) {
+            free(item);
+            ++w->failures;
+            return;
+        }
+        item->active = active;
+        walk_tree(w, item);
+    }
+}
+
+int FlushPermissions() {
+    if (request_count == 0) return 0;
+    TraceBegin();
+
+    PermWalk w;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.stack = NULL;
+    w.live = 0;
+    w.failures = 0;
+    int i, j;
+
+    // The requests are matched up with the files now, not when the
+    // script queued them, but nothing that could have changed the
+    // tree has run since: see KeepsPermissionsQueued().
+    for (i = 0; i < request_count; ++i) {
+        canonicalize(&requests[i]);
+    }
+
+    // Sorted by path, every recursive request is reached before any
+    // request below it, so those are handled by the enclosing walk.
+    qsort(requests, request_count, sizeof(PermRequest), compare_requests);
+    for (i = 0; i < request_count; ++i) {
+        if (requests[i].recursive && !requests[i].handled) {
+            walk_root(&w, &requests[i]);
+        }
+    }
+
+    // Whatever is left is set_perm on paths outside every recursive
+    // tree (or that the walk couldn't reach), so no walk touched them;
+    // for each path the last one wins.
+    for (i = 0; i < request_count; i = j) {
+        for (j = i+1; j < request_count &&
+                 strcmp(requests[j].path, requests[i].path) == 0; ++j);
+        if (requests[i].handled) continue;
+        w.failures += apply(AT_FDCWD, requests[j-1].path, requests[j-1].path,
+                            &requests[j-1], 0);
+    }
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+
+    fprintf(stderr, "applied %d permission requests (%d failures)\n",
+            request_count, w.failures);
+    char detail[32];
+    snprintf(detail, sizeof(detail), "%d requests", request_count);
+    TraceEnd("perms", "FlushPermissions", detail);
+
+    for (i = 0; i < request_count; ++i) {
+        free(requests[i].path);
+    }
+    request_count = 0;
+    return w.failures;
+}
@@ -0,0 +1,35 @@
+#ifndef _UPDATER_PERMS_H_
+#define _UPDATER_PERMS_H_
+
+// Batched ownership/permission changes.  set_perm and
+// set_perm_recursive requests are queued rather than applied
+// immediately, and FlushPermissions() applies the whole batch with a
+// single walk of each affected tree.  The end result is the same as
+// applying the requests one by one, in order: every file ends up with
+// the owner and mode of the last request that covered it.  Requests
+// are matched to files by their canonical paths, so it doesn't matter
+// which symlinks or ".." a request goes through to reach a file.
+//
+// Anything that might look at or replace the files in question must
+// call FlushPermissions() first; the updater does that before every
+// registered function the script calls, other than the few that
+// KeepsPermissionsQueued() lists.
+
+// Queue a chown+chmod of a single path (following symlinks, as
+// chown(2) and chmod(2) do).
+void QueuePermissions(const char* path, int uid, int gid, int mode);
+
+// Queue a chown+chmod of everything under 'path'; directories get
+// dir_mode, everything else file_mode, and symlinks below 'path' are
+// skipped.  If 'path' itself is a symlink, its target is changed.
+void QueueRecursivePermissions(const char* path, int uid, int gid,
+                               int dir_mode, int file_mode);
+
+// Number of requests waiting to be applied.
+int PendingPermissions();
+
+// Apply and forget all queued requests.  Returns the number of failed
+// chowns, chmods and other lookups, counted separately.
+int FlushPermissions();
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Checks that FlushPermissions() applies queued set_perm and
+ * set_perm_recursive requests in script order, however their paths are
+ * spelled: through a symlinked directory, through "..", or naming a
+ * symlink to the tree.
+ *
+ * Builds a small tree in a scratch directory (default /data/local/tmp)
+ * and only changes modes, so it doesn't need to run as root.
+ *
+ *     updater_perms_test [scratch-dir]
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "perms.h"
+
+#define TOP_MAX (PATH_MAX / 2)
+
+static char real_dir[TOP_MAX + 8];  /* <scratch>/perms_test/real */
+static char file[PATH_MAX];         /* .../real/f */
+static char link_dir[TOP_MAX + 8];  /* .../link -> real */
+
+static int setup(const char* scratch)
+{
+    char top[TOP_MAX];
+
+    snprintf(top, sizeof(top), "%s/perms_test", scratch);
+    snprintf(real_dir, sizeof(real_dir), "%s/real", top);
+    snprintf(file, sizeof(file), "%s/f", real_dir);
+    snprintf(link_dir, sizeof(link_dir), "%s/link", top);
+    mkdir(top, 0755);
+    mkdir(real_dir, 0755);
+    FILE* f = fopen(file, "w");
+    if (f == NULL || fclose(f) != 0) {
+        fprintf(stderr, "can't create %s\n", file);
+        return -1;
+    }
+    unlink(link_dir);
+    if (symlink("real", link_dir) != 0) {
+        fprintf(stderr, "can't create %s\n", link_dir);
+        return -1;
+    }
+    return 0;
+}
+
+static void cleanup(const char* scratch)
+{
+    char top[TOP_MAX];
+
+    snprintf(top, sizeof(top), "%s/perms_test", scratch);
+    unlink(link_dir);
+    unlink(file);
+    rmdir(real_dir);
+    rmdir(top);
+}
+
+static int check(const char* what, const char* path, int expected)
+{
+    struct stat st;
+    int mode = stat(path, &st) == 0 ? (int)(st.st_mode & 07777) : -1;
+
+    printf("%s: %s (%o, expected %o)\n",
+           mode == expected ? "PASS" : "FAIL", what, mode, expected);
+    return mode == expected ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    const char* scratch = argc > 1 ? argv[1] : "/data/local/tmp";
+    int uid = getuid(), gid = getgid();
+    char path[PATH_MAX];
+    int failures = 0;
+
+    if (setup(scratch) != 0)
+        return 1;
+
+    /* The later recursive request must win over the earlier single one,
+     * which reaches the same file through the symlink.
+     */
+    snprintf(path, sizeof(path), "%s/f", link_dir);
+    QueuePermissions(path, uid, gid, 0600);
+    QueueRecursivePermissions(real_dir, uid, gid, 0755, 0644);
+    FlushPermissions();
+    failures += check("set_perm via symlink, then set_perm_recursive",
+                      file, 0644);
+
+    /* And the other way round. */
+    QueueRecursivePermissions(real_dir, uid, gid, 0755, 0644);
+    QueuePermissions(path, uid, gid, 0600);
+    FlushPermissions();
+    failures += check("set_perm_recursive, then set_perm via symlink",
+                      file, 0600);
+
+    /* The same through "..". */
+    snprintf(path, sizeof(path), "%s/../real/f", real_dir);
+    QueuePermissions(path, uid, gid, 0600);
+    QueueRecursivePermissions(real_dir, uid, gid, 0755, 0640);
+    FlushPermissions();
+    failures += check("set_perm via .., then set_perm_recursive",
+                      file, 0640);
+
+    /* A recursive request naming a symlink changes the tree it points
+     * to.
+     */
+    QueueRecursivePermissions(link_dir, uid, gid, 0750, 0604);
+    FlushPermissions();
+    failures += check("set_perm_recursive of a symlink (dir)",
+                      real_dir, 0750);
+    failures += check("set_perm_recursive of a symlink (file)",
+                      file, 0604);
+
+    cleanup(scratch);
+    return failures != 0;
+}
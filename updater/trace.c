@@ -0,0 +1,287 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "trace.h"
+
+// Events are written in the JSON array format, which chrome://tracing
+// reads even without the closing bracket, so a trace cut short by a
+// crash still loads.
+#define TRACE_BUF_SIZE (64 * 1024)
+#define TRACE_MAX_DEPTH 256
+#define TRACE_DETAIL_MAX 256
+
+typedef struct {
+    long long rchar, wchar, syscr, syscw, read_bytes, write_bytes;
+} IoCounters;
+
+typedef struct {
+    long long wall_us;
+    long long cpu_us;
+    IoCounters io;
+    IoCounters self;    // the tracer's own share of io
+} Sample;
+
+static int trace_fd = -1;
+static int io_fd = -1;
+static int trace_pid;
+
+// Our reads of /proc/self/io and writes of the trace, to take back
+// out of the counters.
+static IoCounters self_io;
+
+static char out_buf[TRACE_BUF_SIZE];
+static size_t out_len = 0;
+static int first_event = 1;
+
+// Open spans.  Ones nested deeper than TRACE_MAX_DEPTH are counted but
+// not recorded.
+static Sample stack[TRACE_MAX_DEPTH];
+static int depth = 0;
+
+// Offsets of the start of each line of the script, for reporting
+// where each call is.
+static int* line_starts = NULL;
+static int line_count = 0;
+
+static void FlushTrace() {
+    char* p = out_buf;
+    while (out_len > 0) {
+        ssize_t w = write(trace_fd, p, out_len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        self_io.syscw++;
+        self_io.wchar += w;
+        p += w;
+        out_len -= w;
+    }
+    out_len = 0;
+}
+
+static void Append(const char* s, size_t len) {
+    while (len > 0) {
+        if (out_len == sizeof(out_buf)) FlushTrace();
+        size_t n = sizeof(out_buf) - out_len;
+        if (n > len) n = len;
+        memcpy(out_buf + out_len, s, n);
+        out_len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+static void AppendString(const char* s) {
+    Append(s, strlen(s));
+}
+
+// Append 's' as a JSON string, quotes included.
+static void AppendJsonString(const char* s, size_t max) {
+    char esc[8];
+    size_t i;
+    Append("\"", 1);
+    for (i = 0; s[i] != '\0' && i < max; ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            Append(esc, 2);
+        } else if (c < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            Append(esc, 6);
+        } else {
+            Append((const char*)&c, 1);
+        }
+    }
+    if (s[i] != '\0') AppendString("...");
+    Append("\"", 1);
+}
+
+static long long IoField(const char* buf, const char* key) {
+    const char* p = strstr(buf, key);
+    return p == NULL ? 0 : strtoll(p + strlen(key), NULL, 10);
+}
+
+static void TakeSample(Sample* s) {
+    struct timespec ts;
+    struct rusage ru;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    s->wall_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    s->cpu_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    if (getrusage(RUSAGE_CHILDREN, &ru) == 0) {
+        s->cpu_us += (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+                     ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    }
+
+    // The counters we read don't include this read yet; the next
+    // sample's will.
+    s->self = self_io;
+    if (io_fd >= 0) {
+        char buf[512];
+        ssize_t n = pread(io_fd, buf, sizeof(buf) - 1, 0);
+        if (n > 0) {
+            self_io.syscr++;
+            self_io.rchar += n;
+            buf[n] = '\0';
+            s->io.rchar = IoField(buf, "rchar:");
+            s->io.wchar = IoField(buf, "wchar:");
+            s->io.syscr = IoField(buf, "syscr:");
+            s->io.syscw = IoField(buf, "syscw:");
+            s->io.read_bytes = IoField(buf, "\nread_bytes:");
+            s->io.write_bytes = IoField(buf, "\nwrite_bytes:");
+            return;
+        }
+    }
+    memset(&s->io, 0, sizeof(s->io));
+}
+
+static int LineOf(int offset) {
+    int lo = 0, hi = line_count;
+    if (line_count == 0) return 0;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (line_starts[mid] <= offset) lo = mid; else hi = mid;
+    }
+    return lo + 1;
+}
+
+static void EndSpan(const char* cat, const char* name, const char* detail,
+                    int line, int failed) {
+    Sample end;
+    char buf[512];
+
+    if (trace_fd < 0 || depth == 0) return;
+    if (--depth >= TRACE_MAX_DEPTH) return;
+    TakeSample(&end);
+
+    const Sample* start = &stack[depth];
+#define DELTA(f) ((end.io.f - start->io.f) - (end.self.f - start->self.f))
+
+    AppendString(first_event ? "\n" : ",\n");
+    first_event = 0;
+    AppendString("{\"name\":");
+    AppendJsonString(name, TRACE_DETAIL_MAX);
+    AppendString(",\"cat\":");
+    AppendJsonString(cat, TRACE_DETAIL_MAX);
+    snprintf(buf, sizeof(buf),
+             ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+             "\"args\":{\"cpu_us\":%lld",
+             trace_pid, trace_pid, start->wall_us,
+             end.wall_us - start->wall_us, end.cpu_us - start->cpu_us);
+    AppendString(buf);
+    if (io_fd >= 0) {
+        snprintf(buf, sizeof(buf),
+                 ",\"rchar\":%lld,\"wchar\":%lld,\"syscr\":%lld,"
+                 "\"syscw\":%lld,\"read_bytes\":%lld,\"write_bytes\":%lld",
+                 DELTA(rchar), DELTA(wchar), DELTA(syscr), DELTA(syscw),
+                 DELTA(read_bytes), DELTA(write_bytes));
+        AppendString(buf);
+    }
+    if (line > 0) {
+        snprintf(buf, sizeof(buf), ",\"line\":%d", line);
+        AppendString(buf);
+    }
+    if (failed) {
+        AppendString(",\"failed\":true");
+    }
+    if (detail != NULL) {
+        AppendString(",\"detail\":");
+        AppendJsonString(detail, TRACE_DETAIL_MAX);
+    }
+    AppendString("}}");
+#undef DELTA
+}
+
+void TraceBegin() {
+    if (trace_fd < 0) return;
+    if (depth < TRACE_MAX_DEPTH) {
+        TakeSample(&stack[depth]);
+    }
+    ++depth;
+}
+
+void TraceEnd(const char* cat, const char* name, const char* detail) {
+    EndSpan(cat, name, detail, 0, 0);
+}
+
+void TraceDiscard() {
+    if (trace_fd < 0 || depth == 0) return;
+    --depth;
+}
+
+int Tracing() {
+    return trace_fd >= 0;
+}
+
+// Operators are left out: only calls of registered functions, with
+// the first argument when it's a literal (usually the path the call
+// works on).
+void TraceCall(State* state, Expr* expr, int done, Value* result) {
+    if (trace_fd < 0 || FindFunction(expr->name) != expr->fn) return;
+    if (!done) {
+        TraceBegin();
+        return;
+    }
+    const char* detail = NULL;
+    if (expr->argc > 0 && expr->argv[0]->fn == Literal) {
+        detail = expr->argv[0]->name;
+    }
+    EndSpan("edify", expr->name, detail, LineOf(expr->start), result == NULL);
+}
+
+static void FinishTrace() {
+    if (trace_fd < 0) return;
+    AppendString("\n]\n");
+    FlushTrace();
+    close(trace_fd);
+    trace_fd = -1;
+    if (io_fd >= 0) close(io_fd);
+    io_fd = -1;
+}
+
+int StartTrace(const char* script) {
+    const char* path = getenv("UPDATE_PACKAGE_TRACE");
+    if (path == NULL || *path == '\0') return 0;
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "can't open trace %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    if (io_fd < 0) {
+        fprintf(stderr, "no /proc/self/io (%s); tracing time only\n",
+                strerror(errno));
+    }
+    trace_pid = getpid();
+
+    int i, n = 1;
+    for (i = 0; script[i] != '\0'; ++i) {
+        if (script[i] == '\n') ++n;
+    }
+    line_starts = malloc(n * sizeof(int));
+    if (line_starts != NULL) {
+        line_starts[line_count++] = 0;
+        for (i = 0; script[i] != '\0'; ++i) {
+            if (script[i] == '\n') line_starts[line_count++] = i + 1;
+        }
+    }
+
+    char buf[128];
+    snprintf(buf, sizeof(buf),
+             "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+             "\"args\":{\"name\":\"updater\"}}", trace_pid);
+    AppendString(buf);
+    first_event = 0;
+
+    atexit(FinishTrace);
+    fprintf(stderr, "tracing to %s\n", path);
+    return 1;
+}
@@ -0,0 +1,36 @@
+#ifndef _UPDATER_TRACE_H_
+#define _UPDATER_TRACE_H_
+
+// Install profiling.  When $UPDATE_PACKAGE_TRACE names a file, every
+// edify function the script calls, every entry package_extract_dir()
+// unpacks and every batch of permission changes is written there as a
+// Chrome trace event (load it in chrome://tracing or ui.perfetto.dev).
+// Each event carries its wall time and, in its args, the CPU time
+// (ours and that of children reaped meanwhile) and the I/O counters
+// from /proc/self/io: bytes read and written through syscalls
+// (rchar/wchar) and at the block layer (read_bytes/write_bytes), and
+// the number of read and write syscalls (syscr/syscw).  Counters don't
+// include the tracer's own reads and writes.
+
+#include "edify/expr.h"
+
+// Open the trace named by $UPDATE_PACKAGE_TRACE, if any, for calls
+// made while evaluating 'script'.  The trace is finished when the
+// process exits.  Returns nonzero if tracing.
+int StartTrace(const char* script);
+
+// The edify call hook that records calls; does nothing unless tracing.
+void TraceCall(State* state, Expr* expr, int done, Value* result);
+
+// Nonzero if StartTrace() turned tracing on.
+int Tracing();
+
+// Spans.  TraceBegin() starts one; TraceEnd() ends the innermost open
+// span and records it under 'cat' and 'name', with 'detail' (if not
+// NULL) in its args; TraceDiscard() ends it without recording it.
+// All of these do nothing unless tracing.
+void TraceBegin();
+void TraceEnd(const char* cat, const char* name, const char* detail);
+void TraceDiscard();
+
+#endif
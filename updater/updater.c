@@ -14,13 +14,19 @@
  * limitations under the License.
  */
 
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include "edify/expr.h"
+#include "mincrypt/sha.h"
 #include "updater.h"
 #include "install.h"
+#include "perms.h"
+#include "trace.h"
 #include "minzip/Zip.h"
 
 // Generated by the makefile, this function defines the
@@ -32,6 +38,103 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Recovery passes the fd of the package it has already mapped (and
+// verified) in $UPDATE_PACKAGE_FD.  Use that when it refers to the
+// same file as the path we were given, so we operate on the verified
+// bytes and don't open the package a second time; otherwise fall back
+// to opening the path.
+static int OpenPackage(const char* path, ZipArchive* za) {
+    const char* fd_str = getenv("UPDATE_PACKAGE_FD");
+    if (fd_str != NULL) {
+        int fd = atoi(fd_str);
+        struct stat fd_st, path_st;
+        unsetenv("UPDATE_PACKAGE_FD");
+        if (fd > 2 && fstat(fd, &fd_st) == 0 && S_ISREG(fd_st.st_mode) &&
+            stat(path, &path_st) == 0 &&
+            fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino) {
+            return mzOpenZipArchiveFd(fd, za);
+        }
+        fprintf(stderr, "ignoring UPDATE_PACKAGE_FD %s; reopening %s\n",
+                fd_str, path);
+    }
+    return mzOpenZipArchive(path, za);
+}
+
+// Queued set_perm changes (see perms.h) are applied before any
+// registered function runs that might look at or replace the files,
+// whichever file defines it.
+static void BeforeAndAfterCall(State* state, Expr* expr, int done, Value* result) {
+    if (!done && PendingPermissions() > 0 &&
+        FindFunction(expr->name) == expr->fn &&
+        !KeepsPermissionsQueued(expr->fn)) {
+        FlushPermissions();
+    }
+    TraceCall(state, expr, done, result);
+}
+
+// Compiled scripts are kept here, named by the SHA-1 of the script
+// text, so flashing the same package again skips the parser.
+#define SCRIPT_CACHE_DIR "/tmp"
+
+// Load the compiled form of 'script' from the cache, or parse it,
+// fold its constants and cache the result.  Returns NULL on a parse
+// error.
+static Expr* CompileScript(char* script, int script_len) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA(script, script_len, digest);
+
+    char cache_path[PATH_MAX];
+    int n = snprintf(cache_path, sizeof(cache_path),
+                     "%s/updater-script-", SCRIPT_CACHE_DIR);
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        n += snprintf(cache_path+n, sizeof(cache_path)-n, "%02x", digest[i]);
+    }
+
+    Expr* root = LoadCompiledExpr(cache_path);
+    if (root != NULL) {
+        fprintf(stderr, "using compiled script %s\n", cache_path);
+        return root;
+    }
+
+    int error_count = 0;
+    yy_scan_string(script);
+    int error = yyparse(&root, &error_count);
+    if (error != 0 || error_count > 0) {
+        fprintf(stderr, "%d parse errors\n", error_count);
+        return NULL;
+    }
+
+    root = OptimizeExpr(root);
+    SaveCompiledExpr(cache_path, root);
+    return root;
+}
+
+// How far ahead of the script the package may be read in.  Enough to
+// keep a slow sdcard busy while we inflate and write, without pushing
+// much else out of the page cache.
+#define PREFETCH_BUDGET (16 * 1024 * 1024)
+
+// Queue the package entries the script extracts for readahead, in the
+// order it will extract them: arguments are evaluated before the call
+// that uses them.  Only literal paths can be known in advance, and
+// both arms of an if are queued.
+static void PlanPrefetch(Expr* e, ZipArchive* za, Function extract_file,
+                         Function extract_dir) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        PlanPrefetch(e->argv[i], za, extract_file, extract_dir);
+    }
+    if (e->argc < 1 || e->argv[0]->fn != Literal) return;
+
+    if (e->fn == extract_file) {
+        const ZipEntry* entry = mzFindZipEntry(za, e->argv[0]->name);
+        if (entry != NULL) mzPrefetchZipEntry(za, entry);
+    } else if (e->fn == extract_dir) {
+        mzPrefetchZipDir(za, e->argv[0]->name);
+    }
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -66,12 +169,13 @@ int main(int argc, char** argv) {
     setenv("UPDATE_PACKAGE", package_data, 1);
     ZipArchive za;
     int err;
-    err = mzOpenZipArchive(package_data, &za);
+    err = OpenPackage(package_data, &za);
     if (err != 0) {
         fprintf(stderr, "failed to open package %s: %s\n",
                 package_data, strerror(err));
         return 3;
     }
+    za.strictCrc = getenv("UPDATE_PACKAGE_STRICT_CRC") != NULL;
 
     const ZipEntry* script_entry = mzFindZipEntry(&za, SCRIPT_NAME);
     if (script_entry == NULL) {
@@ -79,6 +183,10 @@ int main(int argc, char** argv) {
         return 4;
     }
 
+    if (mzGetZipEntryUncompLen(script_entry) > INT_MAX) {
+        fprintf(stderr, "%s is too large\n", SCRIPT_NAME);
+        return 5;
+    }
     char* script = malloc(script_entry->uncompLen+1);
     if (!mzReadZipEntry(&za, script_entry, script, script_entry->uncompLen)) {
         fprintf(stderr, "failed to read script from package\n");
@@ -95,15 +203,15 @@ int main(int argc, char** argv) {
 
     // Parse the script.
 
-    Expr* root;
-    int error_count = 0;
-    yy_scan_string(script);
-    int error = yyparse(&root, &error_count);
-    if (error != 0 || error_count > 0) {
-        fprintf(stderr, "%d parse errors\n", error_count);
+    Expr* root = CompileScript(script, script_entry->uncompLen);
+    if (root == NULL) {
         return 6;
     }
 
+    PlanPrefetch(root, &za, FindFunction("package_extract_file"),
+                 FindFunction("package_extract_dir"));
+    mzStartPrefetch(&za, PREFETCH_BUDGET);
+
     // Evaluate the parsed script.
 
     UpdaterInfo updater_info;
@@ -115,8 +223,15 @@ int main(int argc, char** argv) {
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
+    state.arena = NULL;
 
+    StartTrace(script);
+    SetCallHook(BeforeAndAfterCall);
+    TraceBegin();
     char* result = Evaluate(&state, root);
+    FreeArena(&state);
+    FlushPermissions();
+    TraceEnd("updater", "script", package_data);
 
     if (result == NULL) {
         if (state.errmsg == NULL) {
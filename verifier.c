@@ -21,25 +21,33 @@
 #include "mincrypt/sha.h"
 
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// Look for an RSA signature embedded in the .ZIP file comment given
-// the path to the zip.  Verify it matches one of the given public
-// keys.
-//
-// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
-// or no key matches the signature).
+#define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
 
-int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+// The most of the end of the file the footer checks ever look at: the
+// EOCD plus the longest possible comment.
+#define TAIL_SIZE (EOCD_HEADER_SIZE + 0xffff)
 
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
-        LOGE("failed to open %s (%s)\n", path, strerror(errno));
-        return VERIFY_FAILURE;
-    }
+// Hash in chunks so the progress bar keeps moving.
+#define CHUNK_SIZE (64*1024)
 
+// Check the signature footer and EOCD at the end of a package of the
+// given length.  tail holds the last tail_len bytes of the package,
+// where tail_len is the smaller of length and TAIL_SIZE.  On success,
+// *signed_len is how much of the package the signature covers and
+// *signature points at the RSA block within tail.
+static int check_footer(const unsigned char* tail, size_t tail_len,
+                        long long length, long long* signed_len,
+                        const unsigned char** signature) {
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -49,23 +57,14 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     // us how far back from the end we have to start reading to find
     // the whole comment.
 
-#define FOOTER_SIZE 6
-
-    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (length < FOOTER_SIZE) {
+        LOGE("package is too short to hold a signature\n");
         return VERIFY_FAILURE;
     }
 
-    unsigned char footer[FOOTER_SIZE];
-    if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
-        LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* footer = tail + tail_len - FOOTER_SIZE;
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -77,46 +76,30 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
-#define EOCD_HEADER_SIZE 22
-
     // The end-of-central-directory record is 22 bytes plus any
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
-    if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (length < (long long)eocd_size) {
+        LOGE("comment size doesn't fit in package\n");
         return VERIFY_FAILURE;
     }
+    const unsigned char* eocd = tail + tail_len - eocd_size;
 
     // Determine how much of the file is covered by the signature.
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = ftell(f) + EOCD_HEADER_SIZE - 2;
-
-    unsigned char* eocd = malloc(eocd_size);
-    if (eocd == NULL) {
-        LOGE("malloc for EOCD record failed\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-    if (fread(eocd, 1, eocd_size, f) != eocd_size) {
-        LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    *signed_len = (length - eocd_size) + EOCD_HEADER_SIZE - 2;
 
     // If this is really is the EOCD record, it will begin with the
     // magic number $50 $4b $05 $06.
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -129,56 +112,183 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
+    // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
+    // the signing tool appends after the signature itself.
+    *signature = eocd + eocd_size - 6 - RSANUMBYTES;
+    return VERIFY_SUCCESS;
+}
+
+static int check_signature(SHA_CTX* ctx, const unsigned char* signature,
+                           const RSAPublicKey *pKeys, unsigned int numKeys) {
+    const uint8_t* sha1 = SHA_final(ctx);
+    int i;
+    for (i = 0; i < numKeys; ++i) {
+        if (RSA_verify(pKeys+i, signature, RSANUMBYTES, sha1)) {
+            LOGI("whole-file signature verified\n");
+            return VERIFY_SUCCESS;
+        }
+    }
+    LOGE("failed to verify whole-file signature\n");
+    return VERIFY_FAILURE;
+}
+
+static void update_progress(long long so_far, long long signed_len,
+                            double* frac) {
+    double f = so_far / (double)signed_len;
+    if (f > *frac + 0.02 || so_far == signed_len) {
+        ui_set_progress(f);
+        *frac = f;
+    }
+}
 
+// Look for an RSA signature embedded in the .ZIP file comment of the
+// zip image at data[0..length).  Verify it matches one of the given
+// public keys.
+//
+// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
+// or no key matches the signature).
+
+int verify_data(const unsigned char* data, size_t length,
+                const RSAPublicKey *pKeys, unsigned int numKeys) {
+    ui_set_progress(0.0);
+
+    size_t tail_len = length < TAIL_SIZE ? length : TAIL_SIZE;
+    long long signed_len;
+    const unsigned char* signature;
+    if (check_footer(data + length - tail_len, tail_len, length,
+                     &signed_len, &signature) != VERIFY_SUCCESS) {
+        return VERIFY_FAILURE;
+    }
+
+    // Hash straight out of the caller's buffer.
     SHA_CTX ctx;
     SHA_init(&ctx);
-    unsigned char* buffer = malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
+
+    double frac = -1.0;
+    long long so_far = 0;
+    while (so_far < signed_len) {
+        size_t size = CHUNK_SIZE;
+        if (signed_len - so_far < size) size = signed_len - so_far;
+        SHA_update(&ctx, data + so_far, size);
+        so_far += size;
+        update_progress(so_far, signed_len, &frac);
+    }
+
+    return check_signature(&ctx, signature, pKeys, numKeys);
+}
+
+static int read_fully(int fd, unsigned char* buf, size_t len, long long off) {
+    while (len > 0) {
+        ssize_t n = pread64(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Same as verify_data(), but reads the package through fd, so it works
+// on packages too large to map.  fd's offset is left alone.
+
+int verify_fd(int fd, long long length,
+              const RSAPublicKey *pKeys, unsigned int numKeys) {
+    ui_set_progress(0.0);
+
+    if (length < FOOTER_SIZE) {
+        LOGE("package is too short to hold a signature\n");
         return VERIFY_FAILURE;
     }
 
+    size_t tail_len = length < TAIL_SIZE ? length : TAIL_SIZE;
+    unsigned char* tail = malloc(tail_len);
+    unsigned char* buf = malloc(CHUNK_SIZE);
+    int result = VERIFY_FAILURE;
+    if (tail == NULL || buf == NULL) {
+        LOGE("failed to allocate verification buffers\n");
+        goto done;
+    }
+    if (read_fully(fd, tail, tail_len, length - tail_len) != 0) {
+        LOGE("failed to read package footer (%s)\n", strerror(errno));
+        goto done;
+    }
+
+    long long signed_len;
+    const unsigned char* signature;
+    if (check_footer(tail, tail_len, length, &signed_len, &signature) !=
+        VERIFY_SUCCESS) {
+        goto done;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    // We read front to back; let the kernel read further ahead than it
+    // would by default, so the card stays busy while we hash.
+    posix_fadvise64(fd, 0, signed_len, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+
     double frac = -1.0;
-    size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
+    long long so_far = 0;
     while (so_far < signed_len) {
-        int size = BUFFER_SIZE;
+        size_t size = CHUNK_SIZE;
         if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
+        if (read_fully(fd, buf, size, so_far) != 0) {
+            LOGE("failed to read package (%s)\n", strerror(errno));
+            goto done;
         }
-        SHA_update(&ctx, buffer, size);
+        SHA_update(&ctx, buf, size);
         so_far += size;
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            ui_set_progress(f);
-            frac = f;
-        }
+        update_progress(so_far, signed_len, &frac);
     }
-    fclose(f);
-    free(buffer);
 
-    const uint8_t* sha1 = SHA_final(&ctx);
-    for (i = 0; i < numKeys; ++i) {
-        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
-        // the signing tool appends after the signature itself.
-        if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
-                       RSANUMBYTES, sha1)) {
-            LOGI("whole-file signature verified\n");
-            free(eocd);
-            return VERIFY_SUCCESS;
-        }
+    result = check_signature(&ctx, signature, pKeys, numKeys);
+
+done:
+    free(buf);
+    free(tail);
+    return result;
+}
+
+// Map the file at path and verify it with verify_data(), or read it
+// with verify_fd() if it is too big to map.
+
+int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
     }
-    free(eocd);
-    LOGE("failed to verify whole-file signature\n");
-    return VERIFY_FAILURE;
+
+    long long length = lseek64(fd, 0, SEEK_END);
+    if (length < 0) {
+        LOGE("failed to stat %s (%s)\n", path, strerror(errno));
+        close(fd);
+        return VERIFY_FAILURE;
+    }
+    if (length == 0) {
+        close(fd);
+        return VERIFY_FAILURE;
+    }
+
+    void* data = MAP_FAILED;
+    if ((unsigned long long)length <= SIZE_MAX) {
+        data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        int result = verify_fd(fd, length, pKeys, numKeys);
+        close(fd);
+        return result;
+    }
+    close(fd);
+
+    int result = verify_data(data, length, pKeys, numKeys);
+    munmap(data, length);
+    return result;
 }